@@ -0,0 +1,92 @@
+#include <array>
+
+#include "binary_copy.h"
+
+namespace {
+
+constexpr char copy_signature[] = "PGCOPY\n\377\r\n";
+
+constexpr uint8_t ambiguous = 4;
+constexpr uint8_t invalid = 5;
+
+// Codes of uppercased characters, matching the nucleotides accepted by nuclseq_in.
+constexpr std::array<uint8_t, 256> make_symbol_codes() {
+    std::array<uint8_t, 256> codes {};
+    for (auto& code : codes)
+        code = invalid;
+    codes['A'] = 0;
+    codes['C'] = 1;
+    codes['G'] = 2;
+    codes['T'] = 3;
+    for (char symbol : std::string_view("NWSMKRYBDHV"))
+        codes[static_cast<unsigned char>(symbol)] = ambiguous;
+    return codes;
+}
+
+constexpr auto symbol_codes = make_symbol_codes();
+
+void append_int16(std::string& out, uint16_t value) {
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+void append_int32(std::string& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out += static_cast<char>(value >> shift);
+}
+
+char to_upper(char chr) {
+    return chr >= 'a' && chr <= 'z' ? chr - 'a' + 'A' : chr;
+}
+
+}
+
+void CopyEncoder::append_header(std::string& out) {
+    out.append(copy_signature, sizeof(copy_signature));
+    append_int32(out, 0);
+    append_int32(out, 0);
+}
+
+void CopyEncoder::append_trailer(std::string& out) {
+    append_int16(out, 0xFFFF);
+}
+
+std::optional<char> CopyEncoder::append_row(std::string& out, std::string_view name, std::string_view sequence, std::optional<std::string_view> quality) {
+    holes.clear();
+    pac.assign((sequence.size() + 3) / 4, '\0');
+
+    for (size_t i = 0; i < sequence.size(); i++) {
+        char symbol = to_upper(sequence[i]);
+        uint8_t code = symbol_codes[static_cast<unsigned char>(symbol)];
+
+        if (code == invalid)
+            return sequence[i];
+        if (code == ambiguous) {
+            // Holes are maximal runs of one symbol, like the ones nuclseq_in produces and nuclseq_recv expects.
+            if (!holes.empty() && holes.back().symbol == symbol && holes.back().offset + holes.back().len == i)
+                holes.back().len++;
+            else
+                holes.push_back(Hole { static_cast<uint32_t>(i), 1, symbol });
+        } else {
+            pac[i >> 2] |= static_cast<char>(code << ((~i & 3) << 1));
+        }
+    }
+
+    append_int16(out, quality ? 3 : 2);
+    append_int32(out, name.size());
+    out += name;
+    append_int32(out, 8 + 9 * holes.size() + pac.size());
+    append_int32(out, sequence.size());
+    append_int32(out, holes.size());
+    for (const Hole& hole : holes) {
+        append_int32(out, hole.offset);
+        append_int32(out, hole.len);
+        out += hole.symbol;
+    }
+    out += pac;
+    if (quality) {
+        append_int32(out, quality->size());
+        out += *quality;
+    }
+    return std::nullopt;
+}
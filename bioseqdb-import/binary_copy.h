@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Encodes rows for COPY FROM STDIN in the binary format. Sequences are packed on the client into the binary format of
+// nuclseq, the same one nuclseq_recv reads, so the server neither parses nor validates individual characters.
+class CopyEncoder {
+public:
+    static void append_header(std::string& out);
+    static void append_trailer(std::string& out);
+
+    // Appends a row of a name, a sequence and optionally its quality string. Lowercase nucleotides are uppercased.
+    // Returns the first character that is not a nucleotide, in which case nothing is appended.
+    std::optional<char> append_row(std::string& out, std::string_view name, std::string_view sequence, std::optional<std::string_view> quality);
+
+private:
+    struct Hole {
+        uint32_t offset;
+        uint32_t len;
+        char symbol;
+    };
+
+    // Reused between rows, so that encoding does not allocate once buffers reach the size of the longest sequence.
+    std::vector<Hole> holes;
+    std::string pac;
+};
@@ -1,23 +1,121 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include <libpq-fe.h>
 
-void check_pg(PGconn* connection, PGresult* result) {
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        std::cerr << "\x1B[1;31merror:\x1B[0m postgres error\n\x1B[1;33mdetails:\x1B[0m\n" << PQerrorMessage(connection);
+#include "binary_copy.h"
+#include "queue.h"
+#include "sequence_reader.h"
+
+// Batches are sent to COPY as single messages, so they are limited both by records and by bases.
+constexpr size_t batch_max_records = 4096;
+constexpr size_t batch_max_bases = 16 << 20;
+
+// Each stage may run ahead of the next one by this many batches per thread.
+constexpr size_t queue_batches_per_thread = 2;
+
+struct ParsedBatch {
+    std::vector<SequenceRecord> records;
+};
+
+struct EncodedBatch {
+    std::string data;
+    size_t records;
+    size_t bases;
+};
+
+std::mutex error_mutex;
+
+[[noreturn]] void fail(std::string_view message, std::string_view details) {
+    std::lock_guard lock(error_mutex);
+    std::cerr << "\x1B[1;31merror:\x1B[0m " << message << "\n\x1B[1;33mdetails:\x1B[0m\n" << details;
+    std::exit(1);
+}
+
+void check_pg(PGconn* connection, PGresult* result, ExecStatusType expected) {
+    if (PQresultStatus(result) != expected) {
         PQclear(result);
-        std::exit(1);
+        fail("postgres error", PQerrorMessage(connection));
     }
     PQclear(result);
 }
 
+PGconn* connect(const char* postgres_url) {
+    PGconn* connection = PQconnectdb(postgres_url);
+    if (PQstatus(connection) != CONNECTION_OK)
+        fail("postgres error", PQerrorMessage(connection));
+    return connection;
+}
+
+// Fails early on mismatched columns, instead of after the first batch of sequences has been parsed and encoded.
+std::string column_type(PGconn* connection, std::string_view table, std::string_view column) {
+    const char* query =
+        "SELECT t.typname::text FROM pg_attribute a JOIN pg_type t ON t.oid = a.atttypid "
+        "WHERE a.attrelid = $1::regclass AND a.attname = $2 AND NOT a.attisdropped;";
+    std::string table_storage(table);
+    std::string column_storage(column);
+    const char* params[2] = {table_storage.c_str(), column_storage.c_str()};
+    PGresult* result = PQexecParams(connection, query, 2, nullptr, params, nullptr, nullptr, 0);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        PQclear(result);
+        fail("postgres error", PQerrorMessage(connection));
+    }
+    std::string type = PQntuples(result) == 1 ? PQgetvalue(result, 0, 0) : "";
+    PQclear(result);
+    if (type.empty())
+        fail("invalid column", "column '" + std::string(column) + "' does not exist in table '" + std::string(table) + "'\n");
+    return type;
+}
+
+void check_text_column(PGconn* connection, std::string_view table, std::string_view column) {
+    std::string type = column_type(connection, table, column);
+    if (type != "text" && type != "varchar")
+        fail("invalid column", "column '" + std::string(column) + "' has type " + type + ", expected text or varchar\n");
+}
+
+bool parse_count(const char* text, int& count) {
+    char* end;
+    long value = std::strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || value < 1 || value > 1024)
+        return false;
+    count = static_cast<int>(value);
+    return true;
+}
+
+void print_usage(const char* program) {
+    std::cerr << "\x1B[1;31merror:\x1B[0m invalid command-line arguments\n\x1B[1;34musage:\x1B[0m " << program << " [--threads N] [--connections N] [--quality-column COLUMN] <TABLE> <NAME COLUMN> <SEQUENCE COLUMN> <FASTA/FASTQ FILE>\n";
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        std::cerr << "\x1B[1;31merror:\x1B[0m invalid command-line arguments\n\x1B[1;34musage:\x1B[0m " << argv[0] << " <TABLE> <NAME COLUMN> <SEQUENCE COLUMN> <FASTA FILE>\n";
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int connections = 1;
+    std::optional<std::string_view> column_quality;
+    std::vector<const char*> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if ((arg == "--threads" || arg == "--connections") && i + 1 < argc) {
+            if (!parse_count(argv[++i], arg == "--threads" ? threads : connections)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--quality-column" && i + 1 < argc) {
+            column_quality = argv[++i];
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+    if (positional.size() != 4) {
+        print_usage(argv[0]);
         return 1;
     }
 
@@ -26,51 +124,121 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    std::string_view table = argv[1];
-    std::string_view column_name = argv[2];
-    std::string_view column_sequence = argv[3];
-    std::string_view fasta_file_path = argv[4];
-    std::string_view postgres_url = std::getenv("DB_URI");
+    std::string_view table = positional[0];
+    std::string_view column_name = positional[1];
+    std::string_view column_sequence = positional[2];
+    const char* sequence_file_path = positional[3];
+    const char* postgres_url = std::getenv("DB_URI");
 
-    std::cout << "opening fasta file" << std::endl;
-    std::ifstream fasta_file(fasta_file_path.data());
+    std::cout << "opening sequence file" << std::endl;
+    BGZF* sequence_file = bgzf_open(sequence_file_path, "r");
+    if (sequence_file == nullptr) {
+        std::cerr << "\x1B[1;31merror:\x1B[0m could not open sequence file \x1B[1;33mcaused by\x1B[0m " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    // Only BGZF splits the stream into independently compressed blocks, plain gzip is always inflated on this thread.
+    if (bgzf_compression(sequence_file) == 2 && bgzf_mt(sequence_file, threads, 256) != 0)
+        fail("could not start decompression threads", "\n");
+    SequenceReader reader(sequence_file);
+    if (column_quality && reader.format() != SequenceFormat::fastq)
+        fail("invalid command-line arguments", "quality column given, but the sequence file is not in fastq format\n");
 
     std::cout << "connecting to postgres instance" << std::endl;
-    PGconn* connection = PQconnectdb(postgres_url.data());
-    if (PQstatus(connection) != CONNECTION_OK) {
-        std::cerr << "\x1B[1;31merror:\x1B[0m postgres error \x1B[1;33mcaused by\x1B[0m " << PQerrorMessage(connection) << "\n";
-        PQfinish(connection);
-        return 1;
+    std::vector<PGconn*> writer_connections;
+    for (int i = 0; i < connections; i++)
+        writer_connections.push_back(connect(postgres_url));
+
+    check_text_column(writer_connections[0], table, column_name);
+    if (column_quality)
+        check_text_column(writer_connections[0], table, *column_quality);
+    std::string sequence_type = column_type(writer_connections[0], table, column_sequence);
+    if (sequence_type != "nuclseq")
+        fail("invalid column", "column '" + std::string(column_sequence) + "' has type " + sequence_type + ", expected nuclseq\n");
+
+    BlockingQueue<ParsedBatch> parsed(queue_batches_per_thread * threads);
+    BlockingQueue<EncodedBatch> encoded(queue_batches_per_thread * connections);
+
+    // Rows may reach the table in a different order than in the file, as batches are encoded and sent concurrently.
+    std::atomic<int> encoders_running = threads;
+    std::vector<std::thread> encoders;
+    for (int i = 0; i < threads; i++) {
+        encoders.emplace_back([&]{
+            CopyEncoder encoder;
+            while (std::optional<ParsedBatch> batch = parsed.pop()) {
+                EncodedBatch out {std::string(), batch->records.size(), 0};
+                for (const SequenceRecord& record : batch->records) {
+                    std::optional<std::string_view> quality;
+                    if (column_quality)
+                        quality = record.quality;
+                    if (std::optional<char> invalid = encoder.append_row(out.data, record.name, record.sequence, quality))
+                        fail("invalid sequence file", "sequence '" + record.name + "' contains invalid nucleotide '" + *invalid + "'\n");
+                    out.bases += record.sequence.size();
+                }
+                encoded.push(std::move(out));
+            }
+            if (--encoders_running == 0)
+                encoded.close();
+        });
     }
 
-    check_pg(connection, PQexec(connection, "BEGIN;"));
-
-    std::string current_name;
-    std::string current_sequence;
-    std::string current_line;
-    std::string insert_query = std::string("INSERT INTO ") + table.data() + "(" + column_name.data() + ", " + column_sequence.data() + ") VALUES ($1, $2);";
-    auto try_submit_sequence = [&]{
-        if (current_sequence.length() > 0) {
-            std::cout << "inserting sequence '" << current_name << "' [" << current_sequence.length() << " bytes]\n";
-            const char* params[2] = {current_name.c_str(), current_sequence.c_str()};
-            check_pg(connection, PQexecParams(connection, insert_query.c_str(), 2, nullptr, params, nullptr, nullptr, 1));
-            current_sequence.clear();
-        }
-        current_name.clear();
-    };
-    while (std::getline(fasta_file, current_line)) {
-        if (!current_line.empty() && current_line[0] == '>') {
-            try_submit_sequence();
-            current_name = current_line.substr(1);
-        } else {
-            for (char& chr : current_line)
-                chr = (char) std::toupper(chr);
-            current_sequence += current_line;
+    std::string copy_columns = std::string(column_name) + ", " + std::string(column_sequence);
+    if (column_quality)
+        copy_columns += ", " + std::string(*column_quality);
+    std::string copy_query = std::string("COPY ") + table.data() + "(" + copy_columns + ") FROM STDIN WITH (FORMAT binary);";
+    std::atomic<size_t> total_records = 0;
+    std::atomic<size_t> total_bases = 0;
+    std::vector<std::thread> writers;
+    for (PGconn* connection : writer_connections) {
+        writers.emplace_back([&, connection]{
+            check_pg(connection, PQexec(connection, copy_query.c_str()), PGRES_COPY_IN);
+            auto put = [&](const std::string& data) {
+                if (PQputCopyData(connection, data.data(), static_cast<int>(data.size())) != 1)
+                    fail("postgres error", PQerrorMessage(connection));
+            };
+
+            std::string framing;
+            CopyEncoder::append_header(framing);
+            put(framing);
+            while (std::optional<EncodedBatch> batch = encoded.pop()) {
+                put(batch->data);
+                total_records += batch->records;
+                total_bases += batch->bases;
+            }
+            framing.clear();
+            CopyEncoder::append_trailer(framing);
+            put(framing);
+
+            if (PQputCopyEnd(connection, nullptr) != 1)
+                fail("postgres error", PQerrorMessage(connection));
+            check_pg(connection, PQgetResult(connection), PGRES_COMMAND_OK);
+        });
+    }
+
+    ParsedBatch batch;
+    size_t batch_bases = 0;
+    SequenceRecord record;
+    while (reader.next(record)) {
+        batch_bases += record.sequence.size();
+        batch.records.push_back(std::move(record));
+        if (batch.records.size() == batch_max_records || batch_bases >= batch_max_bases) {
+            parsed.push(std::move(batch));
+            batch = ParsedBatch();
+            batch_bases = 0;
         }
     }
-    try_submit_sequence();
+    if (!batch.records.empty())
+        parsed.push(std::move(batch));
+    if (reader.error())
+        fail("invalid sequence file", *reader.error() + "\n");
+    parsed.close();
+    bgzf_close(sequence_file);
 
-    check_pg(connection, PQexec(connection, "COMMIT;"));
+    for (std::thread& encoder : encoders)
+        encoder.join();
+    for (std::thread& writer : writers)
+        writer.join();
+    for (PGconn* connection : writer_connections)
+        PQfinish(connection);
 
-    PQfinish(connection);
+    std::cout << "inserted " << total_records << " sequences [" << total_bases << " bytes]" << std::endl;
 }
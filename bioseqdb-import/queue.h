@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Bounded queue connecting the stages of the import pipeline. Producers wait while it is full, so a slow stage holds
+// back the ones before it instead of buffering the whole input. Once closed and drained, pop returns nothing.
+template<typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity): capacity(capacity), closed(false) {}
+
+    void push(T item) {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [&]{ return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock lock(mutex);
+        not_empty.wait(lock, [&]{ return !items.empty() || closed; });
+        if (items.empty())
+            return std::nullopt;
+        T item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+    void close() {
+        std::lock_guard lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
@@ -0,0 +1,124 @@
+#include <cstring>
+
+#include "sequence_reader.h"
+
+namespace {
+
+constexpr size_t initial_buffer_size = 16 << 20;
+
+}
+
+LineReader::LineReader(BGZF* file): file(file), buffer(initial_buffer_size), begin(0), end(0), eof(false), error(false) {}
+
+bool LineReader::next_line(std::string_view& line) {
+    while (true) {
+        auto newline = static_cast<const char*>(memchr(buffer.data() + begin, '\n', end - begin));
+        if (newline != nullptr || (eof && begin < end)) {
+            size_t line_end = newline != nullptr ? newline - buffer.data() : end;
+            line = std::string_view(buffer.data() + begin, line_end - begin);
+            begin = newline != nullptr ? line_end + 1 : end;
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            return true;
+        }
+        if (eof)
+            return false;
+        refill();
+    }
+}
+
+std::optional<char> LineReader::peek() {
+    while (begin == end && !eof)
+        refill();
+    if (begin == end)
+        return std::nullopt;
+    return buffer[begin];
+}
+
+// Read errors end the input like end of file does, so callers should check failed afterwards.
+void LineReader::refill() {
+    if (begin > 0) {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    if (end == buffer.size())
+        buffer.resize(buffer.size() * 2);
+
+    ssize_t read = bgzf_read(file, buffer.data() + end, buffer.size() - end);
+    if (read > 0)
+        end += read;
+    else
+        eof = true;
+    if (read < 0)
+        error = true;
+}
+
+SequenceReader::SequenceReader(BGZF* file): lines(file), next_name(), has_next(true) {
+    detected_format = lines.peek() == '@' ? SequenceFormat::fastq : SequenceFormat::fasta;
+}
+
+bool SequenceReader::next(SequenceRecord& record) {
+    bool found = detected_format == SequenceFormat::fastq ? next_fastq(record) : next_fasta(record);
+    if (!found && lines.failed() && !error_message)
+        return fail("could not decompress or read the file");
+    return found;
+}
+
+bool SequenceReader::next_fasta(SequenceRecord& record) {
+    std::string_view line;
+    while (has_next) {
+        record.name = std::move(next_name);
+        record.sequence.clear();
+        has_next = false;
+
+        while (lines.next_line(line)) {
+            if (!line.empty() && line[0] == '>') {
+                next_name = line.substr(1);
+                has_next = true;
+                break;
+            }
+            record.sequence += line;
+        }
+
+        if (!record.sequence.empty())
+            return true;
+    }
+    return false;
+}
+
+// Sequence and quality may be wrapped over multiple lines. The quality is read until it is as long as the sequence, as
+// its lines may themselves start with '@' or '+'.
+bool SequenceReader::next_fastq(SequenceRecord& record) {
+    std::string_view line;
+    do {
+        if (!lines.next_line(line))
+            return false;
+    } while (line.empty());
+    if (line[0] != '@')
+        return fail("expected '@' at the start of a fastq record, found '" + std::string(line.substr(0, 16)) + "'");
+
+    record.name = line.substr(1);
+    record.sequence.clear();
+    record.quality.clear();
+    while (true) {
+        if (!lines.next_line(line))
+            return fail("unexpected end of file in fastq record '" + record.name + "'");
+        if (!line.empty() && line[0] == '+')
+            break;
+        record.sequence += line;
+    }
+    while (record.quality.size() < record.sequence.size()) {
+        if (!lines.next_line(line))
+            return fail("unexpected end of file in fastq record '" + record.name + "'");
+        record.quality += line;
+    }
+    if (record.quality.size() != record.sequence.size())
+        return fail("quality of fastq record '" + record.name + "' is longer than its sequence");
+    return true;
+}
+
+bool SequenceReader::fail(std::string message) {
+    error_message = std::move(message);
+    return false;
+}
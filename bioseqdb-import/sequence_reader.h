@@ -0,0 +1,70 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <htslib/htslib/bgzf.h>
+
+struct SequenceRecord {
+    std::string name;
+    std::string sequence;
+    // Empty for FASTA records.
+    std::string quality;
+};
+
+enum class SequenceFormat {
+    fasta,
+    fastq,
+};
+
+// Splits a file into lines through one large buffer, which grows only if a single line does not fit. Files are read
+// through BGZF, which also handles plain gzip and uncompressed files.
+class LineReader {
+public:
+    explicit LineReader(BGZF* file);
+
+    // Returns the next line without its terminator. The line stays valid until the next call.
+    bool next_line(std::string_view& line);
+
+    // Returns the first character of the remaining input without consuming it.
+    std::optional<char> peek();
+
+    bool failed() const { return error; }
+
+private:
+    void refill();
+
+    BGZF* file;
+    std::vector<char> buffer;
+    size_t begin;
+    size_t end;
+    bool eof;
+    bool error;
+};
+
+// Reads FASTA or FASTQ records as they are, leaving validation and uppercasing to the encoders. The format is detected
+// from the first character of the file. FASTA records without any sequence lines are skipped.
+class SequenceReader {
+public:
+    explicit SequenceReader(BGZF* file);
+
+    SequenceFormat format() const { return detected_format; }
+
+    // Returns false at the end of input, and also on errors, which are then described by error.
+    bool next(SequenceRecord& record);
+
+    const std::optional<std::string>& error() const { return error_message; }
+
+private:
+    bool next_fasta(SequenceRecord& record);
+    bool next_fastq(SequenceRecord& record);
+    bool fail(std::string message);
+
+    LineReader lines;
+    SequenceFormat detected_format;
+    std::string next_name;
+    bool has_next;
+    std::optional<std::string> error_message;
+};
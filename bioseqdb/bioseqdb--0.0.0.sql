@@ -3,55 +3,68 @@ CREATE TYPE NUCLSEQ;
 CREATE FUNCTION nuclseq_in(CSTRING)
     RETURNS NUCLSEQ
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_out(NUCLSEQ)
     RETURNS CSTRING
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE FUNCTION nuclseq_recv(INTERNAL)
+    RETURNS NUCLSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_send(NUCLSEQ)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Packed sequences barely compress, and uncompressed values can be read in slices by nuclseq_substring.
 CREATE TYPE nuclseq (
     internallength = VARIABLE,
-    storage = EXTENDED,
+    storage = EXTERNAL,
 	alignment = double,
     input = nuclseq_in,
-    output = nuclseq_out
+    output = nuclseq_out,
+    receive = nuclseq_recv,
+    send = nuclseq_send
 );
 
 CREATE FUNCTION nuclseq_eq(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_ne(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_lt(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_le(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_gt(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_ge(NUCLSEQ, NUCLSEQ)
     RETURNS BOOLEAN
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_cmp(NUCLSEQ, NUCLSEQ)
     RETURNS INTEGER
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE OPERATOR = (
     LEFTARG = NUCLSEQ,
@@ -114,6 +127,11 @@ CREATE OPERATOR >= (
     JOIN = scalargtjoinsel
 );
 
+CREATE FUNCTION nuclseq_sortsupport(INTERNAL)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE OPERATOR CLASS nuclseq_btree_operators
     DEFAULT FOR TYPE NUCLSEQ
     USING btree
@@ -123,39 +141,120 @@ CREATE OPERATOR CLASS nuclseq_btree_operators
         OPERATOR 3 =,
         OPERATOR 4 >=,
         OPERATOR 5 >,
-        FUNCTION 1 nuclseq_cmp(NUCLSEQ, NUCLSEQ);
+        FUNCTION 1 nuclseq_cmp(NUCLSEQ, NUCLSEQ),
+        FUNCTION 2 nuclseq_sortsupport(INTERNAL);
 
 CREATE FUNCTION nuclseq_hash(NUCLSEQ)
     RETURNS INTEGER
-    AS 'hashvarlena'
-    LANGUAGE INTERNAL IMMUTABLE;
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_hash_extended(NUCLSEQ, BIGINT)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE OPERATOR CLASS nuclseq_hash_operators
     DEFAULT FOR TYPE NUCLSEQ
     USING hash
     AS
         OPERATOR 1 =,
-        FUNCTION 1 nuclseq_hash(NUCLSEQ);
+        FUNCTION 1 nuclseq_hash(NUCLSEQ),
+        FUNCTION 2 nuclseq_hash_extended(NUCLSEQ, BIGINT);
 
 CREATE FUNCTION nuclseq_len(NUCLSEQ)
     RETURNS INTEGER
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_content(NUCLSEQ, CSTRING)
     RETURNS DOUBLE PRECISION
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_complement(NUCLSEQ)
     RETURNS NUCLSEQ
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION nuclseq_reverse(NUCLSEQ)
     RETURNS NUCLSEQ
     AS 'MODULE_PATHNAME'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_substring(NUCLSEQ, INTEGER, INTEGER)
+    RETURNS NUCLSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_substring(NUCLSEQ, INTEGER)
+    RETURNS NUCLSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_position(NUCLSEQ, NUCLSEQ)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_contains(NUCLSEQ, NUCLSEQ)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+    LEFTARG = NUCLSEQ,
+    RIGHTARG = NUCLSEQ,
+    PROCEDURE = nuclseq_contains,
+    RESTRICT = contsel,
+    JOIN = contjoinsel
+);
+
+CREATE FUNCTION nuclseq_kmer_similarity(NUCLSEQ, NUCLSEQ)
+    RETURNS DOUBLE PRECISION
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_kmer_similar(NUCLSEQ, NUCLSEQ)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR % (
+    LEFTARG = NUCLSEQ,
+    RIGHTARG = NUCLSEQ,
+    PROCEDURE = nuclseq_kmer_similar,
+    COMMUTATOR = '%',
+    RESTRICT = contsel,
+    JOIN = contjoinsel
+);
+
+CREATE FUNCTION nuclseq_gin_extract_value(NUCLSEQ, INTERNAL, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_gin_extract_query(NUCLSEQ, INTERNAL, INT2, INTERNAL, INTERNAL, INTERNAL, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_gin_consistent(INTERNAL, INT2, NUCLSEQ, INTEGER, INTERNAL, INTERNAL, INTERNAL, INTERNAL)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS nuclseq_gin_kmer_operators
+    FOR TYPE NUCLSEQ
+    USING gin
+    AS
+        OPERATOR 1 @>,
+        OPERATOR 2 %,
+        FUNCTION 1 btint4cmp(INTEGER, INTEGER),
+        FUNCTION 2 nuclseq_gin_extract_value(NUCLSEQ, INTERNAL, INTERNAL),
+        FUNCTION 3 nuclseq_gin_extract_query(NUCLSEQ, INTERNAL, INT2, INTERNAL, INTERNAL, INTERNAL, INTERNAL),
+        FUNCTION 4 nuclseq_gin_consistent(INTERNAL, INT2, NUCLSEQ, INTEGER, INTERNAL, INTERNAL, INTERNAL, INTERNAL),
+        STORAGE INTEGER;
 
 CREATE TYPE bwa_options AS (
 	min_seed_len INTEGER,
@@ -169,7 +268,8 @@ CREATE TYPE bwa_options AS (
 	o_del INTEGER,
 	e_del INTEGER,
 	o_ins INTEGER,
-	e_ins INTEGER
+	e_ins INTEGER,
+	threads INTEGER
 );
 
 CREATE FUNCTION bwa_opts(
@@ -184,14 +284,16 @@ CREATE FUNCTION bwa_opts(
 	o_del INTEGER DEFAULT 6,
 	o_ins INTEGER DEFAULT 6,
 	e_del INTEGER DEFAULT 1,
-	e_ins INTEGER DEFAULT 1
+	e_ins INTEGER DEFAULT 1,
+	threads INTEGER DEFAULT 1
 ) RETURNS bwa_options AS $$ 
 	SELECT ROW(
 		min_seed_len, max_occ, match_score, mismatch_penalty,
 		pen_clip3, pen_clip5, zdrop, bandwidth,
-		o_del, o_ins, e_del, e_ins
+		o_del, e_del, o_ins, e_ins,
+		threads
 	) as opts
-$$ LANGUAGE SQL IMMUTABLE;
+$$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
 
 CREATE TYPE bwa_result AS (
     ref_id BIGINT,
@@ -211,12 +313,214 @@ CREATE TYPE bwa_result AS (
     score INTEGER
 );
 
+-- Results of paired searches, one row per hit of either mate. The hits forming the chosen proper pair have
+-- is_proper_pair set, along with the length of the fragment they span.
+CREATE TYPE bwa_paired_result AS (
+    ref_id BIGINT,
+    ref_subseq NUCLSEQ,
+    ref_match_start INTEGER,
+    ref_match_end INTEGER,
+    ref_match_len INTEGER,
+    query_id BIGINT,
+    query_subseq NUCLSEQ,
+    query_match_start INTEGER,
+    query_match_end INTEGER,
+    query_match_len INTEGER,
+    is_primary BOOLEAN,
+    is_secondary BOOLEAN,
+    is_reverse BOOLEAN,
+    cigar TEXT,
+    score INTEGER,
+    mate INTEGER,
+    is_proper_pair BOOLEAN,
+    insert_size BIGINT
+);
+
+-- Local alignment of a query and a target, with the ends of both as [start, end) and clipped ends of the query shown as
+-- soft clips in the CIGAR.
+CREATE TYPE sw_alignment AS (
+    score INTEGER,
+    cigar TEXT,
+    query_match_start INTEGER,
+    query_match_end INTEGER,
+    target_match_start INTEGER,
+    target_match_end INTEGER
+);
+
+CREATE FUNCTION nuclseq_align_sw(query_sequence NUCLSEQ, target_sequence NUCLSEQ, opts bwa_options DEFAULT bwa_opts())
+    RETURNS sw_alignment
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_search_sw(query_sequence NUCLSEQ, target_sql CSTRING, opts bwa_options DEFAULT bwa_opts())
+    RETURNS TABLE (target_id BIGINT, score INTEGER, cigar TEXT, query_match_start INTEGER, query_match_end INTEGER,
+        target_match_start INTEGER, target_match_end INTEGER)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
 CREATE FUNCTION nuclseq_search_bwa(query_sequence NUCLSEQ, reference_sql CSTRING, opts bwa_options DEFAULT bwa_opts())
     RETURNS SETOF bwa_result
     AS 'MODULE_PATHNAME'
-    LANGUAGE C STABLE STRICT;
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
 
 CREATE FUNCTION nuclseq_multi_search_bwa(query_sql CSTRING, reference_sql CSTRING, opts bwa_options DEFAULT bwa_opts())
     RETURNS SETOF bwa_result
     AS 'MODULE_PATHNAME'
-    LANGUAGE C STABLE STRICT;
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION bwa_index_create(index_name TEXT, reference_sql CSTRING, sa_interval INTEGER DEFAULT 32, threads INTEGER DEFAULT 0,
+        shard_bases BIGINT DEFAULT 0)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+-- Builds submitted with bwa_index_create_async, run by background workers as the submitting role, which needs to
+-- update its rows. Finished rows are kept for the bwa_index_builds view until deleted.
+CREATE TABLE bwa_index_build_queue (
+    build_id BIGSERIAL PRIMARY KEY,
+    kind TEXT NOT NULL DEFAULT 'create' CHECK (kind IN ('create', 'merge')),
+    index_name TEXT NOT NULL,
+    -- Merges take the references and the suffix array interval from the index.
+    reference_sql TEXT CHECK ((kind = 'create') = (reference_sql IS NOT NULL)),
+    sa_interval INTEGER CHECK ((kind = 'create') = (sa_interval IS NOT NULL)),
+    threads INTEGER NOT NULL,
+    shard_bases BIGINT NOT NULL DEFAULT 0,
+    status TEXT NOT NULL DEFAULT 'queued' CHECK (status IN ('queued', 'running', 'done', 'failed', 'cancelled')),
+    submitted_by REGROLE NOT NULL DEFAULT current_user::REGROLE,
+    submitted_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    started_at TIMESTAMPTZ,
+    finished_at TIMESTAMPTZ,
+    sequences BIGINT,
+    bases BIGINT,
+    error TEXT
+);
+
+-- Workers run the reference query of a row as the role that submitted it, so only members of that role may change or
+-- delete the row, and only the columns tracking its progress ever change.
+ALTER TABLE bwa_index_build_queue ENABLE ROW LEVEL SECURITY;
+CREATE POLICY bwa_index_build_queue_visible ON bwa_index_build_queue FOR SELECT USING (true);
+CREATE POLICY bwa_index_build_queue_submitter ON bwa_index_build_queue
+    USING (pg_has_role(submitted_by, 'MEMBER')) WITH CHECK (pg_has_role(submitted_by, 'MEMBER'));
+
+GRANT SELECT, INSERT, DELETE ON bwa_index_build_queue TO PUBLIC;
+GRANT UPDATE (status, started_at, finished_at, sequences, bases, error) ON bwa_index_build_queue TO PUBLIC;
+GRANT USAGE ON SEQUENCE bwa_index_build_queue_build_id_seq TO PUBLIC;
+
+CREATE FUNCTION bwa_index_create_async(index_name TEXT, reference_sql CSTRING, sa_interval INTEGER DEFAULT 32, threads INTEGER DEFAULT 0,
+        shard_bases BIGINT DEFAULT 0)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_build_cancel(build_id BIGINT)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_append(index_name TEXT, reference_sql CSTRING, threads INTEGER DEFAULT 0)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_merge(index_name TEXT, threads INTEGER DEFAULT 0, shard_bases BIGINT DEFAULT 0)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_merge_async(index_name TEXT, threads INTEGER DEFAULT 0, shard_bases BIGINT DEFAULT 0)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_drop(index_name TEXT)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+-- Index files are kept in the data directory and shared by every database and role, so only roles granted these
+-- functions may create, replace or remove them.
+REVOKE EXECUTE ON FUNCTION
+    bwa_index_create(TEXT, CSTRING, INTEGER, INTEGER, BIGINT),
+    bwa_index_create_async(TEXT, CSTRING, INTEGER, INTEGER, BIGINT),
+    bwa_index_append(TEXT, CSTRING, INTEGER),
+    bwa_index_merge(TEXT, INTEGER, BIGINT),
+    bwa_index_merge_async(TEXT, INTEGER, BIGINT),
+    bwa_index_drop(TEXT)
+FROM PUBLIC;
+
+CREATE FUNCTION bwa_index_segments(index_name TEXT)
+    RETURNS TABLE (segment BIGINT, sequences BIGINT, size_bytes BIGINT, max_ref_id BIGINT, shard INTEGER)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+-- Searches of separate queries share nothing but the mapped index, so they can run in parallel workers when the
+-- queries come from a table scanned in parallel.
+CREATE FUNCTION nuclseq_search_bwa_index(query_sequence NUCLSEQ, index_name TEXT, opts bwa_options DEFAULT bwa_opts())
+    RETURNS SETOF bwa_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_search_exact_bwa_index(query_sequence NUCLSEQ, index_name TEXT, max_mismatches INTEGER DEFAULT 0, max_hits INTEGER DEFAULT 100)
+    RETURNS TABLE (ref_id BIGINT, ref_match_start INTEGER, is_reverse BOOLEAN, mismatches INTEGER)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nuclseq_multi_search_bwa_index(query_sql CSTRING, index_name TEXT, opts bwa_options DEFAULT bwa_opts())
+    RETURNS SETOF bwa_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+-- Queries are (id, first mate, second mate) rows.
+CREATE FUNCTION nuclseq_multi_search_bwa_paired(query_sql CSTRING, reference_sql CSTRING, opts bwa_options DEFAULT bwa_opts())
+    RETURNS SETOF bwa_paired_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION nuclseq_multi_search_bwa_paired_index(query_sql CSTRING, index_name TEXT, opts bwa_options DEFAULT bwa_opts())
+    RETURNS SETOF bwa_paired_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION nuclseq_sam_bwa_index(query_sql CSTRING, index_name TEXT, opts bwa_options DEFAULT bwa_opts())
+    RETURNS SETOF TEXT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION nuclseq_export_bwa_index(query_sql CSTRING, index_name TEXT, path TEXT, format TEXT DEFAULT 'bam', opts bwa_options DEFAULT bwa_opts())
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION bwa_index_cache()
+    RETURNS TABLE (index_name TEXT, size_bytes BIGINT, backends INTEGER, mapped_here BOOLEAN, last_used TIMESTAMPTZ)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE VIEW bwa_index_cache AS SELECT * FROM bwa_index_cache();
+
+CREATE FUNCTION bwa_index_build_progress()
+    RETURNS TABLE (build_id BIGINT, pid INTEGER, phase TEXT, sequences BIGINT, bases BIGINT, phase_started TIMESTAMPTZ)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+-- Builds left queued or running by a server restart have no progress and are shown as interrupted. The estimated time
+-- of finishing is extrapolated from the time per base of the last builds, once the number of bases is known.
+CREATE VIEW bwa_index_builds AS
+    SELECT q.build_id, q.kind, q.index_name,
+        CASE WHEN q.status IN ('queued', 'running') AND p.build_id IS NULL THEN 'interrupted' ELSE q.status END AS status,
+        p.phase, p.pid,
+        coalesce(p.sequences, q.sequences) AS sequences,
+        coalesce(p.bases, q.bases) AS bases,
+        q.submitted_by, q.submitted_at, q.started_at, p.phase_started, q.finished_at,
+        CASE WHEN p.phase NOT IN ('queued', 'reading references')
+            THEN q.started_at + p.bases * rate.seconds_per_base * INTERVAL '1 second' END AS estimated_finish,
+        q.error
+    FROM bwa_index_build_queue q
+    LEFT JOIN bwa_index_build_progress() p ON p.build_id = q.build_id
+    CROSS JOIN (
+        SELECT (sum(extract(EPOCH FROM finished_at - started_at)) / nullif(sum(bases), 0))::DOUBLE PRECISION AS seconds_per_base
+        FROM (
+            SELECT started_at, finished_at, bases FROM bwa_index_build_queue
+            WHERE status = 'done' ORDER BY finished_at DESC LIMIT 10
+        ) recent
+    ) rate;
@@ -1,83 +1,326 @@
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <cstring>
 #include <cstdint>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <htslib/htslib/sam.h>
 extern "C" {
+#include <bwa/bwamem.h>
 #include <bwa/bwt.h>
-// Internal libbwa symbol, not exported through any of the headers.
+#include <bwa/ksw.h>
+#include <miscadmin.h>
+#include <storage/fd.h>
+// Internal libbwa symbols, not exported through any of the headers. mem_align1 is a wrapper around mem_align1_core and
+// mem_mark_primary_se, which copies the query and allocates new seeding buffers on every call. mem_matesw is the mate
+// rescue step of paired-end alignment.
 int is_bwt(ubyte_t *T, int n);
+mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf);
+int mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
+int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma);
 }
 
 #include "bwa.h"
+#include "parallel.h"
 #include "sequence.h"
 
 #define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
 
 inline namespace {
+    // Tables turning one packed byte into its four bases, one byte each, in memory order. The reverse complement table
+    // holds complemented bases in reverse order, which is where they land on the reverse strand.
+    constexpr std::array<std::array<ubyte_t, 4>, 256> make_expansion_table(bool reverse_complement) {
+        std::array<std::array<ubyte_t, 4>, 256> table {};
+        for (int byte = 0; byte < 256; byte++) {
+            for (int i = 0; i < 4; i++) {
+                ubyte_t base = byte >> ((3 - i) << 1) & 3;
+                if (reverse_complement)
+                    table[byte][3 - i] = 3 - base;
+                else
+                    table[byte][i] = base;
+            }
+        }
+        return table;
+    }
+
+    constexpr auto forward_expansion = make_expansion_table(false);
+    constexpr auto reverse_complement_expansion = make_expansion_table(true);
+
+    // Work is split into chunks big enough to keep the shared counter of parallel_for out of the profile.
+    constexpr size_t pac2bwt_chunk_bytes = 1 << 20;
+    constexpr size_t pack_chunk_words = 1 << 18;
+
+    // Like bwa index, references longer than this are indexed with the incremental construction of libbwa instead of
+    // expanding both strands into memory.
+    constexpr size_t bwtgen_min_bases = 50000000;
+
+    constexpr size_t bwtgen_chunk_bytes = 1 << 20;
+
+    // Packed bytes of the reverse complement, with complemented bases in reverse order.
+    constexpr std::array<ubyte_t, 256> make_reverse_complement_bytes() {
+        std::array<ubyte_t, 256> table {};
+        for (int byte = 0; byte < 256; byte++)
+            for (int i = 0; i < 4; i++)
+                table[byte] |= (3 - (byte >> (i << 1) & 3)) << ((3 - i) << 1);
+        return table;
+    }
+
+    constexpr auto reverse_complement_bytes = make_reverse_complement_bytes();
+
     // Modifined version of original bwa implementaion adjusted to our requirements.
-    bwt_t* pac2bwt(const std::vector<ubyte_t>& pac_forward) {
+    bwt_t* pac2bwt(const std::vector<ubyte_t>& pac_forward, int threads) {
         const ubyte_t* pac = pac_forward.data();
-        size_t pac_len = pac_forward.size() * 4;
+        size_t pac_bytes = pac_forward.size();
+        size_t pac_len = pac_bytes * 4;
+
+        // The suffix array construction in libbwa indexes the text with 32-bit integers.
+        if (pac_len * 2 >= INT_MAX)
+            raise_pg_error(ERRCODE_PROGRAM_LIMIT_EXCEEDED, errmsg("reference of %zu bases is too large to index", pac_len));
 
+        size_t seq_len = pac_len * 2;
+        size_t bwt_size = (seq_len + 15) >> 4;
         // Calloc here is needed.
         bwt_t* bwt = (bwt_t*) calloc(1, sizeof(bwt_t));
-        bwt->seq_len = pac_len * 2;
-        bwt->bwt_size = (bwt->seq_len + 15) >> 4;
-
-        ubyte_t* buf = (ubyte_t*) malloc(bwt->seq_len + 1);
-        buf[bwt->seq_len] = 0;
-
-        // TODO: optimize
-        // Forward
-        for (size_t i = 0; i < pac_len ; i++) {
-            buf[i] = pac_raw_get(pac, i);
-            bwt->L2[1 + buf[i]]++;
-            bwt->L2[4 - buf[i]]++;
+        ubyte_t* buf = (ubyte_t*) malloc(seq_len + 1);
+        if (bwt == nullptr || buf == nullptr) {
+            free(bwt);
+            free(buf);
+            raise_pg_error(ERRCODE_OUT_OF_MEMORY, errmsg("could not allocate %zu bytes to build bwa index", seq_len + 1));
         }
+        bwt->seq_len = seq_len;
+        bwt->bwt_size = bwt_size;
+        buf[bwt->seq_len] = 0;
 
-        // Backward complement
-        for (ssize_t i = pac_len - 1; i >= 0 ; i--)
-            buf[2 * pac_len - 1 - i] = 0b11 - pac_raw_get(pac, i);
+        // Both strands are expanded a byte at a time, and the base counts come from a histogram of packed bytes.
+        size_t chunks = (pac_bytes + pac2bwt_chunk_bytes - 1) / pac2bwt_chunk_bytes;
+        std::vector<std::array<uint64_t, 4>> base_counts(chunks);
+        parallel_for(chunks, threads, [&](size_t chunk) {
+            size_t begin = chunk * pac2bwt_chunk_bytes;
+            size_t end = std::min(begin + pac2bwt_chunk_bytes, pac_bytes);
+            std::array<uint64_t, 256> histogram {};
+            for (size_t i = begin; i < end; i++) {
+                memcpy(buf + 4 * i, forward_expansion[pac[i]].data(), 4);
+                memcpy(buf + bwt->seq_len - 4 * i - 4, reverse_complement_expansion[pac[i]].data(), 4);
+                histogram[pac[i]]++;
+            }
+            for (int byte = 0; byte < 256; byte++)
+                for (ubyte_t base : forward_expansion[byte])
+                    base_counts[chunk][base] += histogram[byte];
+        });
 
+        for (const auto& counts : base_counts) {
+            for (int base = 0; base < 4; base++) {
+                bwt->L2[1 + base] += counts[base];
+                bwt->L2[4 - base] += counts[base];
+            }
+        }
         for (int i = 2; i <= 4; ++i)
             bwt->L2[i] += bwt->L2[i - 1];
 
+        // libbwa only ships a sequential suffix array construction, so this remains the single-threaded part.
         bwt->primary = is_bwt(buf, bwt->seq_len);
-        bwt->bwt = (u_int32_t*) calloc(bwt->bwt_size, 4);
-        for (size_t i = 0; i < bwt->seq_len; ++i)
-            bwt->bwt[i>>4] |= buf[i] << ((15 - (i & 15)) << 1);
+
+        // Allocated only now, as is_bwt holds a 32-bit suffix array of the whole text until it returns.
+        bwt->bwt = (uint32_t*) malloc(bwt->bwt_size * 4);
+        if (bwt->bwt == nullptr) {
+            free(bwt);
+            free(buf);
+            raise_pg_error(ERRCODE_OUT_OF_MEMORY, errmsg("could not allocate %zu bytes to build bwa index", bwt_size * 4));
+        }
+        parallel_for((bwt->bwt_size + pack_chunk_words - 1) / pack_chunk_words, threads, [&](size_t chunk) {
+            size_t end = std::min((chunk + 1) * pack_chunk_words, bwt->bwt_size);
+            for (size_t word = chunk * pack_chunk_words; word < end; word++) {
+                size_t begin = word << 4;
+                size_t count = std::min<size_t>(16, bwt->seq_len - begin);
+                uint32_t packed = 0;
+                for (size_t i = 0; i < count; i++)
+                    packed |= static_cast<uint32_t>(buf[begin + i]) << ((15 - i) << 1);
+                bwt->bwt[word] = packed;
+            }
+        });
         free(buf);
         return bwt;
     }
 
-    std::string extract_reference_subseq(bwaidx_t* index, int64_t ref_begin, int64_t ref_end) {
-        // TODO directly return PgNucleotideSequence (low priority).
-        std::string subseq(ref_end - ref_begin, '?');
-        for (size_t i = 0; i < subseq.size(); ++i)
-            subseq[i] = "ACGT"[pac_raw_get(index->pac, ref_begin + i)];
-        // TODO: Use binary search to look for relevant holes (low priority).
-        for (bntamb1_t* hole = index->bns->ambs; hole != index->bns->ambs + index->bns->n_holes; ++hole) {
-            int64_t left_intersect = std::max(hole->offset, ref_begin);
-            int64_t right_intersect = std::min(hole->offset + hole->len, ref_end);
-            for (int64_t i = left_intersect; i < right_intersect; ++i)
-                subseq[i - ref_begin] = hole->amb;
+    // Builds the BWT with the incremental construction of libbwa, the bwtsw algorithm of bwa index. It reads both strands
+    // from a packed file and works in blocks, so it never holds more than a fraction of a byte per base of the text,
+    // where pac2bwt needs the expanded text and a 32-bit suffix array. Both files live in the temporary file directory,
+    // whose leftovers from a failed build are removed at the next server start.
+    bwt_t* pac2bwt_bwtgen(const std::vector<ubyte_t>& pac_forward) {
+        static uint32_t file_counter = 0;
+        if (MakePGDirectory(PG_TEMP_FILES_DIR) < 0 && errno != EEXIST)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not create directory \"%s\": %m", PG_TEMP_FILES_DIR)));
+        uint32_t file_number = file_counter++;
+        char* pac_path = psprintf("%s/%s%d.bwa%u.pac", PG_TEMP_FILES_DIR, PG_TEMP_FILE_PREFIX, MyProcPid, file_number);
+        char* bwt_path = psprintf("%s/%s%d.bwa%u.bwt", PG_TEMP_FILES_DIR, PG_TEMP_FILE_PREFIX, MyProcPid, file_number);
+
+        FILE* file = AllocateFile(pac_path, PG_BINARY_W);
+        if (file == nullptr)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not create file \"%s\": %m", pac_path)));
+        auto write = [&](const ubyte_t* data, size_t size) {
+            if (fwrite(data, 1, size, file) != size)
+                ereport(ERROR, (errcode_for_file_access(), errmsg("could not write file \"%s\": %m", pac_path)));
+        };
+        // The reverse strand is the reverse complement of whole packed bytes, as the forward strand always fills them.
+        write(pac_forward.data(), pac_forward.size());
+        std::vector<ubyte_t> chunk;
+        for (size_t end = pac_forward.size(); end > 0;) {
+            size_t begin = end > bwtgen_chunk_bytes ? end - bwtgen_chunk_bytes : 0;
+            chunk.clear();
+            for (size_t i = end; i-- > begin;)
+                chunk.push_back(reverse_complement_bytes[pac_forward[i]]);
+            write(chunk.data(), chunk.size());
+            end = begin;
         }
-        return subseq;
+        // A text filling its last byte is followed by an empty byte, and the file ends with the count of bases in the
+        // last byte, here none.
+        static const ubyte_t trailer[2] = {0, 0};
+        write(trailer, sizeof(trailer));
+        if (FreeFile(file) != 0)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not close file \"%s\": %m", pac_path)));
+
+        // libbwa exits the process on its own I/O and allocation failures, like for every other allocation it makes.
+        bwt_bwtgen(pac_path, bwt_path);
+        unlink(pac_path);
+        bwt_t* bwt = bwt_restore_bwt(bwt_path);
+        unlink(bwt_path);
+        pfree(pac_path);
+        pfree(bwt_path);
+        return bwt;
     }
 
-    std::string cigar_compressed_to_string(const uint32_t *raw, int len) {
-        std::string cigar;
-        for (int i = 0; i < len; ++i) {
-            cigar += std::to_string(bam_cigar_oplen(raw[i]));
-            cigar += bam_cigar_opchr(raw[i]);
+    // Scratch space of the seeding step, starting with the layout of smem_aux_t inside libbwa. libbwa grows the vectors
+    // as needed and never shrinks them, so buffers that are kept soon fit any query and seeding stops allocating.
+    struct SeedingBuffers {
+        bwtintv_v mem;
+        bwtintv_v mem1;
+        bwtintv_v* tmpv[2];
+        bwtintv_v tmp[2];
+
+        SeedingBuffers(): mem(), mem1(), tmpv{&tmp[0], &tmp[1]}, tmp() {}
+        SeedingBuffers(const SeedingBuffers&) = delete;
+        SeedingBuffers& operator=(const SeedingBuffers&) = delete;
+
+        ~SeedingBuffers() {
+            free(mem.a);
+            free(mem1.a);
+            free(tmp[0].a);
+            free(tmp[1].a);
         }
-        return cigar;
+    };
+
+    // One set of seeding buffers per worker thread, kept for the lifetime of the backend.
+    std::vector<std::unique_ptr<SeedingBuffers>> seeding_buffers;
+
+    void reserve_seeding_buffers(size_t workers) {
+        while (seeding_buffers.size() < workers)
+            seeding_buffers.push_back(std::make_unique<SeedingBuffers>());
+    }
+
+    // Orientation of the second mate relative to the first and the distance between their starts, computed like
+    // mem_infer_dir inside libbwa does, so that it indexes the insert size estimates of mem_pestat.
+    int mate_orientation(int64_t l_pac, int64_t first_begin, int64_t second_begin, int64_t& dist) {
+        bool first_reverse = first_begin >= l_pac;
+        bool second_reverse = second_begin >= l_pac;
+        int64_t second = first_reverse == second_reverse ? second_begin : (l_pac << 1) - 1 - second_begin;
+        dist = second > first_begin ? second - first_begin : first_begin - second;
+        return (first_reverse == second_reverse ? 0 : 1) ^ (second > first_begin ? 0 : 3);
+    }
+
+    struct MatePair {
+        size_t first;
+        size_t second;
+        int score;
+    };
+
+    // Finds the pair of primary hits of both mates that scores best, with the score of bwa mem: the sum of the scores of
+    // the hits, lowered by how unlikely their distance is under the insert size distribution. Pairs are compared all
+    // against all, as reads rarely have more than a few primary hits.
+    std::optional<MatePair> best_mate_pair(const mem_opt_t& options, int64_t l_pac, const BwaInsertSizes& insert_sizes,
+            const mem_alnreg_v* mates) {
+        std::optional<MatePair> best;
+        for (size_t i = 0; i < mates[0].n; i++) {
+            const mem_alnreg_t& first = mates[0].a[i];
+            for (size_t j = 0; j < mates[1].n; j++) {
+                const mem_alnreg_t& second = mates[1].a[j];
+                if (first.secondary >= 0 || second.secondary >= 0 || first.rid != second.rid)
+                    continue;
+                int64_t dist;
+                const mem_pestat_t& stats = insert_sizes.orientations[mate_orientation(l_pac, first.rb, second.rb, dist)];
+                if (stats.failed || dist < stats.low || dist > stats.high)
+                    continue;
+                // The deviation is only zero in a degenerate distribution, where every pair of the estimate was the
+                // same length.
+                double deviation = stats.std > 0 ? (dist - stats.avg) / stats.std : 0;
+                double penalty = .721 * std::log(2. * std::erfc(std::fabs(deviation) * M_SQRT1_2)) * options.a;
+                int score = std::max(0, static_cast<int>(first.score + second.score + penalty + .499));
+                if (!best || score > best->score)
+                    best = MatePair{i, j, score};
+            }
+        }
+        return best;
+    }
+
+    // libbwa numbers CIGAR operations in MIDSH order, while BAM puts N before S and H.
+    constexpr char cigar_op_letters[] = "MIDSH";
+    constexpr uint32_t bam_cigar_ops[] = {BAM_CMATCH, BAM_CINS, BAM_CDEL, BAM_CSOFT_CLIP, BAM_CHARD_CLIP};
+    constexpr uint32_t bwa_cigar_soft_clip = 3;
+
+    constexpr char index_file_magic[8] = {'B', 'S', 'Q', 'D', 'B', 'I', 'D', 'X'};
+    // Version 1 files stored hole offsets relative to their own reference sequence, so they are rejected and need to be
+    // built again. Version 2 files lack the last merged segment, and are read as if no delta segment was ever merged.
+    constexpr uint32_t index_file_version = 3;
+    constexpr uint32_t oldest_index_file_version = 2;
+
+    // Every section following the header starts at a multiple of 8 bytes, so the file can later be mapped directly.
+    struct IndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t sa_intv;
+        uint64_t primary;
+        uint64_t L2[5];
+        uint64_t seq_len;
+        uint64_t bwt_size;
+        uint64_t n_sa;
+        uint64_t pac_size;
+        uint64_t n_holes;
+        uint64_t n_seqs;
+        uint64_t last_merged_segment;
+    };
+
+    size_t index_file_header_size(uint32_t version) {
+        return version >= 3 ? sizeof(IndexFileHeader) : offsetof(IndexFileHeader, last_merged_segment);
+    }
+
+    static_assert(sizeof(IndexFileHeader) % 8 == 0, "This should not happen");
+    static_assert(sizeof(bntann1_t) % 8 == 0, "This should not happen");
+
+    void write_section(FILE* file, const char* path, const void* data, size_t size) {
+        static const char padding[8] = {};
+        if (fwrite(data, 1, size, file) != size || fwrite(padding, 1, -size & 7, file) != (-size & 7))
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not write index file \"%s\": %m", path)));
+    }
+
+    void read_section(FILE* file, const char* path, void* data, size_t size) {
+        char padding[8];
+        if (fread(data, 1, size, file) != size || fread(padding, 1, -size & 7, file) != (-size & 7))
+            raise_pg_error(ERRCODE_DATA_CORRUPTED, errmsg("index file \"%s\" is truncated", path));
     }
 }
 
-BwaIndex::BwaIndex(): options(mem_opt_init()), pac_forward(), holes(), annotations(), index(nullptr) {}
+BwaIndex::BwaIndex(): pac_forward(), holes(), annotations(), mapping(nullptr), mapping_size(0), index(nullptr), merged_segment(0) {}
 
 void BwaIndex::add_ref_sequence(int64_t id, const NucleotideSequence& seq) {
     int64_t offset = pac_forward.size() * 4;
@@ -96,23 +339,63 @@ void BwaIndex::add_ref_sequence(int64_t id, const NucleotideSequence& seq) {
     pac_forward.resize(old_size + pac_byte_size(seq.len));
     std::copy_n(seq.pac(), pac_byte_size(seq.len), pac_forward.data() + old_size);
 
-    // There is not so much of holes in standand genome, so nicer code is better.
+    // Holes are shifted to positions in the concatenated reference. References are appended in order and the holes of
+    // each are sorted, so the holes of the index stay sorted too, which lets matches find theirs by binary search.
     std::transform(seq.holes(), seq.holes() + seq.holes_num, std::back_inserter(holes), [&offset](const auto& hole) {
         bntamb1_t ret = hole;
         ret.offset += offset;
-        return hole;
+        return ret;
     });
 }
 
-void BwaIndex::build() {
+void BwaIndex::add_ref_sequences(const BwaIndex& other) {
+    for (size_t i = 0; i < other.sequence_count(); i++) {
+        // Indexes of only empty sequences have no FM-index, and keep just the annotations.
+        NucleotideSequence* seq;
+        if (other.index != nullptr) {
+            const bntseq_t* bns = other.index->bns;
+            const bntann1_t& ann = bns->anns[i];
+            seq = nuclseq_from_slice(bns->ambs, bns->n_holes, other.index->pac + ann.offset / 4, ann.offset, ann.offset + ann.len);
+        } else {
+            seq = nuclseq_from_packed(0, nullptr, 0, nullptr);
+        }
+        add_ref_sequence(other.ref_id(i), *seq);
+        pfree(seq);
+    }
+}
+
+void BwaIndex::build(int sa_interval, int threads, const std::function<void(BwaBuildStep)>& on_step) {
     if (pac_forward.empty())
         return;
 
-    bwt_t* bwt = pac2bwt(pac_forward);
+    auto step = [&](BwaBuildStep next) {
+        if (on_step)
+            on_step(next);
+    };
+
+    struct rusage usage_before;
+    getrusage(RUSAGE_SELF, &usage_before);
+    auto start = std::chrono::steady_clock::now();
+    step(BwaBuildStep::sorting_suffixes);
+    bwt_t* bwt = pac_forward.size() * 4 > bwtgen_min_bases ? pac2bwt_bwtgen(pac_forward) : pac2bwt(pac_forward, threads);
+    step(BwaBuildStep::counting_occurrences);
     bwt_bwtupdate_core(bwt);
-    bwt_cal_sa(bwt, 32);
+    step(BwaBuildStep::sampling_suffix_array);
+    bwt_cal_sa(bwt, sa_interval);
     bwt_gen_cnt_table(bwt);
+    assemble(bwt);
+
+    // Below bwtgen_min_bases, construction holds the expanded text and the full suffix array at once, which takes about
+    // five bytes per base of both strands, so the peak usually dwarfs the finished index. The kernel only tracks the peak of the whole process,
+    // so the growth of that peak during the build is reported too, which undercounts when an earlier peak was higher.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    elog(DEBUG1, "built bwa index of %zu bases in %.1f s, process peak memory usage %ld kB, grown by %ld kB during the build",
+            static_cast<size_t>(bwt->seq_len / 2), elapsed.count(), usage.ru_maxrss, usage.ru_maxrss - usage_before.ru_maxrss);
+}
 
+void BwaIndex::assemble(bwt_t* bwt) {
     bntseq_t* bns = (bntseq_t*) calloc(1, sizeof(bntseq_t));
     bns->seed = 11;
     bns->l_pac = pac_forward.size() * 4;
@@ -127,55 +410,655 @@ void BwaIndex::build() {
     index->pac = pac_forward.data();
 }
 
+void BwaIndex::save(const char* path) const {
+    IndexFileHeader header {};
+    std::copy_n(index_file_magic, sizeof(index_file_magic), header.magic);
+    header.version = index_file_version;
+    header.last_merged_segment = merged_segment;
+    if (index != nullptr) {
+        const bwt_t* bwt = index->bwt;
+        header.sa_intv = bwt->sa_intv;
+        header.primary = bwt->primary;
+        std::copy_n(bwt->L2, 5, header.L2);
+        header.seq_len = bwt->seq_len;
+        header.bwt_size = bwt->bwt_size;
+        header.n_sa = bwt->n_sa;
+        header.pac_size = index->bns->l_pac / 4;
+        header.n_holes = index->bns->n_holes;
+        header.n_seqs = index->bns->n_seqs;
+    } else {
+        header.n_seqs = annotations.size();
+    }
+
+    FILE* file = AllocateFile(path, PG_BINARY_W);
+    if (file == nullptr)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create index file \"%s\": %m", path)));
+
+    write_section(file, path, &header, sizeof(header));
+    if (index != nullptr) {
+        write_section(file, path, index->bwt->bwt, header.bwt_size * sizeof(uint32_t));
+        write_section(file, path, index->bwt->sa, header.n_sa * sizeof(bwtint_t));
+        write_section(file, path, index->pac, header.pac_size);
+        write_section(file, path, index->bns->ambs, header.n_holes * sizeof(bntamb1_t));
+        write_section(file, path, index->bns->anns, header.n_seqs * sizeof(bntann1_t));
+    } else {
+        write_section(file, path, annotations.data(), header.n_seqs * sizeof(bntann1_t));
+    }
+
+    if (FreeFile(file) != 0)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not close index file \"%s\": %m", path)));
+}
+
+void BwaIndex::load(const char* path) {
+    int fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+    if (fd < 0)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not open index file \"%s\": %m", path)));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not stat index file \"%s\": %m", path)));
+    if (static_cast<size_t>(st.st_size) < index_file_header_size(oldest_index_file_version))
+        raise_pg_error(ERRCODE_DATA_CORRUPTED, errmsg("index file \"%s\" is truncated", path));
+
+    // Mapping the file read-only and shared lets every backend use the same page cache pages, instead of holding a
+    // private copy of the whole index.
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    CloseTransientFile(fd);
+    if (data == MAP_FAILED)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not map index file \"%s\": %m", path)));
+    mapping = data;
+    mapping_size = st.st_size;
+
+    const auto& header = *reinterpret_cast<const IndexFileHeader*>(data);
+    if (!std::equal(index_file_magic, index_file_magic + sizeof(index_file_magic), header.magic)
+            || header.version < oldest_index_file_version || header.version > index_file_version)
+        raise_pg_error(ERRCODE_DATA_CORRUPTED, errmsg("file \"%s\" is not a compatible bwa index", path));
+
+    size_t offset = 0;
+    auto section = [&](size_t size) {
+        auto begin = reinterpret_cast<ubyte_t*>(data) + offset;
+        offset += size + (-size & 7);
+        if (offset > mapping_size)
+            raise_pg_error(ERRCODE_DATA_CORRUPTED, errmsg("index file \"%s\" is truncated", path));
+        return begin;
+    };
+    section(index_file_header_size(header.version));
+    if (header.version >= 3)
+        merged_segment = header.last_merged_segment;
+    auto bwt_data = reinterpret_cast<uint32_t*>(section(header.bwt_size * sizeof(uint32_t)));
+    auto sa_data = reinterpret_cast<bwtint_t*>(section(header.n_sa * sizeof(bwtint_t)));
+    auto pac_data = section(header.pac_size);
+    auto holes_data = reinterpret_cast<bntamb1_t*>(section(header.n_holes * sizeof(bntamb1_t)));
+    auto annotations_data = reinterpret_cast<bntann1_t*>(section(header.n_seqs * sizeof(bntann1_t)));
+
+    if (header.pac_size == 0) {
+        annotations.assign(annotations_data, annotations_data + header.n_seqs);
+        return;
+    }
+
+    bwt_t* bwt = (bwt_t*) calloc(1, sizeof(bwt_t));
+    bwt->primary = header.primary;
+    std::copy_n(header.L2, 5, bwt->L2);
+    bwt->seq_len = header.seq_len;
+    bwt->bwt_size = header.bwt_size;
+    bwt->sa_intv = header.sa_intv;
+    bwt->n_sa = header.n_sa;
+    bwt->bwt = bwt_data;
+    bwt->sa = sa_data;
+    bwt_gen_cnt_table(bwt);
+
+    // libbwa never writes to the index, so the const-less pointers into the read-only mapping are never used to
+    // modify it.
+    bntseq_t* bns = (bntseq_t*) calloc(1, sizeof(bntseq_t));
+    bns->seed = 11;
+    bns->l_pac = header.pac_size * 4;
+    bns->n_seqs = header.n_seqs;
+    bns->ambs = holes_data;
+    bns->n_holes = header.n_holes;
+    bns->anns = annotations_data;
+
+    index = (bwaidx_t*) calloc(1, sizeof(bwaidx_t));
+    index->bwt = bwt;
+    index->bns = bns;
+    index->pac = pac_data;
+}
+
+size_t BwaIndex::sequence_count() const {
+    return index != nullptr ? index->bns->n_seqs : annotations.size();
+}
+
+size_t BwaIndex::reference_bases() const {
+    return index != nullptr ? index->bns->l_pac : pac_forward.size() * 4;
+}
+
+int64_t BwaIndex::ref_id(size_t i) const {
+    const bntann1_t& ann = index != nullptr ? index->bns->anns[i] : annotations[i];
+    return reinterpret_cast<int64_t>(ann.name);
+}
+
+int BwaIndex::sa_interval() const {
+    return index != nullptr ? index->bwt->sa_intv : bwa_default_sa_interval;
+}
 
 BwaIndex::~BwaIndex() {
-    // Manual deleation prevents libbwa from running free on vector.data().
+    // Manual deleation prevents libbwa from running free on vector.data() or on the mapped file.
     if (index != nullptr) {
-        bwt_destroy(index->bwt);
+        if (mapping != nullptr)
+            free(index->bwt);
+        else
+            bwt_destroy(index->bwt);
         free(index->bns);
         free(index);
     }
-    free(options);
-}
-
-std::vector<BwaMatch> BwaIndex::align_sequence(const NucleotideSequence& seq) const {
-    if(pac_forward.empty())
-        return {};
-    // bwa algorithm is mainly used with very short query sequences (< 100 symbols) so cost of to_malloc_text here
-    // is minimal.
-    char* raw_query = seq.to_text_palloc();
-    std::string_view query(raw_query);
-
-    mem_alnreg_v aligns = mem_align1(options, index->bwt, index->bns, index->pac, query.length(), query.data()); // get all the hits (was c_str())
-    std::vector<BwaMatch> matches;
-    for (mem_alnreg_t* align = aligns.a; align != aligns.a + aligns.n; ++align) {
-        // BWA returns the align->rid indicating which reference sequence was matched, but some fields refer to
-        // positions withing the concatenated sequence, rather than in the specific sequence. For example, you need to
-        // subtract ref_offset from align->rb and align->re to get positions relative to the original reference
-        // sequence.
-        // TODO: How do rb/re fields look in reverse matches?
+    if (mapping != nullptr)
+        munmap(mapping, mapping_size);
+}
+
+mem_opt_t bwa_default_options() {
+    mem_opt_t* allocated = mem_opt_init();
+    mem_opt_t options = *allocated;
+    free(allocated);
+    return options;
+}
+
+void BwaQueryMatches::clear() {
+    matches.clear();
+    cigar_ops.clear();
+    paired_match.reset();
+    insert_size = 0;
+}
+
+void BwaQueryBatch::add(const NucleotideSequence& seq) {
+    size_t offset = codes.size();
+    codes.resize(offset + seq.length());
+    seq.to_codes(codes.data() + offset);
+    offsets.push_back(codes.size());
+}
+
+void BwaQueryBatch::clear() {
+    codes.clear();
+    offsets.resize(1);
+}
+
+text* bwa_cigar_to_text(const uint32_t* ops, size_t len) {
+    // Operation lengths have 28 bits, so each takes at most 9 digits and a letter.
+    auto cigar = static_cast<text*>(palloc(VARHDRSZ + 10 * len));
+    char* out = VARDATA(cigar);
+    for (size_t i = 0; i < len; i++) {
+        out = std::to_chars(out, out + 9, bam_cigar_oplen(ops[i])).ptr;
+        *out++ = cigar_op_letters[bam_cigar_op(ops[i])];
+    }
+    SET_VARSIZE(cigar, out - reinterpret_cast<char*>(cigar));
+    return cigar;
+}
+
+BwaPairAligner::~BwaPairAligner() {
+    free(profile);
+}
+
+bool BwaPairAligner::align(const mem_opt_t& options, const NucleotideSequence& query, const NucleotideSequence& target,
+        BwaPairAlignment& result) {
+    result.cigar_ops.clear();
+    if (query.length() == 0 || target.length() == 0)
+        return false;
+    // Scores are kept in 16-bit lanes, which a perfect match of the whole query must not overflow.
+    if (query.length() * options.a >= INT16_MAX)
+        raise_pg_error(ERRCODE_PROGRAM_LIMIT_EXCEEDED, errmsg("query of %zu bases is too long to align", query.length()));
+
+    query_codes.resize(query.length());
+    query.to_codes(query_codes.data());
+    target_codes.resize(target.length());
+    target.to_codes(target_codes.data());
+
+    // Like bwa mem, 8-bit lanes are only used when even a perfect match scores below their limit.
+    bool bytes = query_codes.size() * options.a < 250;
+    if (profile != nullptr && (bytes != profile_bytes || query_codes != profile_query
+            || memcmp(profile_mat.data(), options.mat, profile_mat.size()) != 0)) {
+        free(profile);
+        profile = nullptr;
+    }
+    if (profile == nullptr) {
+        profile_query = query_codes;
+        memcpy(profile_mat.data(), options.mat, profile_mat.size());
+        profile_bytes = bytes;
+    }
+
+    // libbwa finds where the alignment ends first, and then where it starts by aligning the reversed sequences back.
+    int xtra = KSW_XSTART | (bytes ? KSW_XBYTE : 0);
+    kswr_t local = ksw_align2(query_codes.size(), query_codes.data(), target_codes.size(), target_codes.data(), 5,
+            options.mat, options.o_del, options.e_del, options.o_ins, options.e_ins, xtra, &profile);
+    if (local.score <= 0 || local.qb < 0 || local.tb < 0)
+        return false;
+
+    // The band has to cover the difference of the lengths, or the global alignment could not reach the ends.
+    int query_len = local.qe + 1 - local.qb;
+    int target_len = local.te + 1 - local.tb;
+    int width = std::max(options.w, std::abs(query_len - target_len));
+    int n_cigar = 0;
+    uint32_t* cigar = nullptr;
+    ksw_global2(query_len, query_codes.data() + local.qb, target_len, target_codes.data() + local.tb, 5, options.mat,
+            options.o_del, options.e_del, options.o_ins, options.e_ins, width, &n_cigar, &cigar);
+
+    if (local.qb > 0)
+        result.cigar_ops.push_back(bam_cigar_gen(local.qb, bwa_cigar_soft_clip));
+    result.cigar_ops.insert(result.cigar_ops.end(), cigar, cigar + n_cigar);
+    if (local.qe + 1 < static_cast<int>(query_codes.size()))
+        result.cigar_ops.push_back(bam_cigar_gen(query_codes.size() - local.qe - 1, bwa_cigar_soft_clip));
+    free(cigar);
+
+    result.score = local.score;
+    result.query_begin = local.qb;
+    result.query_end = local.qe + 1;
+    result.target_begin = local.tb;
+    result.target_end = local.te + 1;
+    return true;
+}
+
+bam1_t* BwaSamRecords::add() {
+    if (used == records.size()) {
+        bam1_t* record = bam_init1();
+        if (record == nullptr)
+            return nullptr;
+        records.emplace_back(record);
+    }
+    return records[used++].get();
+}
+
+void BwaSamRecords::clear() {
+    used = 0;
+    failed = false;
+}
+
+void BwaIndex::align_sequence(const mem_opt_t& options, const NucleotideSequence& seq, BwaQueryMatches& result) const {
+    result.clear();
+    if(index == nullptr)
+        return;
+    std::vector<ubyte_t> query(seq.length());
+    seq.to_codes(query.data());
+    reserve_seeding_buffers(1);
+    align_query(options, query.data(), query.size(), 0, seeding_buffers[0].get(), result);
+}
+
+void BwaIndex::align_sequences(const mem_opt_t& options, BwaQueryBatch& queries, std::vector<BwaQueryMatches>& results) const {
+    results.resize(queries.size());
+    for (BwaQueryMatches& result : results)
+        result.clear();
+    if (index == nullptr)
+        return;
+
+    // libbwa only reads the index while aligning, so queries can be processed concurrently, as long as every worker
+    // seeds with its own buffers.
+    reserve_seeding_buffers(parallel_worker_count(queries.size(), options.n_threads));
+    parallel_for_workers(queries.size(), options.n_threads, [&](size_t worker, size_t i) {
+        align_query(options, queries.query(i), queries.query_length(i), i, seeding_buffers[worker].get(), results[i]);
+    });
+}
+
+void BwaIndex::align_to_sam(const mem_opt_t& options, BwaQueryBatch& queries, const std::vector<int64_t>& ids,
+        std::vector<BwaSamRecords>& results) const {
+    results.resize(queries.size());
+    size_t workers = parallel_worker_count(queries.size(), options.n_threads);
+    reserve_seeding_buffers(workers);
+    std::vector<std::vector<char>> sequences(workers);
+    parallel_for_workers(queries.size(), options.n_threads, [&](size_t worker, size_t i) {
+        mem_alnreg_v regions {};
+        if (index != nullptr) {
+            regions = find_regions(options, queries.query(i), queries.query_length(i), seeding_buffers[worker].get());
+            mem_mark_primary_se(&options, regions.n, regions.a, i);
+        }
+        collect_sam_records(options, queries.query(i), queries.query_length(i), ids[i], regions, sequences[worker], results[i]);
+        free(regions.a);
+    });
+}
+
+void BwaIndex::find_hits(const ubyte_t* query, size_t len, int max_mismatches, size_t max_hits, std::vector<BwaHit>& hits) const {
+    if (index == nullptr || len == 0 || max_hits == 0)
+        return;
+    const bwt_t* bwt = index->bwt;
+    const bntseq_t* bns = index->bns;
+
+    // Both strands are indexed, so a piece of the query occurs in the reference exactly when its reverse complement
+    // does. Extending the reverse complement of longer and longer prefixes, and starting over whenever it stops
+    // occurring, splits every prefix into pieces that each need a mismatch. That bounds the mismatches left for the rest
+    // of the search, which bwa aln gets from an index of the reversed reference.
+    std::vector<int> prefix_mismatches(len);
+    bwtint_t k = 0;
+    bwtint_t l = bwt->seq_len;
+    int pieces = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (query[i] < 4) {
+            ubyte_t c = 3 - query[i];
+            bwtint_t ok, ol;
+            bwt_2occ(bwt, k - 1, l, c, &ok, &ol);
+            k = bwt->L2[c] + ok + 1;
+            l = bwt->L2[c] + ol;
+        }
+        if (query[i] >= 4 || k > l) {
+            pieces++;
+            k = 0;
+            l = bwt->seq_len;
+        }
+        prefix_mismatches[i] = pieces;
+    }
+    if (prefix_mismatches[len - 1] > max_mismatches)
+        return;
+
+    // Suffix array intervals of the query with every combination of substitutions, searched depth first from the end of
+    // the query. Different substitutions give different strings, so the intervals never overlap.
+    struct Interval {
+        size_t remaining;
+        bwtint_t k;
+        bwtint_t l;
+        int mismatches;
+    };
+    std::vector<Interval> pending { {len, 0, bwt->seq_len, 0} };
+    std::vector<Interval> found;
+    while (!pending.empty()) {
+        Interval interval = pending.back();
+        pending.pop_back();
+        if (interval.remaining == 0) {
+            found.push_back(interval);
+            continue;
+        }
+        size_t i = interval.remaining - 1;
+        int bound = i > 0 ? prefix_mismatches[i - 1] : 0;
+        bwtint_t ok[4], ol[4];
+        bwt_2occ4(bwt, interval.k - 1, interval.l, ok, ol);
+        for (ubyte_t c = 0; c < 4; c++) {
+            int mismatches = interval.mismatches + (c != query[i]);
+            if (bwt->L2[c] + ok[c] + 1 <= bwt->L2[c] + ol[c] && mismatches + bound <= max_mismatches)
+                pending.push_back({i, bwt->L2[c] + ok[c] + 1, bwt->L2[c] + ol[c], mismatches});
+        }
+    }
+    std::sort(found.begin(), found.end(), [](const Interval& a, const Interval& b) { return a.mismatches < b.mismatches; });
+
+    // Occurrences are located on the concatenation of both strands, and the ones crossing the boundary between
+    // references or strands are dropped.
+    auto l_pac = static_cast<int64_t>(bns->l_pac);
+    auto query_len = static_cast<int64_t>(len);
+    size_t located = 0;
+    for (const Interval& interval : found) {
+        for (bwtint_t sa = interval.k; sa <= interval.l && located < max_hits; sa++) {
+            auto pos = static_cast<int64_t>(bwt_sa(bwt, sa));
+            bool reverse_strand = pos >= l_pac;
+            int64_t begin = reverse_strand ? 2 * l_pac - pos - query_len : pos;
+            if (begin < 0 || begin + query_len > l_pac)
+                continue;
+            const bntann1_t& ref = bns->anns[bns_pos2rid(bns, begin)];
+            if (begin + query_len > ref.offset + ref.len || bns_cnt_ambi(bns, begin, len, nullptr) > 0)
+                continue;
+            hits.push_back({
+                .ref_id = reinterpret_cast<int64_t>(ref.name),
+                .ref_match_begin = static_cast<int32_t>(begin - ref.offset),
+                .mismatches = interval.mismatches,
+                .is_reverse = reverse_strand,
+            });
+            located++;
+        }
+    }
+}
+
+sam_hdr_t* BwaIndex::sam_header() const {
+    const bntann1_t* refs = index != nullptr ? index->bns->anns : annotations.data();
+    std::string text = "@HD\tVN:1.6\tSO:unsorted\n";
+    for (size_t i = 0; i < sequence_count(); i++) {
+        text += "@SQ\tSN:" + std::to_string(reinterpret_cast<int64_t>(refs[i].name));
+        text += "\tLN:" + std::to_string(refs[i].len) + "\n";
+    }
+    text += "@PG\tID:bioseqdb\tPN:bioseqdb\n";
+
+    sam_hdr_t* header = sam_hdr_parse(text.size(), text.c_str());
+    if (header == nullptr)
+        raise_pg_error(ERRCODE_OUT_OF_MEMORY, errmsg("could not build sam header"));
+    return header;
+}
+
+// Takes O(log holes + length), as holes of the match are found by binary search.
+NucleotideSequence* BwaIndex::ref_subseq(const BwaMatch& match) const {
+    const bntseq_t* bns = index->bns;
+    return nuclseq_from_slice(bns->ambs, bns->n_holes, index->pac + match.ref_begin / 4, match.ref_begin, match.ref_end);
+}
+
+void BwaIndex::align_pairs(const mem_opt_t& options, BwaQueryBatch& queries, BwaInsertSizes& insert_sizes,
+        std::vector<BwaQueryMatches>& results) const {
+    results.resize(queries.size());
+    for (BwaQueryMatches& result : results)
+        result.clear();
+    if (index == nullptr)
+        return;
+
+    std::vector<mem_alnreg_v> regions(queries.size());
+    reserve_seeding_buffers(parallel_worker_count(queries.size(), options.n_threads));
+    parallel_for_workers(queries.size(), options.n_threads, [&](size_t worker, size_t i) {
+        regions[i] = find_regions(options, queries.query(i), queries.query_length(i), seeding_buffers[worker].get());
+    });
+
+    // Like bwa mem, the distribution is estimated from the pairs of the batch whose mates both have a unique best hit.
+    mem_pestat_t estimates[4];
+    mem_pestat(&options, index->bns->l_pac, regions.size(), regions.data(), estimates);
+    for (int orientation = 0; orientation < 4; orientation++) {
+        if (!estimates[orientation].failed)
+            insert_sizes.orientations[orientation] = estimates[orientation];
+    }
+
+    parallel_for(queries.size() / 2, options.n_threads, [&](size_t pair) {
+        mem_alnreg_v* mates = &regions[2 * pair];
+
+        // Good hits of each mate are searched for the other mate nearby, at the expected distance. Candidates are copied
+        // first, as rescues of the second mate may add to the hits of the first.
+        std::vector<mem_alnreg_t> candidates[2];
+        for (int mate = 0; mate < 2; mate++) {
+            for (size_t i = 0; i < mates[mate].n; i++) {
+                if (mates[mate].a[i].score >= mates[mate].a[0].score - options.pen_unpaired)
+                    candidates[mate].push_back(mates[mate].a[i]);
+            }
+        }
+        for (int mate = 0; mate < 2; mate++) {
+            size_t other = 2 * pair + 1 - mate;
+            for (size_t i = 0; i < candidates[mate].size() && i < static_cast<size_t>(options.max_matesw); i++) {
+                mem_matesw(&options, index->bns, index->pac, insert_sizes.orientations, &candidates[mate][i],
+                        queries.query_length(other), queries.query(other), &mates[1 - mate]);
+            }
+        }
+        for (int mate = 0; mate < 2; mate++)
+            mem_mark_primary_se(&options, mates[mate].n, mates[mate].a, 2 * pair + mate);
+
+        // A proper pair is only reported when it beats aligning the mates separately, which costs pen_unpaired.
+        std::optional<MatePair> best;
+        if (mates[0].n > 0 && mates[1].n > 0) {
+            best = best_mate_pair(options, index->bns->l_pac, insert_sizes, mates);
+            if (best && best->score <= mates[0].a[0].score + mates[1].a[0].score - options.pen_unpaired)
+                best.reset();
+        }
+
+        for (int mate = 0; mate < 2; mate++) {
+            size_t i = 2 * pair + mate;
+            collect_matches(options, queries.query(i), queries.query_length(i), mates[mate], results[i]);
+            free(mates[mate].a);
+        }
+        if (best) {
+            BwaQueryMatches& first = results[2 * pair];
+            BwaQueryMatches& second = results[2 * pair + 1];
+            const BwaMatch& first_match = first.matches[best->first];
+            const BwaMatch& second_match = second.matches[best->second];
+            first.paired_match = static_cast<uint32_t>(best->first);
+            second.paired_match = static_cast<uint32_t>(best->second);
+            // Matches are on the forward strand, so the fragment spans from the leftmost start to the rightmost end.
+            first.insert_size = std::max(first_match.ref_end, second_match.ref_end)
+                    - std::min(first_match.ref_begin, second_match.ref_begin);
+            second.insert_size = first.insert_size;
+        }
+    });
+}
+
+// Uses only malloc-based memory, so it is safe to run outside of the backend thread. The query is given as codes, which
+// libbwa aligns as they are. The id only seeds the choice between equally good primary matches.
+void BwaIndex::align_query(const mem_opt_t& options, ubyte_t* query, size_t len, int64_t id, void* seeding_buffers,
+        BwaQueryMatches& result) const {
+    mem_alnreg_v aligns = find_regions(options, query, len, seeding_buffers);
+    mem_mark_primary_se(&options, aligns.n, aligns.a, id);
+    collect_matches(options, query, len, aligns, result);
+    free(aligns.a);
+}
+
+// Finds the aligned regions of a query, sorted by score, but without choosing the primary ones yet.
+mem_alnreg_v BwaIndex::find_regions(const mem_opt_t& options, ubyte_t* query, size_t len, void* seeding_buffers) const {
+    auto seq = reinterpret_cast<char*>(query);
+    return mem_align1_core(&options, index->bwt, index->bns, index->pac, len, seq, seeding_buffers);
+}
+
+// Uses only malloc-based memory like align_query. Reverse hits store the reverse complement of the query, as SAM
+// requires, with ambiguous symbols written as N like bwa mem does.
+void BwaIndex::collect_sam_records(const mem_opt_t& options, const ubyte_t* query, size_t len, int64_t id,
+        const mem_alnreg_v& regions, std::vector<char>& sequences, BwaSamRecords& result) const {
+    result.clear();
+    sequences.resize(2 * len);
+    char* forward = sequences.data();
+    char* reverse = sequences.data() + len;
+    for (size_t i = 0; i < len; i++) {
+        forward[i] = "ACGTN"[query[i]];
+        reverse[len - 1 - i] = "TGCAN"[query[i]];
+    }
+    char name[24];
+    size_t name_len = std::to_chars(name, name + sizeof(name), id).ptr - name;
+
+    auto add = [&](uint16_t flag, int32_t rid, hts_pos_t pos, uint8_t mapq, uint32_t* cigar, size_t n_cigar) {
+        bam1_t* record = result.add();
+        // Room for the NM and AS tags, with 4-byte values.
+        if (record == nullptr || bam_set1(record, name_len, name, flag, rid, pos, mapq, n_cigar, cigar, -1, -1, 0, len,
+                (flag & BAM_FREVERSE) != 0 ? reverse : forward, nullptr, 14) < 0)
+            result.failed = true;
+        return result.failed ? nullptr : record;
+    };
+
+    bool has_primary = false;
+    for (const mem_alnreg_t* align = regions.a; align != regions.a + regions.n; ++align) {
+        mem_aln_t details = mem_reg2aln(&options, index->bns, index->pac, len, reinterpret_cast<const char*>(query), align);
+        for (int i = 0; i < details.n_cigar; i++)
+            details.cigar[i] = bam_cigar_gen(bam_cigar_oplen(details.cigar[i]), bam_cigar_ops[bam_cigar_op(details.cigar[i])]);
+
+        // Like bwa mem, primary hits after the first one are supplementary.
+        uint16_t flag = details.flag | (details.is_rev ? BAM_FREVERSE : 0);
+        if ((flag & BAM_FSECONDARY) == 0) {
+            if (has_primary)
+                flag |= BAM_FSUPPLEMENTARY;
+            has_primary = true;
+        }
+        if (bam1_t* record = add(flag, details.rid, details.pos, details.mapq, details.cigar, details.n_cigar)) {
+            if (bam_aux_update_int(record, "NM", details.NM) < 0 || bam_aux_update_int(record, "AS", details.score) < 0)
+                result.failed = true;
+        }
+        free(details.cigar);
+    }
+    if (regions.n == 0)
+        add(BAM_FUNMAP, -1, -1, 0, nullptr, 0);
+}
+
+void BwaIndex::collect_matches(const mem_opt_t& options, const ubyte_t* query, size_t len, const mem_alnreg_v& regions,
+        BwaQueryMatches& result) const {
+    auto seq = reinterpret_cast<const char*>(query);
+    int64_t l_pac = index->bns->l_pac;
+    for (const mem_alnreg_t* align = regions.a; align != regions.a + regions.n; ++align) {
+        // BWA returns the align->rid indicating which reference sequence was matched, but align->rb and align->re are
+        // positions in both strands of the concatenated sequence. Matches on the reverse strand lie past l_pac and are
+        // counted from its end, so they are mapped back to the forward strand before subtracting ref_offset.
+        bool reverse_strand = align->rb >= l_pac;
+        int64_t ref_begin = reverse_strand ? 2 * l_pac - align->re : align->rb;
+        int64_t ref_end = reverse_strand ? 2 * l_pac - align->rb : align->re;
         int64_t ref_offset = index->bns->anns[align->rid].offset;
-        mem_aln_t details = mem_reg2aln(options, index->bns, index->pac, query.length(), query.data(), align);
-        matches.push_back({
+        mem_aln_t details = mem_reg2aln(&options, index->bns, index->pac, len, seq, align);
+        result.matches.push_back({
             .ref_id = reinterpret_cast<int64_t>(index->bns->anns[align->rid].name),
-            .ref_subseq = extract_reference_subseq(index, align->rb, align->re),
-            .ref_match_begin = static_cast<int32_t>(align->rb - ref_offset),
-            .ref_match_end = static_cast<int32_t>(align->re - ref_offset),
-            .ref_match_len = static_cast<int32_t>(align->re - align->rb),
-            .query_subseq = query.substr(align->qb, align->qe - align->qb),
+            .ref_begin = ref_begin,
+            .ref_end = ref_end,
+            .ref_match_begin = static_cast<int32_t>(ref_begin - ref_offset),
+            .ref_match_end = static_cast<int32_t>(ref_end - ref_offset),
+            .ref_match_len = static_cast<int32_t>(ref_end - ref_begin),
             .query_match_begin = align->qb,
             .query_match_end = align->qe,
             .query_match_len = align->qe - align->qb,
             .is_primary = (details.flag & BAM_FSECONDARY) == 0,
             .is_secondary = (details.flag & BAM_FSECONDARY) != 0,
             .is_reverse = details.is_rev != 0,
-            // TODO: Revert the CIGAR string and/or subsequences when the match is reversed?
-            .cigar = cigar_compressed_to_string(details.cigar, details.n_cigar),
+            .cigar_offset = static_cast<uint32_t>(result.cigar_ops.size()),
+            .cigar_len = static_cast<uint32_t>(details.n_cigar),
             .score = details.score,
+            .segment = 0,
         });
+        result.cigar_ops.insert(result.cigar_ops.end(), details.cigar, details.cigar + details.n_cigar);
         free(details.cigar);
     }
+}
 
-    free(aligns.a);
-    return matches;
+BwaSegmentedIndex::BwaSegmentedIndex(std::vector<std::shared_ptr<const BwaIndex>> segments): segments(std::move(segments)) {}
+
+size_t BwaSegmentedIndex::sequence_count() const {
+    size_t count = 0;
+    for (const auto& segment : segments)
+        count += segment->sequence_count();
+    return count;
+}
+
+void BwaSegmentedIndex::align_sequence(const mem_opt_t& options, const NucleotideSequence& seq, BwaQueryMatches& result) {
+    segments[0]->align_sequence(options, seq, result);
+    BwaQueryMatches matches;
+    for (uint32_t segment = 1; segment < segments.size(); segment++) {
+        segments[segment]->align_sequence(options, seq, matches);
+        merge_matches(options, matches, segment, result);
+    }
+}
+
+void BwaSegmentedIndex::align_sequences(const mem_opt_t& options, BwaQueryBatch& queries, std::vector<BwaQueryMatches>& results) {
+    segments[0]->align_sequences(options, queries, results);
+    for (uint32_t segment = 1; segment < segments.size(); segment++) {
+        segments[segment]->align_sequences(options, queries, segment_results);
+        for (size_t i = 0; i < queries.size(); i++)
+            merge_matches(options, segment_results[i], segment, results[i]);
+    }
+}
+
+NucleotideSequence* BwaSegmentedIndex::ref_subseq(const BwaMatch& match) const {
+    return segments[match.segment]->ref_subseq(match);
+}
+
+void BwaSegmentedIndex::find_hits(const NucleotideSequence& seq, int max_mismatches, size_t max_hits, std::vector<BwaHit>& hits) const {
+    hits.clear();
+    std::vector<ubyte_t> query(seq.length());
+    seq.to_codes(query.data());
+    for (const auto& segment : segments)
+        segment->find_hits(query.data(), query.size(), max_mismatches, max_hits, hits);
+    if (segments.size() > 1) {
+        std::stable_sort(hits.begin(), hits.end(), [](const BwaHit& a, const BwaHit& b) { return a.mismatches < b.mismatches; });
+        hits.resize(std::min(hits.size(), max_hits));
+    }
+}
+
+void BwaSegmentedIndex::merge_matches(const mem_opt_t& options, const BwaQueryMatches& matches, uint32_t segment,
+        BwaQueryMatches& result) const {
+    auto cigar_base = static_cast<uint32_t>(result.cigar_ops.size());
+    result.cigar_ops.insert(result.cigar_ops.end(), matches.cigar_ops.begin(), matches.cigar_ops.end());
+    for (BwaMatch match : matches.matches) {
+        match.cigar_offset += cigar_base;
+        match.segment = segment;
+        result.matches.push_back(match);
+    }
+
+    // Earlier segments win ties, so results do not depend on how references were split between segments when their
+    // matches score the same.
+    std::stable_sort(result.matches.begin(), result.matches.end(), [](const BwaMatch& lhs, const BwaMatch& rhs) {
+        return lhs.score > rhs.score;
+    });
+    for (auto match = result.matches.begin(); match != result.matches.end(); ++match) {
+        if (match->is_secondary)
+            continue;
+        for (auto better = result.matches.begin(); better != match; ++better) {
+            int overlap = std::min(match->query_match_end, better->query_match_end) - std::max(match->query_match_begin, better->query_match_begin);
+            int shorter = std::min(match->query_match_len, better->query_match_len);
+            if (!better->is_secondary && better->segment != match->segment && overlap >= options.mask_level * shorter) {
+                match->is_primary = false;
+                match->is_secondary = true;
+                break;
+            }
+        }
+    }
 }
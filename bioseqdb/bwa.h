@@ -1,32 +1,166 @@
 #pragma once
 
+#include <array>
+#include <climits>
 #include <cstdint>
-#include <string>
-#include <string_view>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <vector>
 
+#include <htslib/htslib/sam.h>
 extern "C" {
 #include <bwa/bwt.h>
 #include <bwa/bwamem.h>
+#include <bwa/ksw.h>
 }
 
 #include "sequence.h"
 
+// Matches hold positions rather than sequences, which are only built when a match is returned, straight from the packed
+// reference and query.
 struct BwaMatch {
     int64_t ref_id;
-    std::string ref_subseq;
+    // Bounds of the match on the forward strand of the concatenated reference, whatever strand the query matched.
+    int64_t ref_begin;
+    int64_t ref_end;
     int32_t ref_match_begin;
     int32_t ref_match_end;
     int32_t ref_match_len;
-    std::string_view query_subseq;
     int32_t query_match_begin;
     int32_t query_match_end;
     int32_t query_match_len;
     bool is_primary;
     bool is_secondary;
     bool is_reverse;
-    std::string cigar;
+    // Range of the CIGAR operations of this match in BwaQueryMatches::cigar_ops, encoded like BAM operations, except that
+    // libbwa numbers them in MIDSH order.
+    uint32_t cigar_offset;
+    uint32_t cigar_len;
     int score;
+    // Segment of a BwaSegmentedIndex holding the reference, which bounds and ref_id refer to.
+    uint32_t segment;
+};
+
+// Occurrence of a whole query with few mismatches, located without aligning it.
+struct BwaHit {
+    int64_t ref_id;
+    int32_t ref_match_begin;
+    int32_t mismatches;
+    bool is_reverse;
+};
+
+// Matches of a single query. Clearing keeps the capacity, so reusing one for the next query does not allocate.
+struct BwaQueryMatches {
+    std::vector<BwaMatch> matches;
+    std::vector<uint32_t> cigar_ops;
+    // For mates, the match that forms a proper pair with a match of the other mate, and the length of the fragment they
+    // span.
+    std::optional<uint32_t> paired_match;
+    int64_t insert_size;
+
+    void clear();
+};
+
+// Insert size distributions of mate pairs, one for each orientation of the mates, as estimated by libbwa. A search keeps
+// the last estimate of every orientation, so batches with too few confidently aligned pairs reuse earlier ones.
+struct BwaInsertSizes {
+    mem_pestat_t orientations[4] = {{0, 0, 1, 0, 0}, {0, 0, 1, 0, 0}, {0, 0, 1, 0, 0}, {0, 0, 1, 0, 0}};
+};
+
+// Queries encoded as libbwa codes, stored one after another.
+class BwaQueryBatch {
+public:
+    void add(const NucleotideSequence& seq);
+    void clear();
+    size_t size() const { return offsets.size() - 1; }
+
+    ubyte_t* query(size_t i) { return codes.data() + offsets[i]; }
+    size_t query_length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+private:
+    std::vector<ubyte_t> codes;
+    std::vector<size_t> offsets {0};
+};
+
+// SAM records of the hits of one query. Clearing keeps the records and their buffers, so reusing them for the next query
+// does not allocate.
+class BwaSamRecords {
+public:
+    bam1_t* add();
+    void clear();
+    size_t size() const { return used; }
+    const bam1_t* operator[](size_t i) const { return records[i].get(); }
+
+    // Set when htslib could not allocate a record, which is only reported on the backend thread.
+    bool failed = false;
+
+private:
+    struct Deleter {
+        void operator()(bam1_t* record) const { bam_destroy1(record); }
+    };
+
+    std::vector<std::unique_ptr<bam1_t, Deleter>> records;
+    size_t used = 0;
+};
+
+// Best local alignment of a query and a target, with bounds of both as [begin, end) and the clipped ends of the query
+// included in the CIGAR as soft clips.
+struct BwaPairAlignment {
+    int score;
+    int32_t query_begin;
+    int32_t query_end;
+    int32_t target_begin;
+    int32_t target_end;
+    std::vector<uint32_t> cigar_ops;
+};
+
+// Aligns queries against single targets without an index, with the striped SIMD Smith-Waterman of libbwa, and builds
+// the CIGAR with a banded global alignment of the aligned parts, the way bwa mem extends seeds. The query profile is kept
+// until a different query or scoring comes, so aligning one query against many targets builds it once.
+class BwaPairAligner {
+public:
+    BwaPairAligner() = default;
+    ~BwaPairAligner();
+
+    BwaPairAligner(const BwaPairAligner&) = delete;
+    BwaPairAligner& operator=(const BwaPairAligner&) = delete;
+
+    // Returns false when no part of the query aligns with a positive score.
+    bool align(const mem_opt_t& options, const NucleotideSequence& query, const NucleotideSequence& target,
+            BwaPairAlignment& result);
+
+private:
+    std::vector<ubyte_t> query_codes;
+    std::vector<ubyte_t> target_codes;
+    std::vector<ubyte_t> profile_query;
+    std::array<int8_t, 25> profile_mat {};
+    bool profile_bytes = false;
+    kswq_t* profile = nullptr;
+};
+
+// Formats CIGAR operations of libbwa as palloc'd text.
+text* bwa_cigar_to_text(const uint32_t* ops, size_t len);
+
+// Options are kept apart from the index, so one cached index can serve searches with different parameters.
+mem_opt_t bwa_default_options();
+
+// Interval between sampled suffix array entries, the same as the one used by bwa index.
+constexpr int bwa_default_sa_interval = 32;
+
+// Most bases one FM-index can hold, as libbwa builds the suffix array of both strands with 32-bit integers. References
+// are padded to whole bytes of four bases when concatenated.
+constexpr size_t bwa_max_index_bases = (INT_MAX / 2) & ~static_cast<size_t>(3);
+
+// Most mismatches find_hits allows, as the number of strings it visits grows exponentially with them.
+constexpr int bwa_max_hit_mismatches = 8;
+
+// Steps of building an FM-index, in order. Sorting the suffixes of both strands is single-threaded and usually takes
+// most of the time.
+enum class BwaBuildStep {
+    sorting_suffixes,
+    counting_occurrences,
+    sampling_suffix_array,
 };
 
 class BwaIndex {
@@ -34,16 +168,97 @@ public:
     explicit BwaIndex();
     ~BwaIndex();
 
-    std::vector<BwaMatch> align_sequence(const NucleotideSequence& seq) const;
-    void build();
+    BwaIndex(const BwaIndex&) = delete;
+    BwaIndex& operator=(const BwaIndex&) = delete;
+
+    void align_sequence(const mem_opt_t& options, const NucleotideSequence& seq, BwaQueryMatches& result) const;
+    // Aligns a batch of queries on options.n_threads threads, reusing the buffers already in results.
+    void align_sequences(const mem_opt_t& options, BwaQueryBatch& queries, std::vector<BwaQueryMatches>& results) const;
+    // Aligns a batch of mate pairs, stored as the first and second mate of every pair in turn. Alignment of the mates is
+    // followed by rescuing mates near the hits of their partners and picking the most likely proper pairs, like bwa mem
+    // does in paired-end mode.
+    void align_pairs(const mem_opt_t& options, BwaQueryBatch& queries, BwaInsertSizes& insert_sizes,
+            std::vector<BwaQueryMatches>& results) const;
+    // Aligns a batch of queries like align_sequences, but builds SAM records straight from the alignments instead of
+    // matches. Every query gets its primary hit, other primary hits flagged as supplementary and secondary hits, or a
+    // single unmapped record. Records are named by the query ids.
+    void align_to_sam(const mem_opt_t& options, BwaQueryBatch& queries, const std::vector<int64_t>& ids,
+            std::vector<BwaSamRecords>& results) const;
+    // Finds occurrences of the whole query on either strand with at most max_mismatches substitutions by backward search
+    // on the FM-index, like bwa aln, skipping the seeding, chaining and extension of align_sequence. At most max_hits
+    // occurrences are appended to hits, those with fewer mismatches first. Ambiguous symbols of the query count as
+    // mismatches, and occurrences overlapping ambiguous symbols of the reference are left out.
+    void find_hits(const ubyte_t* query, size_t len, int max_mismatches, size_t max_hits, std::vector<BwaHit>& hits) const;
+    // Header listing the reference sequences, named by their ids. The caller owns the result.
+    sam_hdr_t* sam_header() const;
+    // Builds the part of the reference covered by a match, with its ambiguous symbols.
+    NucleotideSequence* ref_subseq(const BwaMatch& match) const;
+    // Builds the FM-index, keeping every sa_interval-th suffix array entry, which must be a power of two. Denser sampling
+    // locates matches faster at the cost of a larger index. on_step is called before every step, on the calling thread,
+    // and may raise an error to abandon the build, leaking the partial index, which suits processes that exit afterwards.
+    void build(int sa_interval, int threads, const std::function<void(BwaBuildStep)>& on_step = nullptr);
     void add_ref_sequence(int64_t id, const NucleotideSequence& seq);
+    // Adds every reference sequence of a built or loaded index, so segments are merged without reading tables again.
+    void add_ref_sequences(const BwaIndex& other);
+    size_t sequence_count() const;
+    // Length of the concatenated reference, counting the padding of every sequence to whole bytes.
+    size_t reference_bases() const;
+    int64_t ref_id(size_t i) const;
+    int sa_interval() const;
+    size_t mapped_size() const { return mapping_size; }
+
+    // Number of the last delta segment whose references were merged into this main segment of a persistent index.
+    uint64_t last_merged_segment() const { return merged_segment; }
+    void set_last_merged_segment(uint64_t segment) { merged_segment = segment; }
 
-    mem_opt_t* options;
+    // Index files store the finished FM-index together with the reference data, so loading one skips the build.
+    // Loaded indexes are read-only views of the memory-mapped file.
+    void save(const char* path) const;
+    void load(const char* path);
 
 private:
+    void assemble(bwt_t* bwt);
+    void align_query(const mem_opt_t& options, ubyte_t* query, size_t len, int64_t id, void* seeding_buffers,
+            BwaQueryMatches& result) const;
+    mem_alnreg_v find_regions(const mem_opt_t& options, ubyte_t* query, size_t len, void* seeding_buffers) const;
+    void collect_matches(const mem_opt_t& options, const ubyte_t* query, size_t len, const mem_alnreg_v& regions,
+            BwaQueryMatches& result) const;
+    void collect_sam_records(const mem_opt_t& options, const ubyte_t* query, size_t len, int64_t id,
+            const mem_alnreg_v& regions, std::vector<char>& sequences, BwaSamRecords& result) const;
+
     std::vector<ubyte_t> pac_forward;
     std::vector<bntamb1_t> holes;
     std::vector<bntann1_t> annotations; 
+    void* mapping;
+    size_t mapping_size;
     bwaidx_t* index;
+    uint64_t merged_segment;
+};
+
+// Searches an index kept as several segments, shards of references too large for one FM-index and deltas built from
+// references added later, as if it was a single index. Queries are aligned against every segment, and matches
+// overlapping a better match of another segment in the query are marked secondary, the way libbwa marks them within one
+// index. Pairing and SAM records need a single segment.
+class BwaSegmentedIndex {
+public:
+    explicit BwaSegmentedIndex(std::vector<std::shared_ptr<const BwaIndex>> segments);
+
+    size_t segment_count() const { return segments.size(); }
+    const BwaIndex& segment(size_t i) const { return *segments[i]; }
+    std::shared_ptr<const BwaIndex> shared_segment(size_t i) const { return segments[i]; }
+    size_t sequence_count() const;
+
+    void align_sequence(const mem_opt_t& options, const NucleotideSequence& seq, BwaQueryMatches& result);
+    void align_sequences(const mem_opt_t& options, BwaQueryBatch& queries, std::vector<BwaQueryMatches>& results);
+    NucleotideSequence* ref_subseq(const BwaMatch& match) const;
+    // Finds hits in every segment, keeping the max_hits with fewest mismatches.
+    void find_hits(const NucleotideSequence& seq, int max_mismatches, size_t max_hits, std::vector<BwaHit>& hits) const;
+
+private:
+    // Appends the matches of a later segment to the result, and orders all of them by score.
+    void merge_matches(const mem_opt_t& options, const BwaQueryMatches& matches, uint32_t segment, BwaQueryMatches& result) const;
+
+    std::vector<std::shared_ptr<const BwaIndex>> segments;
+    std::vector<BwaQueryMatches> segment_results;
 };
 
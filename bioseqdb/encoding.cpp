@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cstring>
+
+#include "encoding.h"
+#include "pac.h"
+
+inline namespace {
+
+// Runs of repeated bytes are a control byte with the top bit set and 15 bits of length, followed by the byte. Other
+// bytes are copied in literals of up to 128 bytes, after a control byte holding their number minus one.
+constexpr size_t min_run = 4;
+constexpr size_t max_run = 0x7FFF + min_run;
+constexpr size_t max_literal = 128;
+
+constexpr size_t encoded_header_size = sizeof(EncodedSequence);
+constexpr size_t encoded_block_bytes = encoded_block_bases / 4;
+
+// Writes the encoded bytes to out, unless it is null, and returns their number.
+size_t encode_runs(const ubyte_t* in, size_t n, ubyte_t* out) {
+    size_t size = 0;
+    auto put_literal = [&](size_t begin, size_t end) {
+        for (; begin < end; begin += max_literal) {
+            size_t count = std::min(max_literal, end - begin);
+            if (out != nullptr) {
+                out[size] = static_cast<ubyte_t>(count - 1);
+                memcpy(out + size + 1, in + begin, count);
+            }
+            size += count + 1;
+        }
+    };
+
+    size_t literal = 0;
+    for (size_t i = 0; i < n;) {
+        size_t run = 1;
+        while (i + run < n && run < max_run && in[i + run] == in[i])
+            run++;
+        if (run >= min_run) {
+            put_literal(literal, i);
+            if (out != nullptr) {
+                out[size] = static_cast<ubyte_t>(0x80 | (run - min_run) >> 8);
+                out[size + 1] = static_cast<ubyte_t>(run - min_run);
+                out[size + 2] = in[i];
+            }
+            size += 3;
+            literal = i + run;
+        }
+        i += run;
+    }
+    put_literal(literal, n);
+    return size;
+}
+
+// Reads encoded bytes until n bytes are written, never reading or writing out of bounds even for corrupted data.
+void decode_runs(const ubyte_t* in, size_t in_bytes, ubyte_t* out, size_t n) {
+    size_t i = 0;
+    size_t written = 0;
+    while (i < in_bytes && written < n) {
+        ubyte_t control = in[i++];
+        if (control < 0x80) {
+            size_t count = std::min({static_cast<size_t>(control) + 1, n - written, in_bytes - i});
+            memcpy(out + written, in + i, count);
+            i += control + 1;
+            written += count;
+        } else {
+            if (in_bytes - i < 2)
+                break;
+            size_t count = std::min((static_cast<size_t>(control & 0x7F) << 8 | in[i]) + min_run, n - written);
+            memset(out + written, in[i + 1], count);
+            i += 2;
+            written += count;
+        }
+    }
+}
+
+template<typename F>
+void put_varint(uint64_t value, F put) {
+    for (; value >= 0x80; value >>= 7)
+        put(static_cast<ubyte_t>(value | 0x80));
+    put(static_cast<ubyte_t>(value));
+}
+
+uint64_t get_varint(const ubyte_t*& data) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        ubyte_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+}
+
+// Holes are their distance from the end of the previous one, their length and their symbol.
+size_t encode_holes(const bntamb1_t* holes, uint32_t holes_num, ubyte_t* out) {
+    size_t size = 0;
+    auto put = [&](ubyte_t byte) {
+        if (out != nullptr)
+            out[size] = byte;
+        size++;
+    };
+
+    int64_t prev_end = 0;
+    for (const bntamb1_t* hole = holes; hole != holes + holes_num; hole++) {
+        put_varint(hole->offset - prev_end, put);
+        put_varint(hole->len, put);
+        put(static_cast<ubyte_t>(hole->amb));
+        prev_end = hole->offset + hole->len;
+    }
+    return size;
+}
+
+// Returns the number of bases outside of holes before pos.
+size_t gapless_position(const bntamb1_t* holes, uint32_t holes_num, size_t pos) {
+    size_t hidden = 0;
+    for (const bntamb1_t* hole = holes; hole != holes + holes_num && static_cast<size_t>(hole->offset) < pos; hole++)
+        hidden += std::min<size_t>(hole->offset + hole->len, pos) - hole->offset;
+    return pos - hidden;
+}
+
+// Calls f with each stretch [p, q) of bases outside of holes, together with its position among such bases, until the
+// stretches pass end.
+template<typename F>
+void for_each_gapless_block(const bntamb1_t* holes, uint32_t holes_num, size_t len, size_t end, F f) {
+    size_t hidden = 0;
+    size_t p = 0;
+    for (const bntamb1_t* hole = holes; hole != holes + holes_num && p < end; hole++) {
+        if (static_cast<size_t>(hole->offset) > p)
+            f(p, static_cast<size_t>(hole->offset), p - hidden);
+        hidden += hole->len;
+        p = hole->offset + hole->len;
+    }
+    if (p < std::min(len, end))
+        f(p, len, p - hidden);
+}
+
+// Writes len bases of src starting at base src_pos to dst starting at base dst_pos. Bases of dst before dst_pos are
+// kept, and bases of the last written byte past the copied ones are unspecified.
+void pac_copy_at(const ubyte_t* src, size_t src_bytes, size_t src_pos, ubyte_t* dst, size_t dst_pos, size_t len) {
+    size_t head = std::min<size_t>(-dst_pos & 3, len);
+    for (size_t i = 0; i < head; i++) {
+        dst[(dst_pos + i) >> 2] &= ~(0b11 << ((~(dst_pos + i) & 3) << 1));
+        pac_raw_set(dst, dst_pos + i, pac_raw_get(src, src_pos + i));
+    }
+    if (len > head)
+        pac_copy(src, src_bytes, src_pos + head, dst + ((dst_pos + head) >> 2), len - head);
+}
+
+}
+
+NucleotideSequence* nuclseq_for_storage(NucleotideSequence* nucls) {
+    const bntamb1_t* holes = nucls->holes();
+    uint32_t holes_num = nucls->holes_num;
+    size_t gapless = gapless_position(holes, holes_num, nucls->len);
+    size_t gapless_bytes = pac_byte_size(gapless);
+
+    // Filler bases inside holes are random, so they are left out before looking for runs.
+    auto gapless_pac = static_cast<ubyte_t*>(palloc0(std::max<size_t>(gapless_bytes, 1)));
+    for_each_gapless_block(holes, holes_num, nucls->len, nucls->len, [&](size_t p, size_t q, size_t g) {
+        pac_copy_at(nucls->pac(), pac_byte_size(nucls->len), p, gapless_pac, g, q - p);
+    });
+    if (gapless % 4 != 0)
+        gapless_pac[gapless_bytes - 1] &= ~(0xFF >> (2 * (gapless % 4)));
+
+    uint32_t blocks = (gapless_bytes + encoded_block_bytes - 1) / encoded_block_bytes;
+    auto block_ends = static_cast<uint32_t*>(palloc(std::max<size_t>(blocks, 1) * sizeof(uint32_t)));
+    size_t runs_bytes = 0;
+    for (uint32_t block = 0; block < blocks; block++) {
+        size_t begin = block * encoded_block_bytes;
+        runs_bytes += encode_runs(gapless_pac + begin, std::min(encoded_block_bytes, gapless_bytes - begin), nullptr);
+        block_ends[block] = runs_bytes;
+    }
+    size_t holes_bytes = encode_holes(holes, holes_num, nullptr);
+    size_t size = encoded_header_size + blocks * sizeof(uint32_t) + holes_bytes + runs_bytes;
+
+    if (size * 16 <= static_cast<size_t>(VARSIZE(nucls)) * 15) {
+        auto encoded = static_cast<EncodedSequence*>(palloc0(size));
+        SET_VARSIZE(encoded, size);
+        encoded->holes_flagged = holes_num | encoded_sequence_flag;
+        encoded->len = nucls->len;
+        encoded->holes_bytes = holes_bytes;
+        encoded->blocks = blocks;
+        memcpy(const_cast<uint32_t*>(encoded->block_ends()), block_ends, blocks * sizeof(uint32_t));
+        encode_holes(holes, holes_num, const_cast<ubyte_t*>(encoded->holes()));
+        ubyte_t* runs = const_cast<ubyte_t*>(encoded->runs());
+        for (uint32_t block = 0; block < blocks; block++) {
+            size_t begin = block * encoded_block_bytes;
+            encode_runs(gapless_pac + begin, std::min(encoded_block_bytes, gapless_bytes - begin), runs + (block > 0 ? block_ends[block - 1] : 0));
+        }
+        pfree(nucls);
+        nucls = reinterpret_cast<NucleotideSequence*>(encoded);
+    }
+
+    pfree(block_ends);
+    pfree(gapless_pac);
+    return nucls;
+}
+
+NucleotideSequence* nuclseq_decode(const EncodedSequence& encoded) {
+    auto holes = static_cast<bntamb1_t*>(palloc0(std::max<size_t>(encoded.holes_num(), 1) * sizeof(bntamb1_t)));
+    decode_holes(encoded.holes(), holes, encoded.holes_num());
+    NucleotideSequence* nucls = nuclseq_decode_slice(holes, encoded.holes_num(), encoded.len, encoded.block_ends(), encoded.runs(), 0, encoded.len);
+    pfree(holes);
+    return nucls;
+}
+
+void decode_holes(const ubyte_t* data, bntamb1_t* holes, uint32_t holes_num) {
+    int64_t prev_end = 0;
+    for (bntamb1_t* hole = holes; hole != holes + holes_num; hole++) {
+        hole->offset = prev_end + static_cast<int64_t>(get_varint(data));
+        hole->len = static_cast<int32_t>(get_varint(data));
+        hole->amb = static_cast<char>(*data++);
+        prev_end = hole->offset + hole->len;
+    }
+}
+
+std::pair<size_t, size_t> encoded_blocks_covering(const bntamb1_t* holes, uint32_t holes_num, size_t begin, size_t end) {
+    size_t gapless_begin = gapless_position(holes, holes_num, begin);
+    size_t gapless_end = gapless_position(holes, holes_num, end);
+    size_t first = gapless_begin / encoded_block_bases;
+    size_t last = gapless_end > gapless_begin ? (gapless_end - 1) / encoded_block_bases + 1 : first;
+    return {first, last};
+}
+
+NucleotideSequence* nuclseq_decode_slice(const bntamb1_t* holes, uint32_t holes_num, size_t len, const uint32_t* block_ends,
+        const ubyte_t* runs, size_t begin, size_t end) {
+    auto [first, last] = encoded_blocks_covering(holes, holes_num, begin, end);
+    size_t gapless_bytes = pac_byte_size(gapless_position(holes, holes_num, len));
+
+    // Blocks holding the bases of the slice are decompressed together, so stretches can cross block boundaries.
+    size_t buffer_begin = first * encoded_block_bytes;
+    size_t buffer_bytes = std::min(last * encoded_block_bytes, gapless_bytes) - std::min(buffer_begin, gapless_bytes);
+    auto buffer = static_cast<ubyte_t*>(palloc(std::max<size_t>(buffer_bytes, 1)));
+    size_t runs_begin = first > 0 ? block_ends[first - 1] : 0;
+    for (size_t block = first; block < last; block++) {
+        size_t block_runs = block > 0 ? block_ends[block - 1] : 0;
+        size_t block_begin = block * encoded_block_bytes;
+        decode_runs(runs + block_runs - runs_begin, block_ends[block] - block_runs, buffer + block_begin - buffer_begin,
+                std::min(encoded_block_bytes, gapless_bytes - block_begin));
+    }
+
+    // The bases are put back around the holes in a window starting at the byte containing base begin, which is what
+    // nuclseq_from_slice expects.
+    size_t window_begin = begin & ~static_cast<size_t>(3);
+    auto window = static_cast<ubyte_t*>(palloc0(std::max<size_t>(pac_byte_size(end) - begin / 4, 1)));
+    for_each_gapless_block(holes, holes_num, len, end, [&](size_t p, size_t q, size_t g) {
+        size_t from = std::max(p, begin);
+        size_t to = std::min(q, end);
+        if (from < to)
+            pac_copy_at(buffer, buffer_bytes, g + (from - p) - 4 * buffer_begin, window, from - window_begin, to - from);
+    });
+
+    NucleotideSequence* nucls = nuclseq_from_slice(holes, holes_num, window, begin, end);
+    pfree(window);
+    pfree(buffer);
+    return nucls;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "sequence.h"
+
+// Sequences are stored either plain, as NucleotideSequence, or encoded, when that makes them noticeably smaller. The
+// encoded form drops the filler bases inside holes, stores holes as variable-length integers, and compresses the
+// remaining bases in blocks of runs of repeated bytes, so long gaps of N, sequences with many ambiguous symbols, and
+// low-complexity stretches take little space. Blocks are compressed separately, so long values stored out of line can
+// still be read piece by piece. Functions decode values before working on them. Input and the functions deriving new
+// sequences from stored ones, like complement, reverse and substring, pass their results through nuclseq_for_storage,
+// so those may be encoded as well.
+
+// Set in holes_num of encoded values. Plain values can't have that many holes, as they are at most 1 GB.
+constexpr uint32_t encoded_sequence_flag = 1u << 31;
+
+// Number of bases outside of holes compressed together, 1 MiB of packed data.
+constexpr size_t encoded_block_bases = 4 << 20;
+
+// Layout of encoded values. The header is followed by the end offsets of the runs of each block, then the holes, and
+// then the runs.
+struct EncodedSequence {
+    uint32_t holes_num() const { return holes_flagged & ~encoded_sequence_flag; }
+    const uint32_t* block_ends() const { return reinterpret_cast<const uint32_t*>(data); }
+    const ubyte_t* holes() const { return data + blocks * sizeof(uint32_t); }
+    const ubyte_t* runs() const { return holes() + holes_bytes; }
+
+    char vl_len[4];
+    uint32_t holes_flagged;
+    uint32_t len;
+    uint32_t holes_bytes;
+    uint32_t blocks;
+    ubyte_t data[];
+};
+
+static inline bool is_encoded(const NucleotideSequence& nucls) {
+    return (nucls.holes_num & encoded_sequence_flag) != 0;
+}
+
+// Returns the form to store a new value in, which is the encoded one if it saves at least 1/16 of the size. Plain
+// values that got encoded are freed.
+NucleotideSequence* nuclseq_for_storage(NucleotideSequence* nucls);
+
+NucleotideSequence* nuclseq_decode(const EncodedSequence& encoded);
+
+// Writes holes_num holes from their encoded form.
+void decode_holes(const ubyte_t* data, bntamb1_t* holes, uint32_t holes_num);
+
+// Returns the range of blocks holding bases [begin, end).
+std::pair<size_t, size_t> encoded_blocks_covering(const bntamb1_t* holes, uint32_t holes_num, size_t begin, size_t end);
+
+// Builds the sequence of bases [begin, end) of an encoded one, given all of its holes and block ends. The runs start at
+// the first block returned by encoded_blocks_covering, as read from a slice of a stored value.
+NucleotideSequence* nuclseq_decode_slice(const bntamb1_t* holes, uint32_t holes_num, size_t len, const uint32_t* block_ends,
+        const ubyte_t* runs, size_t begin, size_t end);
@@ -1,7 +1,11 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <climits>
+#include <csignal>
 #include <charconv>
+#include <memory>
+#include <string>
 #include <string_view>
 #include <optional>
 #include <cstdint>
@@ -14,18 +18,57 @@ extern "C" {
 #include <fmgr.h>
 #include <funcapi.h>
 #include <miscadmin.h>
+#include <access/gin.h>
+#include <pgstat.h>
+#include <access/htup_details.h>
+#include <access/stratnum.h>
+#include <access/xact.h>
 #include <executor/spi.h>
+#include <catalog/pg_authid.h>
 #include <catalog/pg_type.h>
+#include <common/hashfn.h>
+#include <lib/hyperloglog.h>
+#include <libpq/pqformat.h>
+#include <postmaster/bgworker.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/lmgr.h>
+#include <storage/lock.h>
+#include <tcop/tcopprot.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/snapmgr.h>
+#include <utils/sortsupport.h>
+#include <utils/syscache.h>
 #pragma GCC diagnostic pop
 }
 
 #include "bwa.h"
+#include "encoding.h"
+#include "index_builds.h"
+#include "index_cache.h"
+#include "kmer.h"
+#include "parallel.h"
 #include "sequence.h"
+#include "stored_sequence.h"
 
 #define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
 
 namespace {
 
+// Upper bound on the number of rows fetched from a cursor at once, see the bioseqdb.fetch_batch_size setting.
+int fetch_batch_size = 10000;
+
+// Lowest k-mer similarity accepted by the % operator, see the bioseqdb.kmer_similarity_threshold setting.
+double kmer_similarity_threshold = 0.3;
+
+// Strategy numbers of the operators in nuclseq_gin_kmer_operators.
+constexpr StrategyNumber nuclseq_contains_strategy = 1;
+constexpr StrategyNumber nuclseq_similar_strategy = 2;
+
 text *string_view_to_text(std::string_view s) {
     text *result = (text *) palloc(s.size() + VARHDRSZ);
     SET_VARSIZE(result, s.size() + VARHDRSZ);
@@ -33,12 +76,106 @@ text *string_view_to_text(std::string_view s) {
     return result;
 }
 
+// Sorting calls the comparator many times for every value, so detoasted copies are freed right away.
+void free_detoasted(const NucleotideSequence* nucls, Datum datum) {
+    if (reinterpret_cast<Pointer>(const_cast<NucleotideSequence*>(nucls)) != DatumGetPointer(datum))
+        pfree(const_cast<NucleotideSequence*>(nucls));
+}
+
+// Returns the plain form of a value, decoding it if it was stored encoded.
+const NucleotideSequence* detoast_nuclseq(Datum datum) {
+    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(datum));
+    if (!is_encoded(*nucls))
+        return nucls;
+
+    NucleotideSequence* decoded = nuclseq_decode(*reinterpret_cast<const EncodedSequence*>(nucls));
+    free_detoasted(nucls, datum);
+    return decoded;
+}
+
+int nuclseq_fastcmp(Datum x, Datum y, SortSupport) {
+    const NucleotideSequence* lhs = detoast_nuclseq(x);
+    const NucleotideSequence* rhs = detoast_nuclseq(y);
+    int result = NucleotideSequence::compare(*lhs, *rhs);
+    free_detoasted(lhs, x);
+    free_detoasted(rhs, y);
+    return result;
+}
+
+struct NuclseqSortSupport {
+    int64_t input_count;
+    bool estimating;
+    hyperLogLogState abbr_card;
+};
+
+// Abbreviated keys are the leading bases, as produced by NucleotideSequence::prefix_key. With 32-bit datums only the
+// first half of the key fits.
+Datum nuclseq_abbrev_convert(Datum original, SortSupport ssup) {
+    auto state = static_cast<NuclseqSortSupport*>(ssup->ssup_extra);
+    const NucleotideSequence* nucls = detoast_nuclseq(original);
+    uint64_t key = nucls->prefix_key() >> (64 - 8 * sizeof(Datum));
+    free_detoasted(nucls, original);
+
+    state->input_count++;
+    if (state->estimating)
+        addHyperLogLog(&state->abbr_card, hash_bytes_uint32(static_cast<uint32>(key ^ (key >> 32))));
+
+    return static_cast<Datum>(key);
+}
+
+int nuclseq_abbrev_cmp(Datum x, Datum y, SortSupport) {
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Reads sharing long prefixes, like amplicons or adapter-led libraries, make keys useless, so abbreviation is abandoned
+// when there are very few distinct keys. This follows the heuristic of numeric.
+bool nuclseq_abbrev_abort(int memtupcount, SortSupport ssup) {
+    auto state = static_cast<NuclseqSortSupport*>(ssup->ssup_extra);
+
+    if (memtupcount < 10000 || state->input_count < 10000 || !state->estimating)
+        return false;
+
+    double abbr_card = estimateHyperLogLog(&state->abbr_card);
+    if (abbr_card > 100000.0) {
+        state->estimating = false;
+        return false;
+    }
+
+    return abbr_card < state->input_count / 10000.0 + 0.5;
+}
+
+Datum* kmers_to_datums(const std::vector<uint32_t>& kmers, int32* nkeys) {
+    auto keys = static_cast<Datum*>(palloc(std::max<size_t>(kmers.size(), 1) * sizeof(Datum)));
+    std::transform(kmers.begin(), kmers.end(), keys, [](uint32_t kmer) { return Int32GetDatum(static_cast<int32>(kmer)); });
+    *nkeys = static_cast<int32>(kmers.size());
+    return keys;
+}
+
 }
 
 extern "C" {
 
 PG_MODULE_MAGIC;
 
+void _PG_init(void) {
+    // libbwa prints messages and statistics, like the insert size estimates of every paired batch, to stderr at its
+    // default verbosity, which would fill the server log, so only its errors are kept.
+    bwa_verbose = 1;
+    DefineCustomIntVariable("bioseqdb.fetch_batch_size",
+            "Maximum number of rows fetched at once from reference and query tables.",
+            nullptr, &fetch_batch_size, 10000, 1, INT_MAX, PGC_USERSET, 0, nullptr, nullptr, nullptr);
+    DefineCustomRealVariable("bioseqdb.kmer_similarity_threshold",
+            "Lowest k-mer similarity of sequences matched by the % operator.",
+            nullptr, &kmer_similarity_threshold, 0.3, 0.0, 1.0, PGC_USERSET, 0, nullptr, nullptr, nullptr);
+    index_cache_init();
+    index_builds_init();
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("bioseqdb");
+#else
+    EmitWarningsOnPlaceholders("bioseqdb");
+#endif
+}
+
 // Lowercase nucleotides should not be allowed to be stored in the database. Their meaning in non-standardized, and some
 // libraries can handle them poorly (for example, by replacing them with Ns). They should be handled before importing
 // them into the database, in order to make the internals more robust and prevent accidental usage. A valid option when
@@ -57,141 +194,403 @@ Datum nuclseq_in(PG_FUNCTION_ARGS) {
         }
     }
 
-    PG_RETURN_POINTER(nuclseq_from_text(text));
+    PG_RETURN_POINTER(nuclseq_for_storage(nuclseq_from_text(text)));
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_out);
 Datum nuclseq_out(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
     PG_RETURN_CSTRING(nucls->to_text_palloc());
 }
 
+// The binary format is the length, the number of holes, each hole as its offset, length and symbol, and then the packed
+// bases, with integers in network byte order. Filler bases inside holes and in the padding are not meaningful, and
+// nuclseq_recv replaces them.
+PG_FUNCTION_INFO_V1(nuclseq_recv);
+Datum nuclseq_recv(PG_FUNCTION_ARGS) {
+    StringInfo buf = reinterpret_cast<StringInfo>(PG_GETARG_POINTER(0));
+    uint32_t len = pq_getmsgint(buf, 4);
+    uint32_t holes_num = pq_getmsgint(buf, 4);
+
+    if (len > INT32_MAX / 4)
+        raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("provided sequence is too long"));
+    if (holes_num > len)
+        raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid number of holes in nuclseq_recv: %u", holes_num));
+
+    // Holes must look exactly like the ones nuclseq_in would produce, as maximal sorted runs of one ambiguous symbol.
+    auto holes = static_cast<bntamb1_t*>(palloc0(holes_num * sizeof(bntamb1_t) + 1));
+    uint64_t prev_end = 0;
+    for (uint32_t i = 0; i < holes_num; i++) {
+        uint64_t offset = pq_getmsgint(buf, 4);
+        uint64_t hole_len = pq_getmsgint(buf, 4);
+        char amb = static_cast<char>(pq_getmsgbyte(buf));
+
+        if (std::find(allowed_nucleotides.begin(), allowed_nucleotides.end(), amb) == allowed_nucleotides.end() || nuclcode_from_char(amb) < 4)
+            raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid hole symbol in nuclseq_recv: '%c'", amb));
+        if (hole_len == 0 || offset < prev_end || offset + hole_len > len || (i > 0 && offset == prev_end && holes[i - 1].amb == amb))
+            raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid hole in nuclseq_recv at offset " UINT64_FORMAT, offset));
+
+        holes[i].offset = static_cast<int64_t>(offset);
+        holes[i].len = static_cast<int32_t>(hole_len);
+        holes[i].amb = amb;
+        prev_end = offset + hole_len;
+    }
+
+    auto pac = reinterpret_cast<const ubyte_t*>(pq_getmsgbytes(buf, pac_byte_size(len)));
+    PG_RETURN_POINTER(nuclseq_for_storage(nuclseq_from_packed(len, holes, holes_num, pac)));
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_send);
+Datum nuclseq_send(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, nucls->len);
+    pq_sendint32(&buf, nucls->holes_num);
+    for (const bntamb1_t* hole = nucls->holes(); hole != nucls->holes() + nucls->holes_num; hole++) {
+        pq_sendint32(&buf, static_cast<uint32>(hole->offset));
+        pq_sendint32(&buf, static_cast<uint32>(hole->len));
+        pq_sendbyte(&buf, static_cast<uint8>(hole->amb));
+    }
+    pq_sendbytes(&buf, reinterpret_cast<const char*>(nucls->pac()), pac_byte_size(nucls->len));
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
 PG_FUNCTION_INFO_V1(nuclseq_eq);
 Datum nuclseq_eq(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs == *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_ne);
 Datum nuclseq_ne(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs != *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_lt);
 Datum nuclseq_lt(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs < *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_le);
 Datum nuclseq_le(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs <= *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_gt);
 Datum nuclseq_gt(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs > *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_ge);
 Datum nuclseq_ge(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_BOOL(*lhs >= *rhs);
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_cmp);
 Datum nuclseq_cmp(PG_FUNCTION_ARGS) {
-    auto lhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    auto rhs = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
     PG_RETURN_INT32(NucleotideSequence::compare(*lhs, *rhs));
 }
 
+PG_FUNCTION_INFO_V1(nuclseq_sortsupport);
+Datum nuclseq_sortsupport(PG_FUNCTION_ARGS) {
+    SortSupport ssup = reinterpret_cast<SortSupport>(PG_GETARG_POINTER(0));
+    ssup->comparator = nuclseq_fastcmp;
+
+    if (ssup->abbreviate) {
+        auto state = static_cast<NuclseqSortSupport*>(MemoryContextAlloc(ssup->ssup_cxt, sizeof(NuclseqSortSupport)));
+        state->input_count = 0;
+        state->estimating = true;
+        initHyperLogLog(&state->abbr_card, 10);
+
+        ssup->ssup_extra = state;
+        ssup->comparator = nuclseq_abbrev_cmp;
+        ssup->abbrev_converter = nuclseq_abbrev_convert;
+        ssup->abbrev_abort = nuclseq_abbrev_abort;
+        ssup->abbrev_full_comparator = nuclseq_fastcmp;
+    }
+
+    PG_RETURN_VOID();
+}
+
+// PostgreSQL requires the lower 32 bits of the extended hash with seed 0 to equal the standard hash.
+PG_FUNCTION_INFO_V1(nuclseq_hash);
+Datum nuclseq_hash(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    PG_RETURN_UINT32(static_cast<uint32_t>(nucls->hash(0)));
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_hash_extended);
+Datum nuclseq_hash_extended(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    PG_RETURN_UINT64(nucls->hash(PG_GETARG_INT64(1)));
+}
+
 PG_FUNCTION_INFO_V1(nuclseq_len);
 Datum nuclseq_len(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    PG_RETURN_UINT64(nucls->length());
+    StoredSequence nucls(PG_GETARG_DATUM(0));
+    PG_RETURN_UINT64(nucls.length());
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_content);
 Datum nuclseq_content(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    StoredSequence nucls(PG_GETARG_DATUM(0));
     std::string_view needle = PG_GETARG_CSTRING(1);
     if (needle.length() != 1 || std::find(allowed_nucleotides.begin(), allowed_nucleotides.end(), needle[0]) == allowed_nucleotides.end()) {
         raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE,
                 errmsg("invalid nucleotide in nuclseq_content: '%s'", needle.data()));
     }
-    if (nucls->length() == 0) {
+    if (nucls.length() == 0) {
         PG_RETURN_NULL();
     }
 
-    auto matches = static_cast<double>(nucls->occurences(needle[0]));
-    PG_RETURN_FLOAT8(matches / nucls->length());
+    uint64_t matches = 0;
+    nucls.scan(0, [&](const NucleotideSequence& piece, size_t) {
+        matches += piece.occurences(needle[0]);
+        return false;
+    });
+    PG_RETURN_FLOAT8(static_cast<double>(matches) / nucls.length());
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_complement);
 Datum nuclseq_complement(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    PG_RETURN_POINTER(nucls->complement());
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    PG_RETURN_POINTER(nuclseq_for_storage(nucls->complement()));
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_reverse);
 Datum nuclseq_reverse(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    PG_RETURN_POINTER(nucls->reverse());
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    PG_RETURN_POINTER(nuclseq_for_storage(nucls->reverse()));
 }
 
+// Positions are 1-based and clamped to the sequence like in substring. Only the window is read from stored sequences.
+PG_FUNCTION_INFO_V1(nuclseq_substring);
+Datum nuclseq_substring(PG_FUNCTION_ARGS) {
+    StoredSequence nucls(PG_GETARG_DATUM(0));
+    int64 len = nucls.length();
+    int64 start = PG_GETARG_INT32(1);
+    if (PG_NARGS() > 2 && PG_GETARG_INT32(2) < 0)
+        raise_pg_error(ERRCODE_SUBSTRING_ERROR, errmsg("negative substring length not allowed"));
+
+    int64 stop = PG_NARGS() > 2 ? start + PG_GETARG_INT32(2) : len + 1;
+    size_t begin = std::clamp<int64>(start, 1, len + 1) - 1;
+    size_t end = std::max<size_t>(std::clamp<int64>(stop, 1, len + 1) - 1, begin);
+    PG_RETURN_POINTER(nuclseq_for_storage(nucls.slice(begin, end)));
 }
 
-namespace {
+// Returns the 1-based position of the first occurrence of the motif, or 0 if there is none, like strpos. Long stored
+// sequences are searched block by block, and reading stops at the first match.
+PG_FUNCTION_INFO_V1(nuclseq_position);
+Datum nuclseq_position(PG_FUNCTION_ARGS) {
+    StoredSequence nucls(PG_GETARG_DATUM(0));
+    auto motif = detoast_nuclseq(PG_GETARG_DATUM(1));
+    if (motif->len > nucls.length())
+        PG_RETURN_INT32(0);
+
+    int32 position = 0;
+    nucls.scan(std::max<size_t>(motif->len, 1) - 1, [&](const NucleotideSequence& piece, size_t offset) {
+        std::optional<size_t> found = piece.find(*motif);
+        if (found)
+            position = static_cast<int32>(offset + *found + 1);
+        return found.has_value();
+    });
+    PG_RETURN_INT32(position);
+}
 
-template<typename F>
-Portal iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
-    Portal portal = SPI_cursor_open_with_args(nullptr, sql, 0, nullptr, nullptr, nullptr, true, 0);
-    long batch_size = 1;
+PG_FUNCTION_INFO_V1(nuclseq_contains);
+Datum nuclseq_contains(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto needle = detoast_nuclseq(PG_GETARG_DATUM(1));
+    PG_RETURN_BOOL(nucls->find(*needle).has_value());
+}
 
-    SPI_cursor_fetch(portal, true, batch_size);
-    while (SPI_processed > 0 && SPI_tuptable != NULL) {
-        int n = SPI_processed;
-        SPITupleTable* tuptable = SPI_tuptable;
-        TupleDesc tupdesc = tuptable->tupdesc;
+PG_FUNCTION_INFO_V1(nuclseq_kmer_similarity);
+Datum nuclseq_kmer_similarity(PG_FUNCTION_ARGS) {
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
+    PG_RETURN_FLOAT8(kmer_similarity(distinct_kmers(*lhs), distinct_kmers(*rhs)));
+}
 
-        switch(SPI_gettypeid(tupdesc, 1)) {
-            case INT2OID:
-            case INT4OID:
-            case INT8OID:
-                break;
-            default:
-            raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected column of integers"));
-        }
+PG_FUNCTION_INFO_V1(nuclseq_kmer_similar);
+Datum nuclseq_kmer_similar(PG_FUNCTION_ARGS) {
+    auto lhs = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto rhs = detoast_nuclseq(PG_GETARG_DATUM(1));
+    PG_RETURN_BOOL(kmer_similarity(distinct_kmers(*lhs), distinct_kmers(*rhs)) >= kmer_similarity_threshold);
+}
 
-        if (SPI_gettypeid(tupdesc, 2) != nuclseq_oid)
+// Index keys are the distinct k-mers of a sequence, packed into integers.
+PG_FUNCTION_INFO_V1(nuclseq_gin_extract_value);
+Datum nuclseq_gin_extract_value(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto nkeys = reinterpret_cast<int32*>(PG_GETARG_POINTER(1));
+    PG_RETURN_POINTER(kmers_to_datums(distinct_kmers(*nucls), nkeys));
+}
+
+// Queries without any k-mers, like motifs shorter than a k-mer, cannot be narrowed down and scan the whole index.
+PG_FUNCTION_INFO_V1(nuclseq_gin_extract_query);
+Datum nuclseq_gin_extract_query(PG_FUNCTION_ARGS) {
+    auto query = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto nkeys = reinterpret_cast<int32*>(PG_GETARG_POINTER(1));
+    StrategyNumber strategy = PG_GETARG_UINT16(2);
+    auto search_mode = reinterpret_cast<int32*>(PG_GETARG_POINTER(6));
+
+    Datum* keys = kmers_to_datums(distinct_kmers(*query), nkeys);
+    if ((strategy == nuclseq_contains_strategy && *nkeys == 0) || (strategy == nuclseq_similar_strategy && kmer_similarity_threshold <= 0))
+        *search_mode = GIN_SEARCH_MODE_ALL;
+    PG_RETURN_POINTER(keys);
+}
+
+// A sequence containing the query has all of its k-mers. With c of the n query k-mers present, the similarity is at most
+// c / n, as the union of k-mers has at least n elements. Both conditions are necessary only, so matches are rechecked.
+PG_FUNCTION_INFO_V1(nuclseq_gin_consistent);
+Datum nuclseq_gin_consistent(PG_FUNCTION_ARGS) {
+    auto check = reinterpret_cast<bool*>(PG_GETARG_POINTER(0));
+    StrategyNumber strategy = PG_GETARG_UINT16(1);
+    int32 nkeys = PG_GETARG_INT32(3);
+    auto recheck = reinterpret_cast<bool*>(PG_GETARG_POINTER(5));
+
+    int32 present = std::count(check, check + nkeys, true);
+    *recheck = true;
+    if (strategy == nuclseq_contains_strategy)
+        PG_RETURN_BOOL(present == nkeys);
+    PG_RETURN_BOOL(present >= kmer_similarity_threshold * nkeys);
+}
+
+}
+
+namespace {
+
+Oid check_nuclseq_table_columns(TupleDesc tupdesc, Oid nuclseq_oid, int sequence_columns) {
+    Oid id_type = SPI_gettypeid(tupdesc, 1);
+    switch(id_type) {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+            break;
+        default:
+        raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected column of integers"));
+    }
+
+    for (int column = 2; column < 2 + sequence_columns; column++) {
+        if (SPI_gettypeid(tupdesc, column) != nuclseq_oid)
             raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected column of nuclseqs"));
+    }
 
-        for(int i = 0 ; i < n; i++) {
-            HeapTuple tup = tuptable->vals[i];
-            bool null_id = false, null_seq = false;
+    return id_type;
+}
+
+int64_t id_from_datum(Datum id, Oid id_type) {
+    switch (id_type) {
+        case INT2OID: return DatumGetInt16(id);
+        case INT4OID: return DatumGetInt32(id);
+        default: return DatumGetInt64(id);
+    }
+}
+
+// Rows can be anything from short reads to whole chromosomes, so the batch size starts small and then follows the
+// observed row size, aiming for batches of about work_mem. It at most doubles between fetches, and never exceeds
+// bioseqdb.fetch_batch_size.
+long next_batch_size(long current, uint64 rows, size_t bytes) {
+    size_t target = static_cast<size_t>(work_mem) * 1024;
+    size_t row_bytes = std::max<size_t>(1, bytes / std::max<uint64>(1, rows));
+    long wanted = static_cast<long>(std::min<size_t>(target / row_bytes, LONG_MAX));
+    return std::clamp<long>(std::min(wanted, current * 2), 1, fetch_batch_size);
+}
+
+// Reads (id, sequence) rows from an SPI cursor. Only opening the cursor and fetching need an SPI connection, so a
+// cursor can be kept open between calls of a value-per-call function. Rows may also hold several sequences, such as
+// (id, first mate, second mate) rows of mate pairs.
+class NuclseqCursor {
+public:
+    NuclseqCursor(const char* sql, Oid nuclseq_oid, MemoryContext parent_ctx, int sequence_columns = 1) :
+            portal(SPI_cursor_open_with_args(nullptr, sql, 0, nullptr, nullptr, nullptr, true, 0)),
+            nuclseq_oid(nuclseq_oid),
+            sequence_columns(sequence_columns),
+            id_type(InvalidOid),
+            batch_size(std::min(16, fetch_batch_size)),
+            // Detoasted sequences and anything f allocates are freed after every batch, so memory usage does not grow
+            // with the size of the table.
+            batch_ctx(AllocSetContextCreate(parent_ctx, "bioseqdb fetch batch", ALLOCSET_DEFAULT_SIZES)) {}
+
+    // Calls f for every row of the next batch, and returns false once the cursor is exhausted. Rows with several
+    // sequences call f once for each, in column order, and are skipped whole if any of their values is null.
+    template<typename F>
+    bool fetch_batch(F f) {
+        SPI_cursor_fetch(portal, true, batch_size);
+        if (SPI_processed == 0 || SPI_tuptable == NULL)
+            return false;
+
+        uint64 n = SPI_processed;
+        SPITupleTable* tuptable = SPI_tuptable;
+        TupleDesc tupdesc = tuptable->tupdesc;
+        size_t batch_bytes = 0;
 
-            Datum id = SPI_getbinval(tup, tupdesc, 1, &null_id);
-            Datum nucls = SPI_getbinval(tup, tupdesc, 2, &null_seq);
+        if (id_type == InvalidOid)
+            id_type = check_nuclseq_table_columns(tupdesc, nuclseq_oid, sequence_columns);
 
-            if (!null_id && !null_seq)
-                f(static_cast<int64_t>(id), reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(nucls)));
+        MemoryContext old_ctx = MemoryContextSwitchTo(batch_ctx);
+        for(uint64 i = 0 ; i < n; i++) {
+            HeapTuple tup = tuptable->vals[i];
+            bool null_id = false;
+            std::array<bool, 2> null_seqs {};
+            std::array<Datum, 2> nucls;
+
+            // Column types were checked on the first batch, so values are read straight from the tuple.
+            Datum id = heap_getattr(tup, 1, tupdesc, &null_id);
+            for (int column = 0; column < sequence_columns; column++)
+                nucls[column] = heap_getattr(tup, 2 + column, tupdesc, &null_seqs[column]);
+
+            if (!null_id && std::none_of(null_seqs.begin(), null_seqs.begin() + sequence_columns, [](bool null) { return null; })) {
+                for (int column = 0; column < sequence_columns; column++) {
+                    auto seq = detoast_nuclseq(nucls[column]);
+                    batch_bytes += VARSIZE(seq);
+                    f(id_from_datum(id, id_type), seq);
+                }
+            }
         }
+        MemoryContextSwitchTo(old_ctx);
+        MemoryContextReset(batch_ctx);
 
         SPI_freetuptable(tuptable);
-        SPI_cursor_fetch(portal, true, batch_size);
+        batch_size = next_batch_size(batch_size, n, batch_bytes);
+        return true;
     }
-    return portal;
 
+    void close() {
+        SPI_cursor_close(portal);
+        MemoryContextDelete(batch_ctx);
+    }
+
+private:
+    Portal portal;
+    Oid nuclseq_oid;
+    int sequence_columns;
+    Oid id_type;
+    long batch_size;
+    MemoryContext batch_ctx;
+};
+
+template<typename F>
+void iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
+    NuclseqCursor cursor(sql, nuclseq_oid, CurrentMemoryContext);
+    while (cursor.fetch_batch(f)) {}
+    cursor.close();
 }
 
 int32_t get_opt_or(HeapTupleHeader opts, const char *name, int32_t defval) {
@@ -208,31 +607,399 @@ int32_t get_opt_or(HeapTupleHeader opts, const char *name, int32_t defval) {
     return num;
 }
 
-BwaIndex bwa_index_from_query(const char* sql, HeapTupleHeader opts, Oid nuclseq_oid) {
-    BwaIndex bwa;
-    size_t count = 0;
+mem_opt_t bwa_options_from(HeapTupleHeader opts, size_t sequence_count) {
+    mem_opt_t options = bwa_default_options();
+    options.max_occ = get_opt_or(opts, "max_occ", std::max<int>(500, sequence_count * 2));
+    options.min_seed_len = get_opt_or(opts, "min_seed_len", 19);
+    options.a = get_opt_or(opts, "match_score", 1);
+    options.b = get_opt_or(opts, "mismatch_penalty", 4);
+    options.pen_clip3 = get_opt_or(opts, "pen_clip3", 5);
+    options.pen_clip5 = get_opt_or(opts, "pen_clip5", 5);
+    options.zdrop = get_opt_or(opts, "zdrop", 100);
+    options.w = get_opt_or(opts, "bandwidth", 100);
+    options.o_del = get_opt_or(opts, "o_del", 6);
+    options.o_ins = get_opt_or(opts, "o_ins", 6);
+    options.e_del = get_opt_or(opts, "e_del", 1);
+    options.e_ins = get_opt_or(opts, "e_ins", 1);
+    options.n_threads = get_opt_or(opts, "threads", 1);
+    // libbwa scores mismatches through the precomputed matrix, not the a and b fields.
+    mem_fill_scmat(options.a, options.b, options.mat);
+    return options;
+}
+
+// Kept for the whole backend, so the query profile built by one call is reused by the next one with the same query.
+BwaPairAligner pair_aligner;
+
+HeapTuple build_tuple_alignment(std::optional<int64_t> target_id, const BwaPairAlignment& alignment, TupleDesc tupledesc) {
+    std::array<Datum, 6> values { {
+        Int32GetDatum(alignment.score),
+        PointerGetDatum(bwa_cigar_to_text(alignment.cigar_ops.data(), alignment.cigar_ops.size())),
+        Int32GetDatum(alignment.query_begin),
+        Int32GetDatum(alignment.query_end),
+        Int32GetDatum(alignment.target_begin),
+        Int32GetDatum(alignment.target_end),
+    } };
+    std::array<bool, 6> nulls{};
+    if (!target_id)
+        return heap_form_tuple(tupledesc, values.data(), nulls.data());
+
+    std::array<Datum, 7> id_values;
+    std::array<bool, 7> id_nulls{};
+    id_values[0] = Int64GetDatum(*target_id);
+    std::copy(values.begin(), values.end(), id_values.begin() + 1);
+    return heap_form_tuple(tupledesc, id_values.data(), id_nulls.data());
+}
+
+size_t shard_bases_from(int64_t shard_bases) {
+    if (shard_bases < 0 || static_cast<uint64_t>(shard_bases) > bwa_max_index_bases)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("shard size must be between 0 and %zu bases", bwa_max_index_bases));
+    return shard_bases == 0 ? bwa_max_index_bases : static_cast<size_t>(shard_bases);
+}
+
+// References are split into consecutive shards of at most shard_bases bases, as one FM-index can only hold so many, and
+// building one takes memory proportional to its size. A single reference larger than that still gets a shard of its
+// own. There is always at least one shard, even without any references. f is called with every added reference.
+template<typename F>
+std::vector<std::shared_ptr<BwaIndex>> read_reference_shards(const char* sql, Oid nuclseq_oid, size_t shard_bases, F f) {
+    std::vector<std::shared_ptr<BwaIndex>> shards { std::make_shared<BwaIndex>() };
+    iterate_nuclseq_table(sql, nuclseq_oid, [&](auto id, auto nucls) {
+        size_t bases = pac_byte_size(nucls->len) * 4;
+        if (shards.back()->sequence_count() > 0 && shards.back()->reference_bases() + bases > shard_bases)
+            shards.push_back(std::make_shared<BwaIndex>());
+        shards.back()->add_ref_sequence(id, *nucls);
+        f(*nucls);
+    });
+    return shards;
+}
+
+std::vector<std::shared_ptr<const BwaIndex>> bwa_index_from_query(const char* sql, Oid nuclseq_oid, int sa_interval, int threads) {
+    std::vector<std::shared_ptr<const BwaIndex>> segments;
+    for (std::shared_ptr<BwaIndex>& shard : read_reference_shards(sql, nuclseq_oid, bwa_max_index_bases, [](const auto&) {})) {
+        with_exceptions_as_errors([&] { shard->build(sa_interval, threads); });
+        segments.push_back(std::move(shard));
+    }
+    return segments;
+}
+
+// Pairing and SAM records are not merged across segments, so they need an index of a single shard without unmerged
+// delta segments.
+std::shared_ptr<const BwaIndex> acquire_merged_index(const text* index_name) {
+    std::vector<IndexSegmentNumber> numbers;
+    std::vector<std::shared_ptr<const BwaIndex>> segments = bwa_index_acquire_segments(index_name, &numbers);
+    if (!numbers.back().shard.has_value()) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("bwa index \"%s\" has delta segments that are not merged", text_to_cstring(index_name)),
+                errhint("Merge them with bwa_index_merge.")));
+    }
+    if (segments.size() > 1) {
+        raise_pg_error(ERRCODE_FEATURE_NOT_SUPPORTED,
+                errmsg("bwa index \"%s\" is split into %zu shards, which this search does not support", text_to_cstring(index_name), segments.size()));
+    }
+    return segments[0];
+}
+
+// Creating, appending to, merging and dropping an index replace files of several segments, so they are serialized per
+// index name with a lock held until the end of the transaction. Searches never wait for it. Index files are shared by
+// every database, so the lock is taken with no database. It is an advisory lock tag with 3 as the last field, which
+// pg_advisory_lock never uses, as it sets 1 for bigint keys and 2 for pairs of integer keys.
+void lock_index_segments(const text* index_name) {
+    uint64 key = hash_bytes_extended(reinterpret_cast<const unsigned char*>(VARDATA_ANY(index_name)), VARSIZE_ANY_EXHDR(index_name), 0);
+    LOCKTAG tag;
+    SET_LOCKTAG_ADVISORY(tag, InvalidOid, static_cast<uint32>(key >> 32), static_cast<uint32>(key), 3);
+    (void) LockAcquire(&tag, ExclusiveLock, false, false);
+}
+
+// Writing to a temporary file first guarantees that concurrent searches never observe a partial index.
+void save_index_file(const BwaIndex& bwa, const std::string& path) {
+    if (MakePGDirectory(index_directory) < 0 && errno != EEXIST)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create directory \"%s\": %m", index_directory)));
+
+    std::string temp_path = path + ".tmp";
+    bwa.save(temp_path.c_str());
+    durable_rename(temp_path.c_str(), path.c_str(), ERROR);
+}
+
+// Shards and delta segments left behind by a drop that did not finish must not become part of a new index.
+void remove_stale_segments(const text* index_name) {
+    for (uint32_t shard : bwa_index_extra_shards(index_name))
+        durable_unlink(bwa_index_shard_path(index_name, shard).c_str(), ERROR);
+    for (uint64_t segment : bwa_index_delta_segments(index_name))
+        durable_unlink(bwa_index_segment_path(index_name, segment).c_str(), ERROR);
+}
+
+// Deltas are merged in order, first into the last shard while it stays within shard_bases, and then into new shards.
+// Every shard replaced or added records the last delta merged so far, so searches skip the deltas it covers even
+// before they are removed, and see a consistent index after every single file is renamed into place. on_merged is
+// called with the number and the built index of every such shard, in order.
+template<typename F>
+void merge_index_segments(const std::vector<std::shared_ptr<const BwaIndex>>& segments, const std::vector<IndexSegmentNumber>& numbers,
+        int threads, size_t shard_bases, const std::function<void(BwaBuildStep)>& on_step, F on_merged) {
+    size_t shards = std::count_if(numbers.begin(), numbers.end(), [](const auto& number) { return number.shard.has_value(); });
+    uint32_t target = *numbers[shards - 1].shard;
+    std::shared_ptr<const BwaIndex> base = segments[shards - 1];
+    for (size_t next = shards; next < segments.size();) {
+        size_t bases = base != nullptr ? base->reference_bases() : 0;
+        size_t end = next;
+        while (end < segments.size() && ((base == nullptr && end == next) || bases + segments[end]->reference_bases() <= shard_bases))
+            bases += segments[end++]->reference_bases();
+
+        if (end > next) {
+            auto merged = std::make_shared<BwaIndex>();
+            if (base != nullptr)
+                merged->add_ref_sequences(*base);
+            for (size_t segment = next; segment < end; segment++)
+                merged->add_ref_sequences(*segments[segment]);
+            with_exceptions_as_errors([&] { merged->build(segments[0]->sa_interval(), threads, on_step); });
+            merged->set_last_merged_segment(numbers[end - 1].delta);
+            on_merged(target, std::move(merged));
+        }
+        next = end;
+        base = nullptr;
+        target++;
+    }
+}
+
+// Removes the files of deltas up to the last one merged, once the shards covering them are in place, including ones
+// left behind by a merge that did not finish.
+void remove_merged_deltas(const text* index_name, const std::vector<uint64_t>& deltas, uint64_t last_merged) {
+    for (uint64_t segment : deltas) {
+        if (segment > last_merged)
+            break;
+        durable_unlink(bwa_index_segment_path(index_name, segment).c_str(), ERROR);
+        bwa_index_forget_segment(index_name, segment);
+    }
+}
+
+void check_index_build_options(int32_t sa_interval, int32_t threads) {
+    if (sa_interval <= 0 || (sa_interval & (sa_interval - 1)) != 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("suffix array interval must be a positive power of two"));
+    if (threads < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("number of threads must not be negative"));
+}
+
+// Passed to the background worker of a build through bgw_extra.
+struct IndexBuildRequest {
+    int64_t build_id;
+    // The worker waits for the submitting transaction, as the queue row is only visible once it commits.
+    TransactionId submitter_xid;
+    Oid database;
+    Oid user;
+    // Schema of the extension, holding the queue table.
+    Oid schema;
+    Oid nuclseq_oid;
+};
+static_assert(sizeof(IndexBuildRequest) <= BGW_EXTRALEN, "This should not happen");
+
+std::string build_queue_table(Oid schema) {
+    return quote_qualified_identifier(get_namespace_name(schema), "bwa_index_build_queue");
+}
+
+// Background workers start outside of any transaction, and run every statement in a transaction of its own.
+template<typename F>
+void in_worker_transaction(F f) {
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "SPI_connect returned %d", ret);
+    PushActiveSnapshot(GetTransactionSnapshot());
+    f();
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+IndexBuildPhase build_phase_of(BwaBuildStep step) {
+    switch (step) {
+        case BwaBuildStep::sorting_suffixes: return IndexBuildPhase::sorting_suffixes;
+        case BwaBuildStep::counting_occurrences: return IndexBuildPhase::counting_occurrences;
+        case BwaBuildStep::sampling_suffix_array: return IndexBuildPhase::sampling_suffix_array;
+    }
+    return IndexBuildPhase::sorting_suffixes;
+}
+
+// A queue row claimed by its worker, with the columns that matter for the kind of job.
+struct ClaimedIndexBuild {
+    std::string kind;
+    std::string index_name;
+    std::string reference_sql;
+    int32_t sa_interval;
+    int32_t threads;
+    int64_t shard_bases;
+};
+
+// Returns nothing when the submitting transaction rolled back, or the build was cancelled before it started.
+std::optional<ClaimedIndexBuild> claim_index_build(const IndexBuildRequest& request) {
+    StartTransactionCommand();
+    XactLockTableWait(request.submitter_xid, nullptr, nullptr, XLTW_None);
+    CommitTransactionCommand();
+
+    std::optional<ClaimedIndexBuild> claimed;
+    in_worker_transaction([&] {
+        std::string sql = "UPDATE " + build_queue_table(request.schema) + " SET status = 'running', started_at = now() "
+                "WHERE build_id = $1 AND status = 'queued' RETURNING kind, index_name, reference_sql, sa_interval, threads, shard_bases";
+        std::array<Oid, 1> types { {INT8OID} };
+        std::array<Datum, 1> values { {Int64GetDatum(request.build_id)} };
+        if (SPI_execute_with_args(sql.c_str(), 1, types.data(), values.data(), nullptr, false, 1) != SPI_OK_UPDATE_RETURNING)
+            elog(ERROR, "could not claim bwa index build %lld", static_cast<long long>(request.build_id));
+        if (SPI_processed == 0)
+            return;
+
+        HeapTuple row = SPI_tuptable->vals[0];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        bool null = false;
+        // Merges have no reference query, and use the suffix array interval of the index.
+        const char* reference_sql = SPI_getvalue(row, tupdesc, 3);
+        int32_t sa_interval = DatumGetInt32(SPI_getbinval(row, tupdesc, 4, &null));
+        claimed = ClaimedIndexBuild {
+            .kind = SPI_getvalue(row, tupdesc, 1),
+            .index_name = SPI_getvalue(row, tupdesc, 2),
+            .reference_sql = reference_sql != nullptr ? reference_sql : "",
+            .sa_interval = null ? 0 : sa_interval,
+            .threads = DatumGetInt32(SPI_getbinval(row, tupdesc, 5, &null)),
+            .shard_bases = DatumGetInt64(SPI_getbinval(row, tupdesc, 6, &null)),
+        };
+    });
+    return claimed;
+}
+
+// The queue row is updated before any file is renamed into place, so a build cancelled in the meantime is not saved, and
+// a failure to save rolls the update back. save is called with the segments of the index locked.
+template<typename F>
+void finish_index_build(const IndexBuildRequest& request, const std::string& index_name, uint64_t sequences, uint64_t bases, F save) {
+    in_worker_transaction([&] {
+        std::string sql = "UPDATE " + build_queue_table(request.schema) + " SET status = 'done', finished_at = now(), "
+                "sequences = $2, bases = $3 WHERE build_id = $1 AND status = 'running'";
+        std::array<Oid, 3> types { {INT8OID, INT8OID, INT8OID} };
+        std::array<Datum, 3> values { {Int64GetDatum(request.build_id), Int64GetDatum(sequences), Int64GetDatum(bases)} };
+        if (SPI_execute_with_args(sql.c_str(), 3, types.data(), values.data(), nullptr, false, 0) != SPI_OK_UPDATE)
+            elog(ERROR, "could not finish bwa index build %lld", static_cast<long long>(request.build_id));
+        if (SPI_processed == 0)
+            return;
+
+        const text* name = cstring_to_text(index_name.c_str());
+        lock_index_segments(name);
+        save(name);
+    });
+}
+
+// References are read in a transaction of their own, so no snapshot is held while the FM-index is built. libbwa does
+// not check for interrupts, so cancelling a build takes effect before the next step of building.
+void run_index_create(const IndexBuildRequest& request, const ClaimedIndexBuild& build) {
+    std::string activity = "building bwa index " + build.index_name;
+    pgstat_report_activity(STATE_RUNNING, activity.c_str());
+
+    std::vector<std::shared_ptr<BwaIndex>> shards;
+    uint64_t sequences = 0;
+    uint64_t bases = 0;
+    in_worker_transaction([&] {
+        index_build_report(request.build_id, IndexBuildPhase::reading_references, sequences, bases);
+        shards = read_reference_shards(build.reference_sql.c_str(), request.nuclseq_oid, shard_bases_from(build.shard_bases), [&](const auto& nucls) {
+            bases += nucls.len;
+            index_build_report(request.build_id, IndexBuildPhase::reading_references, ++sequences, bases);
+        });
+    });
+
+    for (std::shared_ptr<BwaIndex>& shard : shards) {
+        with_exceptions_as_errors([&] {
+            shard->build(build.sa_interval, build.threads, [&](BwaBuildStep step) {
+                CHECK_FOR_INTERRUPTS();
+                index_build_report(request.build_id, build_phase_of(step), sequences, bases);
+            });
+        });
+    }
+    CHECK_FOR_INTERRUPTS();
+    index_build_report(request.build_id, IndexBuildPhase::saving, sequences, bases);
+
+    finish_index_build(request, build.index_name, sequences, bases, [&](const text* name) {
+        if (bwa_index_exists(name))
+            raise_pg_error(ERRCODE_DUPLICATE_OBJECT, errmsg("bwa index \"%s\" already exists", build.index_name.c_str()));
+        remove_stale_segments(name);
+        for (size_t shard = shards.size(); shard-- > 0;)
+            save_index_file(*shards[shard], bwa_index_shard_path(name, shard));
+    });
+}
 
-    Portal portal = iterate_nuclseq_table(sql, nuclseq_oid, [&](auto id, auto nucls){
-        bwa.add_ref_sequence(id, *nucls);
-        count++;
+// The segments are read without the lock, so appends and searches go on during the merge. The merged shards are only
+// saved if the shards and deltas read are still the first segments of the index; deltas appended since then are kept.
+void run_index_merge(const IndexBuildRequest& request, const ClaimedIndexBuild& build) {
+    std::string activity = "merging bwa index " + build.index_name;
+    pgstat_report_activity(STATE_RUNNING, activity.c_str());
+
+    const text* name = cstring_to_text(build.index_name.c_str());
+    size_t shard_bases = shard_bases_from(build.shard_bases);
+    std::vector<IndexSegmentNumber> numbers;
+    std::vector<std::shared_ptr<const BwaIndex>> segments;
+    in_worker_transaction([&] {
+        if (!bwa_index_exists(name))
+            raise_pg_error(ERRCODE_UNDEFINED_OBJECT, errmsg("bwa index \"%s\" does not exist", build.index_name.c_str()));
+        segments = bwa_index_acquire_segments(name, &numbers);
     });
-    SPI_cursor_close(portal);
-    bwa.options->max_occ = get_opt_or(opts, "max_occ", std::max<int>(500, count * 2));
-    bwa.options->min_seed_len = get_opt_or(opts, "min_seed_len", 19);
-    bwa.options->a = get_opt_or(opts, "match_score", 1);
-    bwa.options->b = get_opt_or(opts, "mismatch_penalty", 4);
-    bwa.options->pen_clip3 = get_opt_or(opts, "pen_clip3", 5);
-    bwa.options->pen_clip5 = get_opt_or(opts, "pen_clip5", 5);
-    bwa.options->zdrop = get_opt_or(opts, "zdrop", 100);
-    bwa.options->w = get_opt_or(opts, "bandwidth", 100);
-    bwa.options->o_del = get_opt_or(opts, "o_del", 6);
-    bwa.options->o_ins = get_opt_or(opts, "o_ins", 6);
-    bwa.options->e_del = get_opt_or(opts, "e_del", 1);
-    bwa.options->e_ins = get_opt_or(opts, "e_ins", 1);
 
-    bwa.build();
+    uint64_t sequences = 0;
+    uint64_t bases = 0;
+    uint64_t last_merged = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        last_merged = std::max({last_merged, numbers[i].delta, segments[i]->last_merged_segment()});
+        if (!numbers[i].shard.has_value()) {
+            sequences += segments[i]->sequence_count();
+            bases += segments[i]->reference_bases();
+        }
+    }
+
+    std::vector<std::pair<uint32_t, std::shared_ptr<BwaIndex>>> merged;
+    merge_index_segments(segments, numbers, build.threads, shard_bases, [&](BwaBuildStep step) {
+        CHECK_FOR_INTERRUPTS();
+        index_build_report(request.build_id, build_phase_of(step), sequences, bases);
+    }, [&](uint32_t shard, std::shared_ptr<BwaIndex> bwa) {
+        merged.emplace_back(shard, std::move(bwa));
+    });
+    CHECK_FOR_INTERRUPTS();
+    index_build_report(request.build_id, IndexBuildPhase::saving, sequences, bases);
+
+    finish_index_build(request, build.index_name, sequences, bases, [&](const text* name) {
+        std::vector<IndexSegmentNumber> current;
+        std::vector<std::shared_ptr<const BwaIndex>> current_segments;
+        if (bwa_index_exists(name))
+            current_segments = bwa_index_acquire_segments(name, &current);
+        bool unchanged = current.size() >= numbers.size();
+        for (size_t i = 0; unchanged && i < numbers.size(); i++) {
+            unchanged = current[i].shard == numbers[i].shard && current[i].delta == numbers[i].delta
+                    && current_segments[i]->last_merged_segment() == segments[i]->last_merged_segment();
+        }
+        if (!unchanged) {
+            raise_pg_error(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE,
+                    errmsg("bwa index \"%s\" was changed while its deltas were being merged", build.index_name.c_str()));
+        }
+        for (const auto& [shard, bwa] : merged)
+            save_index_file(*bwa, bwa_index_shard_path(name, shard));
+        remove_merged_deltas(name, bwa_index_delta_segments(name), last_merged);
+    });
+}
+
+void run_index_build(const IndexBuildRequest& request) {
+    std::optional<ClaimedIndexBuild> build = claim_index_build(request);
+    if (!build)
+        return;
+    if (build->kind == "merge")
+        run_index_merge(request, *build);
+    else
+        run_index_create(request, *build);
+}
+
+void record_index_build_failure(const IndexBuildRequest& request, const char* message) {
+    in_worker_transaction([&] {
+        std::string sql = "UPDATE " + build_queue_table(request.schema) + " SET status = 'failed', finished_at = now(), "
+                "error = $2 WHERE build_id = $1 AND status IN ('queued', 'running')";
+        std::array<Oid, 2> types { {INT8OID, TEXTOID} };
+        std::array<Datum, 2> values { {Int64GetDatum(request.build_id), CStringGetTextDatum(message)} };
+        SPI_execute_with_args(sql.c_str(), 2, types.data(), values.data(), nullptr, false, 0);
+    });
+}
 
-    return bwa;
+// Functions that do not return nucleotide sequences find the type next to themselves, in the extension schema.
+Oid get_nuclseq_oid(FunctionCallInfo fcinfo) {
+    Oid namespace_oid = get_func_namespace(fcinfo->flinfo->fn_oid);
+    return GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid, CStringGetDatum("nuclseq"), ObjectIdGetDatum(namespace_oid));
 }
 
 void assert_can_return_set(ReturnSetInfo* rsi) {
@@ -279,31 +1046,370 @@ Tuplestorestate* create_tuplestore(ReturnSetInfo* rsi, TupleDesc& tupledesc) {
     return tupstore;
 }
 
-HeapTuple build_tuple_bwa(std::optional<int64_t> query_id, const BwaMatch& match, TupleDesc& tupledesc) {
-    std::array<Datum, 15> values { {
+// Subsequences are sliced straight from the packed reference and query, and the CIGAR is formatted from the operations
+// libbwa returned, so results never go through an intermediate textual form. Results of paired searches have three more
+// columns, about the mate and its pair.
+HeapTuple build_tuple_bwa(std::optional<int64_t> query_id, const NucleotideSequence& query, const BwaQueryMatches& result,
+        const BwaMatch& match, const BwaSegmentedIndex& bwa, std::optional<int32_t> mate, TupleDesc& tupledesc) {
+    NucleotideSequence* query_subseq = nuclseq_from_slice(query.holes(), query.holes_num,
+            query.pac() + match.query_match_begin / 4, match.query_match_begin, match.query_match_end);
+    bool is_proper_pair = result.paired_match == static_cast<uint32_t>(&match - result.matches.data());
+    std::array<Datum, 18> values { {
         Int64GetDatum(match.ref_id),
-        PointerGetDatum(nuclseq_from_text(match.ref_subseq)),
+        PointerGetDatum(bwa.ref_subseq(match)),
         Int32GetDatum(match.ref_match_begin),
         Int32GetDatum(match.ref_match_end),
         Int32GetDatum(match.ref_match_len),
         Int64GetDatum(query_id.value_or(0)),
-        PointerGetDatum(nuclseq_from_text(match.query_subseq)),
+        PointerGetDatum(query_subseq),
         Int32GetDatum(match.query_match_begin),
         Int32GetDatum(match.query_match_end),
         Int32GetDatum(match.query_match_len),
         BoolGetDatum(match.is_primary),
         BoolGetDatum(match.is_secondary),
         BoolGetDatum(match.is_reverse),
-        PointerGetDatum(string_view_to_text(match.cigar)),
+        PointerGetDatum(bwa_cigar_to_text(result.cigar_ops.data() + match.cigar_offset, match.cigar_len)),
         Int32GetDatum(match.score),
+        Int32GetDatum(mate.value_or(0)),
+        BoolGetDatum(is_proper_pair),
+        Int64GetDatum(result.insert_size),
     } };
 
-    std::array<bool, 15> nulls{};
+    std::array<bool, 18> nulls{};
     nulls[5] = !query_id.has_value();
+    nulls[15] = !mate.has_value();
+    nulls[17] = !is_proper_pair;
 
     return heap_form_tuple(tupledesc, values.data(), nulls.data());
 }
 
+void put_single_search_results(Tuplestorestate* tupstore, TupleDesc tupledesc, BwaSegmentedIndex& bwa, const mem_opt_t& options, const NucleotideSequence& nucls) {
+    BwaQueryMatches result;
+    with_exceptions_as_errors([&] { bwa.align_sequence(options, nucls, result); });
+
+    for (const BwaMatch& match : result.matches) {
+        HeapTuple tuple = build_tuple_bwa(std::nullopt, nucls, result, match, bwa, std::nullopt, tupledesc);
+        tuplestore_puttuple(tupstore, tuple);
+        heap_freetuple(tuple);
+    }
+}
+
+// Multi searches return their results with the value-per-call protocol. Queries are aligned one fetched batch at a
+// time, so results for early queries are returned while later ones have not even been read, and a caller that stops
+// early never aligns the rest. Batches grow along with the fetch size, which gives worker threads enough work between
+// the sequential steps of fetching queries and building result tuples.
+//
+// Paired searches read (id, first mate, second mate) rows. Both mates of every pair are aligned in the same batch, and
+// the insert size distribution used for pairing is estimated batch by batch.
+class MultiSearch {
+public:
+    struct Row {
+        int64_t query_id;
+        const NucleotideSequence* query;
+        const BwaQueryMatches* result;
+        const BwaMatch* match;
+        std::optional<int32_t> mate;
+    };
+
+    // Opens the query cursor, so it must be called inside an SPI connection.
+    MultiSearch(BwaSegmentedIndex bwa, const mem_opt_t& options, const char* query_sql, Oid nuclseq_oid, bool paired, MemoryContext ctx) :
+            bwa(std::move(bwa)), options(options), paired(paired), cursor(query_sql, nuclseq_oid, ctx, paired ? 2 : 1),
+            // Packed copies of the queries of the current batch, which its results are sliced from.
+            queries_ctx(AllocSetContextCreate(ctx, "bioseqdb query batch", ALLOCSET_DEFAULT_SIZES)),
+            exhausted(false), query_pos(0), match_pos(0) {}
+
+    // Returns the next match along with its query, or nothing after the last one.
+    std::optional<Row> next() {
+        while (true) {
+            for (; query_pos < ids.size(); query_pos++, match_pos = 0) {
+                const BwaQueryMatches& result = results[query_pos];
+                if (match_pos < result.matches.size()) {
+                    std::optional<int32_t> mate = paired ? std::optional<int32_t>(query_pos % 2 + 1) : std::nullopt;
+                    return Row{ids[query_pos], queries[query_pos], &result, &result.matches[match_pos++], mate};
+                }
+            }
+            if (exhausted)
+                return std::nullopt;
+            align_next_batch();
+        }
+    }
+
+    const BwaSegmentedIndex& index() const { return bwa; }
+
+private:
+    // Query codes, matches and CIGAR buffers are reused from batch to batch, so once they have grown to fit a batch,
+    // aligning the following ones does not allocate outside of libbwa.
+    void align_next_batch() {
+        ids.clear();
+        queries.clear();
+        batch.clear();
+        MemoryContextReset(queries_ctx);
+
+        if (int ret = SPI_connect(); ret < 0)
+            elog(ERROR, "connectby: SPI_connect returned %d", ret);
+        bool fetched = cursor.fetch_batch([&](auto id, auto nuclseq) {
+            auto copy = static_cast<NucleotideSequence*>(MemoryContextAlloc(queries_ctx, VARSIZE(nuclseq)));
+            memcpy(copy, nuclseq, VARSIZE(nuclseq));
+            ids.push_back(id);
+            queries.push_back(copy);
+            batch.add(*nuclseq);
+        });
+        if (!fetched) {
+            cursor.close();
+            exhausted = true;
+        }
+        SPI_finish();
+
+        with_exceptions_as_errors([&] {
+            if (paired)
+                bwa.segment(0).align_pairs(options, batch, insert_sizes, results);
+            else
+                bwa.align_sequences(options, batch, results);
+        });
+        query_pos = 0;
+        match_pos = 0;
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    BwaSegmentedIndex bwa;
+    mem_opt_t options;
+    bool paired;
+    BwaInsertSizes insert_sizes;
+    NuclseqCursor cursor;
+    MemoryContext queries_ctx;
+    bool exhausted;
+    std::vector<int64_t> ids;
+    std::vector<const NucleotideSequence*> queries;
+    BwaQueryBatch batch;
+    std::vector<BwaQueryMatches> results;
+    size_t query_pos;
+    size_t match_pos;
+};
+
+// Alignments of queries as SAM records, aligned one fetched batch at a time like in MultiSearch. Records are built by
+// the worker threads straight from the alignments of libbwa, and only their text form is made on the backend thread.
+class SamExport {
+public:
+    // Opens the query cursor, so it must be called inside an SPI connection.
+    SamExport(std::shared_ptr<const BwaIndex> bwa, const mem_opt_t& options, const char* query_sql, Oid nuclseq_oid, MemoryContext ctx) :
+            bwa(std::move(bwa)), options(options), cursor(query_sql, nuclseq_oid, ctx), header(this->bwa->sam_header()),
+            exhausted(false), query_pos(0), record_pos(0), header_pos(0), line{} {}
+
+    ~SamExport() {
+        sam_hdr_destroy(header);
+        free(line.s);
+    }
+
+    SamExport(const SamExport&) = delete;
+    SamExport& operator=(const SamExport&) = delete;
+
+    const sam_hdr_t* sam_header() const { return header; }
+
+    // Returns the next record, or nullptr after the last one.
+    const bam1_t* next() {
+        while (true) {
+            for (; query_pos < ids.size(); query_pos++, record_pos = 0) {
+                if (record_pos < records[query_pos].size())
+                    return records[query_pos][record_pos++];
+            }
+            if (exhausted)
+                return nullptr;
+            align_next_batch();
+        }
+    }
+
+    // Returns the next line of SAM text without its line break, starting with the lines of the header.
+    std::optional<std::string_view> next_line() {
+        std::string_view header_text(sam_hdr_str(header), sam_hdr_length(header));
+        if (header_pos < header_text.size()) {
+            size_t end = std::min(header_text.find('\n', header_pos), header_text.size());
+            std::string_view header_line = header_text.substr(header_pos, end - header_pos);
+            header_pos = end + 1;
+            return header_line;
+        }
+
+        const bam1_t* record = next();
+        if (record == nullptr)
+            return std::nullopt;
+        if (sam_format1(header, record, &line) < 0)
+            raise_pg_error(ERRCODE_OUT_OF_MEMORY, errmsg("could not format sam record"));
+        return std::string_view(line.s, line.l);
+    }
+
+private:
+    void align_next_batch() {
+        ids.clear();
+        batch.clear();
+
+        if (int ret = SPI_connect(); ret < 0)
+            elog(ERROR, "connectby: SPI_connect returned %d", ret);
+        bool fetched = cursor.fetch_batch([&](auto id, auto nuclseq) {
+            ids.push_back(id);
+            batch.add(*nuclseq);
+        });
+        if (!fetched) {
+            cursor.close();
+            exhausted = true;
+        }
+        SPI_finish();
+
+        with_exceptions_as_errors([&] { bwa->align_to_sam(options, batch, ids, records); });
+        for (const BwaSamRecords& query_records : records) {
+            if (query_records.failed)
+                raise_pg_error(ERRCODE_OUT_OF_MEMORY, errmsg("could not allocate sam record"));
+        }
+        query_pos = 0;
+        record_pos = 0;
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    std::shared_ptr<const BwaIndex> bwa;
+    mem_opt_t options;
+    NuclseqCursor cursor;
+    sam_hdr_t* header;
+    bool exhausted;
+    std::vector<int64_t> ids;
+    BwaQueryBatch batch;
+    std::vector<BwaSamRecords> records;
+    size_t query_pos;
+    size_t record_pos;
+    size_t header_pos;
+    kstring_t line;
+};
+
+// SAM or BAM file written by an export. It is closed by the destructor when the export fails, so errors leak neither the
+// file nor the compression threads of htslib.
+class SamOutput {
+public:
+    SamOutput(): file(nullptr), path() {}
+
+    ~SamOutput() {
+        if (file != nullptr)
+            sam_close(file);
+    }
+
+    SamOutput(const SamOutput&) = delete;
+    SamOutput& operator=(const SamOutput&) = delete;
+
+    void open(const char* path, bool bam, int threads, const sam_hdr_t* header) {
+        this->path = path;
+        file = sam_open(path, bam ? "wb" : "w");
+        if (file == nullptr)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not open file \"%s\" for writing: %m", path)));
+        // BGZF compression runs on its own thread pool, which must not receive signals meant for the backend.
+        int compression_threads = resolve_thread_count(threads);
+        if (bam && compression_threads > 1)
+            with_signals_blocked([&] { hts_set_threads(file, compression_threads); });
+        if (sam_hdr_write(file, header) < 0)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not write file \"%s\": %m", path)));
+    }
+
+    void write(const sam_hdr_t* header, const bam1_t* record) {
+        if (sam_write1(file, header, record) < 0)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not write file \"%s\": %m", path.c_str())));
+    }
+
+    void close() {
+        int ret = sam_close(file);
+        file = nullptr;
+        if (ret < 0)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not close file \"%s\": %m", path.c_str())));
+    }
+
+private:
+    samFile* file;
+    std::string path;
+};
+
+// Makes a memory context own an object, which is destroyed when the context is reset or deleted, including when the
+// query fails.
+template<typename T>
+T* owned_by_context(MemoryContext ctx, T* object) {
+    auto callback = static_cast<MemoryContextCallback*>(MemoryContextAlloc(ctx, sizeof(MemoryContextCallback)));
+    callback->func = [](void* arg) { delete static_cast<T*>(arg); };
+    callback->arg = object;
+    MemoryContextRegisterResetCallback(ctx, callback);
+    return object;
+}
+
+// Stores the search in the memory of the whole call sequence. The object is owned by that memory context, so it is
+// destroyed both after the last row and when the executor stops calling early or fails.
+template<typename Search>
+void start_multi_search(FuncCallContext* funcctx, Search* search) {
+    funcctx->user_fctx = owned_by_context(funcctx->multi_call_memory_ctx, search);
+}
+
+TupleDesc bless_retval_tupledesc(FunctionCallInfo fcinfo, FuncCallContext* funcctx) {
+    MemoryContext old_ctx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    TupleDesc tupledesc = BlessTupleDesc(CreateTupleDescCopy(get_retval_tupledesc(fcinfo)));
+    MemoryContextSwitchTo(old_ctx);
+    funcctx->tuple_desc = tupledesc;
+    return tupledesc;
+}
+
+Datum return_next_multi_search_result(FunctionCallInfo fcinfo) {
+    FuncCallContext* funcctx = SRF_PERCALL_SETUP();
+    auto search = static_cast<MultiSearch*>(funcctx->user_fctx);
+
+    if (auto row = search->next()) {
+        HeapTuple tuple = build_tuple_bwa(row->query_id, *row->query, *row->result, *row->match, search->index(),
+                row->mate, funcctx->tuple_desc);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    SRF_RETURN_DONE(funcctx);
+}
+
+Datum multi_search_bwa(FunctionCallInfo fcinfo, bool paired) {
+    if (SRF_IS_FIRSTCALL()) {
+        FuncCallContext* funcctx = SRF_FIRSTCALL_INIT();
+
+        const char* query_sql = PG_GETARG_CSTRING(0);
+        const char* reference_sql = PG_GETARG_CSTRING(1);
+        HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+
+        TupleDesc ret_tupdesc = bless_retval_tupledesc(fcinfo, funcctx);
+        Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
+
+        if (int ret = SPI_connect(); ret < 0)
+            elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+        BwaSegmentedIndex bwa(bwa_index_from_query(reference_sql, nuclseq_oid, bwa_default_sa_interval,
+                get_opt_or(opts, "threads", 1)));
+        if (paired && bwa.segment_count() > 1)
+            raise_pg_error(ERRCODE_PROGRAM_LIMIT_EXCEEDED, errmsg("references are too large for one index, which pairing needs"));
+        mem_opt_t options = bwa_options_from(opts, bwa.sequence_count());
+        start_multi_search(funcctx, new MultiSearch(std::move(bwa), options, query_sql, nuclseq_oid, paired, funcctx->multi_call_memory_ctx));
+
+        SPI_finish();
+    }
+
+    return return_next_multi_search_result(fcinfo);
+}
+
+Datum multi_search_bwa_index(FunctionCallInfo fcinfo, bool paired) {
+    if (SRF_IS_FIRSTCALL()) {
+        FuncCallContext* funcctx = SRF_FIRSTCALL_INIT();
+
+        const char* query_sql = PG_GETARG_CSTRING(0);
+        const text* index_name = PG_GETARG_TEXT_PP(1);
+        HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+
+        TupleDesc ret_tupdesc = bless_retval_tupledesc(fcinfo, funcctx);
+        Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
+        BwaSegmentedIndex bwa(paired ? std::vector{acquire_merged_index(index_name)} : bwa_index_acquire_segments(index_name));
+        mem_opt_t options = bwa_options_from(opts, bwa.sequence_count());
+
+        if (int ret = SPI_connect(); ret < 0)
+            elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+        start_multi_search(funcctx, new MultiSearch(std::move(bwa), options, query_sql, nuclseq_oid, paired, funcctx->multi_call_memory_ctx));
+
+        SPI_finish();
+    }
+
+    return return_next_multi_search_result(fcinfo);
+}
+
 }
 
 extern "C" {
@@ -313,7 +1419,7 @@ Datum nuclseq_search_bwa(PG_FUNCTION_ARGS) {
     ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
     assert_can_return_set(rsi);
 
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
     const char* reference_sql = PG_GETARG_CSTRING(1);
     HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
 
@@ -323,15 +1429,75 @@ Datum nuclseq_search_bwa(PG_FUNCTION_ARGS) {
     TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
 
     Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
-    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid);
+    BwaSegmentedIndex bwa(bwa_index_from_query(reference_sql, nuclseq_oid, bwa_default_sa_interval,
+            get_opt_or(opts, "threads", 1)));
+    mem_opt_t options = bwa_options_from(opts, bwa.sequence_count());
     SPI_finish();
 
     Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+    put_single_search_results(ret_tupstore, ret_tupdesc, bwa, options, *nucls);
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_search_bwa_index);
+Datum nuclseq_search_bwa_index(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    const text* index_name = PG_GETARG_TEXT_PP(1);
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+
+    BwaSegmentedIndex bwa(bwa_index_acquire_segments(index_name));
+    mem_opt_t options = bwa_options_from(opts, bwa.sequence_count());
+
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+    put_single_search_results(ret_tupstore, ret_tupdesc, bwa, options, *nucls);
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Short queries that only need exact or nearly exact hits skip alignment, and only get the positions of the hits.
+PG_FUNCTION_INFO_V1(nuclseq_search_exact_bwa_index);
+Datum nuclseq_search_exact_bwa_index(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    auto nucls = detoast_nuclseq(PG_GETARG_DATUM(0));
+    const text* index_name = PG_GETARG_TEXT_PP(1);
+    int32_t max_mismatches = PG_GETARG_INT32(2);
+    int32_t max_hits = PG_GETARG_INT32(3);
+    if (max_mismatches < 0 || max_mismatches > bwa_max_hit_mismatches)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_mismatches must be between 0 and %d", bwa_max_hit_mismatches));
+    if (max_hits < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_hits must not be negative"));
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
 
-    std::vector<BwaMatch> aligns = bwa.align_sequence(*nucls);
+    BwaSegmentedIndex bwa(bwa_index_acquire_segments(index_name));
+    std::vector<BwaHit> hits;
+    with_exceptions_as_errors([&] { bwa.find_hits(*nucls, max_mismatches, max_hits, hits); });
 
-    for (BwaMatch& row : aligns) {
-        HeapTuple tuple = build_tuple_bwa(std::nullopt, row, ret_tupdesc);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+    for (const BwaHit& hit : hits) {
+        std::array<Datum, 4> values { {
+            Int64GetDatum(hit.ref_id),
+            Int32GetDatum(hit.ref_match_begin),
+            BoolGetDatum(hit.is_reverse),
+            Int32GetDatum(hit.mismatches),
+        } };
+        std::array<bool, 4> nulls{};
+
+        HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
         tuplestore_puttuple(ret_tupstore, tuple);
         heap_freetuple(tuple);
     }
@@ -342,35 +1508,508 @@ Datum nuclseq_search_bwa(PG_FUNCTION_ARGS) {
     return (Datum) nullptr;
 }
 
-PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa);
-Datum nuclseq_multi_search_bwa(PG_FUNCTION_ARGS) {
+// Returns null when no part of the query aligns with the target.
+PG_FUNCTION_INFO_V1(nuclseq_align_sw);
+Datum nuclseq_align_sw(PG_FUNCTION_ARGS) {
+    auto query = detoast_nuclseq(PG_GETARG_DATUM(0));
+    auto target = detoast_nuclseq(PG_GETARG_DATUM(1));
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+    mem_opt_t options = bwa_options_from(opts, 1);
+
+    BwaPairAlignment alignment;
+    if (!pair_aligner.align(options, *query, *target, alignment))
+        PG_RETURN_NULL();
+
+    TupleDesc tupledesc = BlessTupleDesc(get_retval_tupledesc(fcinfo));
+    PG_RETURN_DATUM(HeapTupleGetDatum(build_tuple_alignment(std::nullopt, alignment, tupledesc)));
+}
+
+// Aligns the query against every (id, seq) row of the target query, returning the targets it aligns with.
+PG_FUNCTION_INFO_V1(nuclseq_search_sw);
+Datum nuclseq_search_sw(PG_FUNCTION_ARGS) {
     ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
     assert_can_return_set(rsi);
 
+    auto query = detoast_nuclseq(PG_GETARG_DATUM(0));
+    const char* target_sql = PG_GETARG_CSTRING(1);
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+    mem_opt_t options = bwa_options_from(opts, 1);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    BwaPairAlignment alignment;
+    iterate_nuclseq_table(target_sql, get_nuclseq_oid(fcinfo), [&](auto id, auto target) {
+        CHECK_FOR_INTERRUPTS();
+        if (!pair_aligner.align(options, *query, *target, alignment))
+            return;
+        HeapTuple tuple = build_tuple_alignment(id, alignment, ret_tupdesc);
+        tuplestore_puttuple(ret_tupstore, tuple);
+        heap_freetuple(tuple);
+    });
+
+    SPI_finish();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa);
+Datum nuclseq_multi_search_bwa(PG_FUNCTION_ARGS) {
+    return multi_search_bwa(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa_index);
+Datum nuclseq_multi_search_bwa_index(PG_FUNCTION_ARGS) {
+    return multi_search_bwa_index(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa_paired);
+Datum nuclseq_multi_search_bwa_paired(PG_FUNCTION_ARGS) {
+    return multi_search_bwa(fcinfo, true);
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa_paired_index);
+Datum nuclseq_multi_search_bwa_paired_index(PG_FUNCTION_ARGS) {
+    return multi_search_bwa_index(fcinfo, true);
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_sam_bwa_index);
+Datum nuclseq_sam_bwa_index(PG_FUNCTION_ARGS) {
+    if (SRF_IS_FIRSTCALL()) {
+        FuncCallContext* funcctx = SRF_FIRSTCALL_INIT();
+
+        const char* query_sql = PG_GETARG_CSTRING(0);
+        const text* index_name = PG_GETARG_TEXT_PP(1);
+        HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+
+        std::shared_ptr<const BwaIndex> bwa = acquire_merged_index(index_name);
+        mem_opt_t options = bwa_options_from(opts, bwa->sequence_count());
+
+        if (int ret = SPI_connect(); ret < 0)
+            elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+        start_multi_search(funcctx, new SamExport(std::move(bwa), options, query_sql, get_nuclseq_oid(fcinfo), funcctx->multi_call_memory_ctx));
+
+        SPI_finish();
+    }
+
+    FuncCallContext* funcctx = SRF_PERCALL_SETUP();
+    if (auto line = static_cast<SamExport*>(funcctx->user_fctx)->next_line())
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(string_view_to_text(*line)));
+    SRF_RETURN_DONE(funcctx);
+}
+
+// Writes a file on the server, so like COPY to a file, it is limited to roles trusted with that.
+PG_FUNCTION_INFO_V1(nuclseq_export_bwa_index);
+Datum nuclseq_export_bwa_index(PG_FUNCTION_ARGS) {
     const char* query_sql = PG_GETARG_CSTRING(0);
+    const text* index_name = PG_GETARG_TEXT_PP(1);
+    const char* path = text_to_cstring(PG_GETARG_TEXT_PP(2));
+    std::string format = text_to_cstring(PG_GETARG_TEXT_PP(3));
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(4);
+
+    if (format != "sam" && format != "bam")
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("alignment format must be \"sam\" or \"bam\""));
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        raise_pg_error(ERRCODE_INSUFFICIENT_PRIVILEGE,
+                errmsg("must be superuser or have privileges of the pg_write_server_files role to export alignments to a file"));
+    if (!is_absolute_path(path))
+        raise_pg_error(ERRCODE_INVALID_NAME, errmsg("relative path not allowed for alignment export"));
+
+    std::shared_ptr<const BwaIndex> bwa = acquire_merged_index(index_name);
+    mem_opt_t options = bwa_options_from(opts, bwa->sequence_count());
+
+    // SPI_connect switches to a context that is gone after SPI_finish.
+    MemoryContext call_ctx = CurrentMemoryContext;
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+    auto exporter = owned_by_context(call_ctx, new SamExport(std::move(bwa), options, query_sql, get_nuclseq_oid(fcinfo), call_ctx));
+    SPI_finish();
+
+    auto output = owned_by_context(call_ctx, new SamOutput());
+    output->open(path, format == "bam", options.n_threads, exporter->sam_header());
+    int64_t records = 0;
+    while (const bam1_t* record = exporter->next()) {
+        output->write(exporter->sam_header(), record);
+        records++;
+    }
+    output->close();
+
+    PG_RETURN_INT64(records);
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_create);
+Datum bwa_index_create(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
     const char* reference_sql = PG_GETARG_CSTRING(1);
-    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+    int32_t sa_interval = PG_GETARG_INT32(2);
+    int32_t threads = PG_GETARG_INT32(3);
+
+    size_t shard_bases = shard_bases_from(PG_GETARG_INT64(4));
+
+    check_index_build_options(sa_interval, threads);
+
+    (void) bwa_index_path(index_name);
+    lock_index_segments(index_name);
+    if (bwa_index_exists(index_name))
+        raise_pg_error(ERRCODE_DUPLICATE_OBJECT, errmsg("bwa index \"%s\" already exists", text_to_cstring(index_name)));
 
     if (int ret = SPI_connect(); ret < 0)
         elog(ERROR, "connectby: SPI_connect returned %d", ret);
 
-    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
-    Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
-    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid);
-    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+    std::vector<std::shared_ptr<BwaIndex>> shards = read_reference_shards(reference_sql, get_nuclseq_oid(fcinfo), shard_bases, [](const auto&) {});
+    SPI_finish();
 
-    iterate_nuclseq_table(query_sql, nuclseq_oid, [&](auto id, auto nuclseq){
-        std::vector<BwaMatch> aligns = bwa.align_sequence(*nuclseq);
+    // Shards are built one at a time and saved from the last one, so the index appears once the first one is in place.
+    remove_stale_segments(index_name);
+    for (size_t shard = shards.size(); shard-- > 0;) {
+        with_exceptions_as_errors([&] { shards[shard]->build(sa_interval, threads); });
+        save_index_file(*shards[shard], bwa_index_shard_path(index_name, shard));
+        shards[shard].reset();
+    }
+
+    PG_RETURN_VOID();
+}
+
+// Builds run in a background worker each, so the caller only waits for the worker to start. The queue row and the
+// worker only take effect once the calling transaction commits. Merges have no reference query nor suffix array interval.
+int64_t queue_index_build(FunctionCallInfo fcinfo, const text* index_name, const char* kind, const char* reference_sql,
+        std::optional<int32_t> sa_interval, int32_t threads, int64_t shard_bases) {
+    if (!index_builds_available()) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("background bwa index builds need bioseqdb to be loaded through shared_preload_libraries"),
+                errhint("Add libbioseqdb to shared_preload_libraries, or build the index with bwa_index_create.")));
+    }
+
+    Oid schema = get_func_namespace(fcinfo->flinfo->fn_oid);
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+    std::string sql = "INSERT INTO " + build_queue_table(schema) + " (kind, index_name, reference_sql, sa_interval, threads, shard_bases) "
+            "VALUES ($1, $2, $3, $4, $5, $6) RETURNING build_id";
+    std::array<Oid, 6> types { {TEXTOID, TEXTOID, TEXTOID, INT4OID, INT4OID, INT8OID} };
+    std::array<Datum, 6> values { {
+        CStringGetTextDatum(kind),
+        PointerGetDatum(index_name),
+        reference_sql != nullptr ? CStringGetTextDatum(reference_sql) : (Datum) 0,
+        Int32GetDatum(sa_interval.value_or(0)),
+        Int32GetDatum(threads),
+        Int64GetDatum(shard_bases),
+    } };
+    std::array<char, 7> nulls { {' ', ' ', reference_sql != nullptr ? ' ' : 'n', sa_interval ? ' ' : 'n', ' ', ' ', '\0'} };
+    if (SPI_execute_with_args(sql.c_str(), 6, types.data(), values.data(), nulls.data(), false, 1) != SPI_OK_INSERT_RETURNING)
+        elog(ERROR, "could not queue bwa index build");
+    bool null = false;
+    int64_t build_id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &null));
+    SPI_finish();
+
+    index_build_reserve(build_id, text_to_cstring(index_name));
+
+    IndexBuildRequest request {
+        .build_id = build_id,
+        .submitter_xid = GetTopTransactionId(),
+        .database = MyDatabaseId,
+        .user = GetUserId(),
+        .schema = schema,
+        .nuclseq_oid = get_nuclseq_oid(fcinfo),
+    };
+    BackgroundWorker worker {};
+    snprintf(worker.bgw_name, BGW_MAXLEN, "bioseqdb index build %lld", static_cast<long long>(build_id));
+    strlcpy(worker.bgw_type, "bioseqdb index build", BGW_MAXLEN);
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    strlcpy(worker.bgw_library_name, "$libdir/libbioseqdb", sizeof(worker.bgw_library_name));
+    strlcpy(worker.bgw_function_name, "bwa_index_build_main", sizeof(worker.bgw_function_name));
+    memcpy(worker.bgw_extra, &request, sizeof(request));
+    worker.bgw_notify_pid = MyProcPid;
+
+    BackgroundWorkerHandle* handle = nullptr;
+    pid_t pid = 0;
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle)) {
+        index_build_release(build_id);
+        ereport(ERROR, (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                errmsg("could not register background worker for bwa index build"),
+                errhint("Consider increasing max_worker_processes.")));
+    }
+    if (WaitForBackgroundWorkerStartup(handle, &pid) != BGWH_STARTED) {
+        index_build_release(build_id);
+        raise_pg_error(ERRCODE_INSUFFICIENT_RESOURCES, errmsg("could not start background worker for bwa index build"));
+    }
+    return build_id;
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_create_async);
+Datum bwa_index_create_async(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+    const char* reference_sql = PG_GETARG_CSTRING(1);
+    int32_t sa_interval = PG_GETARG_INT32(2);
+    int32_t threads = PG_GETARG_INT32(3);
+    int64_t shard_bases = PG_GETARG_INT64(4);
+
+    check_index_build_options(sa_interval, threads);
+    (void) shard_bases_from(shard_bases);
+    (void) bwa_index_path(index_name);
+    if (bwa_index_exists(index_name))
+        raise_pg_error(ERRCODE_DUPLICATE_OBJECT, errmsg("bwa index \"%s\" already exists", text_to_cstring(index_name)));
+
+    PG_RETURN_INT64(queue_index_build(fcinfo, index_name, "create", reference_sql, sa_interval, threads, shard_bases));
+}
+
+// Merges in the background keep the segments unlocked while the merged shards are built, so deltas can still be
+// appended meanwhile.
+PG_FUNCTION_INFO_V1(bwa_index_merge_async);
+Datum bwa_index_merge_async(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+    int32_t threads = PG_GETARG_INT32(1);
+    int64_t shard_bases = PG_GETARG_INT64(2);
+
+    if (threads < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("number of threads must not be negative"));
+    (void) shard_bases_from(shard_bases);
+    if (!bwa_index_exists(index_name))
+        raise_pg_error(ERRCODE_UNDEFINED_OBJECT, errmsg("bwa index \"%s\" does not exist", text_to_cstring(index_name)));
+
+    PG_RETURN_INT64(queue_index_build(fcinfo, index_name, "merge", nullptr, std::nullopt, threads, shard_bases));
+}
+
+PGDLLEXPORT void bwa_index_build_main(Datum);
+void bwa_index_build_main(Datum) {
+    IndexBuildRequest request;
+    memcpy(&request, MyBgworkerEntry->bgw_extra, sizeof(request));
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnectionByOid(request.database, request.user, 0);
+    if (!index_build_attach(request.build_id))
+        proc_exit(0);
+
+    MemoryContext worker_ctx = CurrentMemoryContext;
+    PG_TRY();
+    {
+        run_index_build(request);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(worker_ctx);
+        EmitErrorReport();
+        ErrorData* error = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+        record_index_build_failure(request, error->message);
+    }
+    PG_END_TRY();
+
+    proc_exit(0);
+}
+
+// Cancelled builds are marked in the queue right away, and their workers are terminated. The check for privileges over
+// the submitting role is the one pg_terminate_backend makes.
+PG_FUNCTION_INFO_V1(bwa_index_build_cancel);
+Datum bwa_index_build_cancel(PG_FUNCTION_ARGS) {
+    int64_t build_id = PG_GETARG_INT64(0);
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+    std::string sql = "UPDATE " + build_queue_table(get_func_namespace(fcinfo->flinfo->fn_oid)) + " SET status = 'cancelled', "
+            "finished_at = now() WHERE build_id = $1 AND status IN ('queued', 'running') RETURNING submitted_by";
+    std::array<Oid, 1> types { {INT8OID} };
+    std::array<Datum, 1> values { {Int64GetDatum(build_id)} };
+    if (SPI_execute_with_args(sql.c_str(), 1, types.data(), values.data(), nullptr, false, 1) != SPI_OK_UPDATE_RETURNING)
+        elog(ERROR, "could not cancel bwa index build");
+    bool cancelled = SPI_processed > 0;
+    bool null = false;
+    Oid submitter = cancelled ? DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &null)) : InvalidOid;
+    SPI_finish();
 
-        for (BwaMatch& row : aligns) {
-            HeapTuple tuple = build_tuple_bwa(id, row, ret_tupdesc);
-            tuplestore_puttuple(ret_tupstore, tuple);
-            heap_freetuple(tuple);
+    if (cancelled) {
+        if (!has_privs_of_role(GetUserId(), submitter))
+            raise_pg_error(ERRCODE_INSUFFICIENT_PRIVILEGE, errmsg("must be a member of the role that submitted the bwa index build"));
+        for (const IndexBuildProgress& build : index_build_entries()) {
+            if (build.build_id == build_id && build.pid != 0)
+                kill(build.pid, SIGTERM);
         }
-    });
+    }
+
+    PG_RETURN_BOOL(cancelled);
+}
+
+// References are added as a new delta segment, indexed on their own, so the cost does not depend on the size of the
+// index. Searches align queries against every segment until the deltas are merged.
+PG_FUNCTION_INFO_V1(bwa_index_append);
+Datum bwa_index_append(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+    const char* reference_sql = PG_GETARG_CSTRING(1);
+    int32_t threads = PG_GETARG_INT32(2);
 
+    if (threads < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("number of threads must not be negative"));
+
+    lock_index_segments(index_name);
+    std::vector<std::shared_ptr<const BwaIndex>> segments = bwa_index_acquire_segments(index_name);
+    std::vector<uint64_t> existing = bwa_index_delta_segments(index_name);
+    uint64_t segment = existing.empty() ? 0 : existing.back();
+    for (const auto& bwa : segments)
+        segment = std::max(segment, bwa->last_merged_segment());
+    segment++;
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    std::vector<std::shared_ptr<BwaIndex>> deltas = read_reference_shards(reference_sql, get_nuclseq_oid(fcinfo), bwa_max_index_bases, [](const auto&) {});
     SPI_finish();
 
+    // References too large for one FM-index are appended as several delta segments.
+    for (std::shared_ptr<BwaIndex>& delta : deltas) {
+        if (delta->sequence_count() == 0)
+            continue;
+        with_exceptions_as_errors([&] { delta->build(segments[0]->sa_interval(), threads); });
+        save_index_file(*delta, bwa_index_segment_path(index_name, segment++));
+        delta.reset();
+    }
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_merge);
+Datum bwa_index_merge(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+    int32_t threads = PG_GETARG_INT32(1);
+    size_t shard_bases = shard_bases_from(PG_GETARG_INT64(2));
+
+    if (threads < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("number of threads must not be negative"));
+
+    lock_index_segments(index_name);
+    std::vector<IndexSegmentNumber> numbers;
+    std::vector<std::shared_ptr<const BwaIndex>> segments = bwa_index_acquire_segments(index_name, &numbers);
+    std::vector<uint64_t> deltas = bwa_index_delta_segments(index_name);
+
+    merge_index_segments(segments, numbers, threads, shard_bases, {}, [&](uint32_t shard, std::shared_ptr<BwaIndex> bwa) {
+        save_index_file(*bwa, bwa_index_shard_path(index_name, shard));
+    });
+    remove_merged_deltas(index_name, deltas, deltas.empty() ? 0 : deltas.back());
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_drop);
+Datum bwa_index_drop(PG_FUNCTION_ARGS) {
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+
+    std::string path = bwa_index_path(index_name);
+    lock_index_segments(index_name);
+    if (!bwa_index_exists(index_name))
+        raise_pg_error(ERRCODE_UNDEFINED_OBJECT, errmsg("bwa index \"%s\" does not exist", text_to_cstring(index_name)));
+
+    // Removing the first shard first makes the whole index disappear at once.
+    durable_unlink(path.c_str(), ERROR);
+    remove_stale_segments(index_name);
+    bwa_index_forget(index_name);
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_segments);
+Datum bwa_index_segments(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const text* index_name = PG_GETARG_TEXT_PP(0);
+    std::vector<IndexSegmentNumber> numbers;
+    std::vector<std::shared_ptr<const BwaIndex>> segments = bwa_index_acquire_segments(index_name, &numbers);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        const BwaIndex& segment = *segments[i];
+        int64_t max_ref_id = INT64_MIN;
+        for (size_t ref = 0; ref < segment.sequence_count(); ref++)
+            max_ref_id = std::max(max_ref_id, segment.ref_id(ref));
+
+        std::array<Datum, 5> values { {
+            Int64GetDatum(numbers[i].delta),
+            Int64GetDatum(segment.sequence_count()),
+            Int64GetDatum(segment.mapped_size()),
+            Int64GetDatum(max_ref_id),
+            Int32GetDatum(numbers[i].shard.value_or(0)),
+        } };
+        std::array<bool, 5> nulls{};
+        nulls[3] = segment.sequence_count() == 0;
+        nulls[4] = !numbers[i].shard.has_value();
+
+        HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+        tuplestore_puttuple(ret_tupstore, tuple);
+        heap_freetuple(tuple);
+    }
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_cache);
+Datum bwa_index_cache(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    for (const IndexCacheEntry& entry : bwa_index_cache_entries()) {
+        std::array<Datum, 5> values { {
+            PointerGetDatum(string_view_to_text(entry.name)),
+            Int64GetDatum(entry.size),
+            Int32GetDatum(entry.backends),
+            BoolGetDatum(entry.mapped_here),
+            TimestampTzGetDatum(entry.last_used),
+        } };
+        std::array<bool, 5> nulls{};
+        nulls[2] = entry.backends < 0;
+
+        HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+        tuplestore_puttuple(ret_tupstore, tuple);
+        heap_freetuple(tuple);
+    }
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+PG_FUNCTION_INFO_V1(bwa_index_build_progress);
+Datum bwa_index_build_progress(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    for (const IndexBuildProgress& build : index_build_entries()) {
+        std::array<Datum, 6> values { {
+            Int64GetDatum(build.build_id),
+            Int32GetDatum(build.pid),
+            CStringGetTextDatum(index_build_phase_name(build.phase)),
+            Int64GetDatum(build.sequences),
+            Int64GetDatum(build.bases),
+            TimestampTzGetDatum(build.phase_started),
+        } };
+        std::array<bool, 6> nulls{};
+        nulls[1] = build.pid == 0;
+
+        HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+        tuplestore_puttuple(ret_tupstore, tuple);
+        heap_freetuple(tuple);
+    }
+
     rsi->returnMode = SFRM_Materialize;
     rsi->setResult = ret_tupstore;
     rsi->setDesc = ret_tupdesc;
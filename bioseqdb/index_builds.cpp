@@ -0,0 +1,210 @@
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wregister"
+#include <postgres.h>
+#include <fmgr.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+#pragma GCC diagnostic pop
+}
+
+#include "index_builds.h"
+
+#define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
+
+namespace {
+
+// Slots with a build id of 0 are free. Build ids come from a sequence, so they are never 0, but every database has its
+// own sequence, so slots are told apart by the database too.
+struct SharedIndexBuild {
+    Oid database;
+    int64_t build_id;
+    char index_name[NAMEDATALEN];
+    int32_t pid;
+    IndexBuildPhase phase;
+    uint64_t sequences;
+    uint64_t bases;
+    TimestampTz phase_started;
+};
+
+struct SharedIndexBuilds {
+    LWLock* lock;
+    int32_t capacity;
+    SharedIndexBuild slots[FLEXIBLE_ARRAY_MEMBER];
+};
+
+int max_index_builds = 4;
+
+SharedIndexBuilds* shared_builds = nullptr;
+
+shmem_startup_hook_type prev_shmem_startup_hook = nullptr;
+#if PG_VERSION_NUM >= 150000
+shmem_request_hook_type prev_shmem_request_hook = nullptr;
+#endif
+
+Size shared_builds_size() {
+    return add_size(offsetof(SharedIndexBuilds, slots), mul_size(max_index_builds, sizeof(SharedIndexBuild)));
+}
+
+void request_shared_builds() {
+    RequestAddinShmemSpace(shared_builds_size());
+    RequestNamedLWLockTranche("bioseqdb index builds", 1);
+}
+
+#if PG_VERSION_NUM >= 150000
+void index_builds_shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    request_shared_builds();
+}
+#endif
+
+void index_builds_shmem_startup() {
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    bool found = false;
+    shared_builds = static_cast<SharedIndexBuilds*>(ShmemInitStruct("bioseqdb index builds", shared_builds_size(), &found));
+    if (!found) {
+        memset(shared_builds, 0, shared_builds_size());
+        shared_builds->lock = &GetNamedLWLockTranche("bioseqdb index builds")->lock;
+        shared_builds->capacity = max_index_builds;
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+// Finds the slot of a build of the current database. Callers must hold the lock.
+SharedIndexBuild* find_slot(int64_t build_id) {
+    for (int32_t i = 0; i < shared_builds->capacity; i++) {
+        if (shared_builds->slots[i].build_id == build_id && shared_builds->slots[i].database == MyDatabaseId)
+            return &shared_builds->slots[i];
+    }
+    return nullptr;
+}
+
+void release_on_exit(int, Datum build_id) {
+    index_build_release(DatumGetInt64(build_id));
+}
+
+}
+
+void index_builds_init() {
+    DefineCustomIntVariable("bioseqdb.max_index_builds",
+            "Number of bwa index builds that can be queued or running in background workers at once.",
+            "Only used when bioseqdb is loaded through shared_preload_libraries.",
+            &max_index_builds, 4, 1, 1024, PGC_POSTMASTER, 0, nullptr, nullptr, nullptr);
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = index_builds_shmem_request;
+#else
+    request_shared_builds();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = index_builds_shmem_startup;
+}
+
+bool index_builds_available() {
+    return shared_builds != nullptr;
+}
+
+const char* index_build_phase_name(IndexBuildPhase phase) {
+    switch (phase) {
+        case IndexBuildPhase::queued: return "queued";
+        case IndexBuildPhase::reading_references: return "reading references";
+        case IndexBuildPhase::sorting_suffixes: return "sorting suffixes";
+        case IndexBuildPhase::counting_occurrences: return "counting occurrences";
+        case IndexBuildPhase::sampling_suffix_array: return "sampling suffix array";
+        case IndexBuildPhase::saving: return "saving";
+    }
+    return "unknown";
+}
+
+void index_build_reserve(int64_t build_id, const std::string& index_name) {
+    LWLockAcquire(shared_builds->lock, LW_EXCLUSIVE);
+    SharedIndexBuild* free_slot = nullptr;
+    for (int32_t i = 0; i < shared_builds->capacity; i++) {
+        SharedIndexBuild& slot = shared_builds->slots[i];
+        if (slot.build_id == 0 && free_slot == nullptr)
+            free_slot = &slot;
+        // Index files are shared by all databases, so the names of builds are compared in every one of them.
+        if (slot.build_id != 0 && slot.index_name == index_name) {
+            LWLockRelease(shared_builds->lock);
+            raise_pg_error(ERRCODE_OBJECT_IN_USE, errmsg("bwa index \"%s\" is already being built", index_name.c_str()));
+        }
+    }
+    if (free_slot == nullptr) {
+        LWLockRelease(shared_builds->lock);
+        ereport(ERROR, (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                errmsg("too many bwa index builds in progress"),
+                errhint("Wait for a build to finish, or increase bioseqdb.max_index_builds.")));
+    }
+
+    *free_slot = SharedIndexBuild {};
+    free_slot->database = MyDatabaseId;
+    free_slot->build_id = build_id;
+    strlcpy(free_slot->index_name, index_name.c_str(), sizeof(free_slot->index_name));
+    free_slot->phase = IndexBuildPhase::queued;
+    free_slot->phase_started = GetCurrentTimestamp();
+    LWLockRelease(shared_builds->lock);
+}
+
+void index_build_release(int64_t build_id) {
+    LWLockAcquire(shared_builds->lock, LW_EXCLUSIVE);
+    if (SharedIndexBuild* slot = find_slot(build_id))
+        *slot = SharedIndexBuild {};
+    LWLockRelease(shared_builds->lock);
+}
+
+bool index_build_attach(int64_t build_id) {
+    LWLockAcquire(shared_builds->lock, LW_EXCLUSIVE);
+    SharedIndexBuild* slot = find_slot(build_id);
+    if (slot != nullptr)
+        slot->pid = MyProcPid;
+    LWLockRelease(shared_builds->lock);
+
+    if (slot != nullptr)
+        before_shmem_exit(release_on_exit, Int64GetDatum(build_id));
+    return slot != nullptr;
+}
+
+void index_build_report(int64_t build_id, IndexBuildPhase phase, uint64_t sequences, uint64_t bases) {
+    LWLockAcquire(shared_builds->lock, LW_EXCLUSIVE);
+    if (SharedIndexBuild* slot = find_slot(build_id)) {
+        if (slot->phase != phase) {
+            slot->phase = phase;
+            slot->phase_started = GetCurrentTimestamp();
+        }
+        slot->sequences = sequences;
+        slot->bases = bases;
+    }
+    LWLockRelease(shared_builds->lock);
+}
+
+std::vector<IndexBuildProgress> index_build_entries() {
+    std::vector<IndexBuildProgress> entries;
+    if (shared_builds == nullptr)
+        return entries;
+
+    LWLockAcquire(shared_builds->lock, LW_SHARED);
+    for (int32_t i = 0; i < shared_builds->capacity; i++) {
+        const SharedIndexBuild& slot = shared_builds->slots[i];
+        if (slot.build_id != 0 && slot.database == MyDatabaseId)
+            entries.push_back({slot.build_id, slot.index_name, slot.pid, slot.phase, slot.sequences, slot.bases, slot.phase_started});
+    }
+    LWLockRelease(shared_builds->lock);
+    return entries;
+}
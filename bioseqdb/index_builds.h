@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <postgres.h>
+#include <utils/timestamp.h>
+}
+
+// Phases of a background index build, in order.
+enum class IndexBuildPhase : int32_t {
+    queued,
+    reading_references,
+    sorting_suffixes,
+    counting_occurrences,
+    sampling_suffix_array,
+    saving,
+};
+
+struct IndexBuildProgress {
+    int64_t build_id;
+    std::string index_name;
+    // Process id of the background worker, or 0 until it starts.
+    int32_t pid;
+    IndexBuildPhase phase;
+    uint64_t sequences;
+    uint64_t bases;
+    TimestampTz phase_started;
+};
+
+// Builds submitted with bwa_index_create_async are recorded in the bwa_index_build_queue table, and run by a background
+// worker each. Progress of running builds is kept in shared memory, in a fixed number of slots, so background builds
+// are only available when the extension is loaded through shared_preload_libraries. Build ids are only unique within a
+// database, so the functions below refer to builds of the database the backend is connected to.
+void index_builds_init();
+bool index_builds_available();
+
+const char* index_build_phase_name(IndexBuildPhase phase);
+
+// Takes a slot for a build before its worker starts, raising an error when every slot is taken or the index is already
+// being built.
+void index_build_reserve(int64_t build_id, const std::string& index_name);
+// Frees the slot of the build, if it still has one.
+void index_build_release(int64_t build_id);
+// Records the worker in the slot of the build, and frees the slot when the worker exits. Returns false when the build
+// no longer has a slot.
+bool index_build_attach(int64_t build_id);
+void index_build_report(int64_t build_id, IndexBuildPhase phase, uint64_t sequences, uint64_t bases);
+
+// Builds of the current database.
+std::vector<IndexBuildProgress> index_build_entries();
@@ -0,0 +1,540 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+extern "C" {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wregister"
+#include <postgres.h>
+#include <fmgr.h>
+#include <miscadmin.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+#pragma GCC diagnostic pop
+}
+
+#include "index_cache.h"
+
+#define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
+
+const char* const index_directory = "bioseqdb";
+
+namespace {
+
+// An index file is identified by its inode and modification time, so recreating an index under the same name is
+// noticed by backends that still have the old file mapped.
+struct FileIdentity {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && mtime_sec == other.mtime_sec
+            && mtime_nsec == other.mtime_nsec && size == other.size;
+    }
+    bool operator!=(const FileIdentity& other) const { return !(*this == other); }
+};
+
+// Backends cannot unmap memory of other processes, so eviction is cooperative. A backend that wants to free up space
+// bumps the generation of the least recently used entries, and every backend drops mappings with an outdated
+// generation the next time it uses the cache. Mapped pages of idle backends are clean file pages, which the kernel
+// can reclaim on its own in the meantime.
+// Entries are keyed by the index name, followed by the number of the segment for delta segments.
+constexpr size_t max_key_length = NAMEDATALEN + 24;
+
+struct SharedIndexEntry {
+    char name[max_key_length];
+    FileIdentity identity;
+    int32_t backends;
+    uint32_t generation;
+    TimestampTz last_used;
+};
+
+struct SharedIndexCache {
+    LWLock* lock;
+    int32_t capacity;
+    SharedIndexEntry entries[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct LocalIndexEntry {
+    std::shared_ptr<const BwaIndex> index;
+    FileIdentity identity;
+    uint32_t generation;
+    TimestampTz last_used;
+};
+
+int index_cache_size_mb = 16384;
+int max_cached_indexes = 64;
+
+SharedIndexCache* shared_cache = nullptr;
+std::map<std::string, LocalIndexEntry> local_cache;
+bool exit_callback_registered = false;
+
+shmem_startup_hook_type prev_shmem_startup_hook = nullptr;
+#if PG_VERSION_NUM >= 150000
+shmem_request_hook_type prev_shmem_request_hook = nullptr;
+#endif
+
+Size shared_cache_size() {
+    return add_size(offsetof(SharedIndexCache, entries), mul_size(max_cached_indexes, sizeof(SharedIndexEntry)));
+}
+
+void request_shared_cache() {
+    RequestAddinShmemSpace(shared_cache_size());
+    RequestNamedLWLockTranche("bioseqdb", 1);
+}
+
+#if PG_VERSION_NUM >= 150000
+void index_cache_shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    request_shared_cache();
+}
+#endif
+
+void index_cache_shmem_startup() {
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    bool found = false;
+    shared_cache = static_cast<SharedIndexCache*>(ShmemInitStruct("bioseqdb index cache", shared_cache_size(), &found));
+    if (!found) {
+        memset(shared_cache, 0, shared_cache_size());
+        shared_cache->lock = &GetNamedLWLockTranche("bioseqdb")->lock;
+        shared_cache->capacity = max_cached_indexes;
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+uint64_t cache_budget() {
+    return static_cast<uint64_t>(index_cache_size_mb) * 1024 * 1024;
+}
+
+std::string index_name(const text* name) {
+    return std::string(VARDATA_ANY(name), VARSIZE_ANY_EXHDR(name));
+}
+
+// Callers must hold the shared cache lock.
+SharedIndexEntry* find_shared_entry(const std::string& name) {
+    for (int32_t i = 0; i < shared_cache->capacity; i++) {
+        if (shared_cache->entries[i].name == name)
+            return &shared_cache->entries[i];
+    }
+    return nullptr;
+}
+
+// Callers must hold the shared cache lock. Returns nullptr when every slot belongs to an index that is mapped.
+SharedIndexEntry* claim_shared_entry(const std::string& name) {
+    SharedIndexEntry* victim = nullptr;
+    for (int32_t i = 0; i < shared_cache->capacity; i++) {
+        SharedIndexEntry& entry = shared_cache->entries[i];
+        if (entry.name[0] == '\0' || entry.backends == 0) {
+            if (victim == nullptr || (victim->name[0] != '\0' && (entry.name[0] == '\0' || entry.last_used < victim->last_used)))
+                victim = &entry;
+        }
+    }
+    if (victim != nullptr) {
+        // The generation survives reuse of the slot, so stale mappings of the previous index are never mistaken for
+        // mappings of the new one.
+        uint32_t generation = victim->generation;
+        memset(victim, 0, sizeof(SharedIndexEntry));
+        strlcpy(victim->name, name.c_str(), max_key_length);
+        victim->generation = generation;
+    }
+    return victim;
+}
+
+// Callers must hold the shared cache lock.
+void release_shared_entry(const std::string& name, const LocalIndexEntry& local) {
+    SharedIndexEntry* entry = find_shared_entry(name);
+    if (entry != nullptr && entry->identity == local.identity && entry->generation == local.generation && entry->backends > 0)
+        entry->backends--;
+}
+
+void detach_all(int, Datum) {
+    if (shared_cache != nullptr) {
+        LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+        for (const auto& [name, local] : local_cache)
+            release_shared_entry(name, local);
+        LWLockRelease(shared_cache->lock);
+    }
+    local_cache.clear();
+}
+
+// Drops local mappings that other backends asked to evict, or whose file has been replaced.
+void sweep_local_cache() {
+    if (shared_cache == nullptr || local_cache.empty())
+        return;
+
+    LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+    for (auto it = local_cache.begin(); it != local_cache.end();) {
+        SharedIndexEntry* entry = find_shared_entry(it->first);
+        if (entry == nullptr || entry->identity != it->second.identity || entry->generation != it->second.generation) {
+            release_shared_entry(it->first, it->second);
+            it = local_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    LWLockRelease(shared_cache->lock);
+}
+
+// Callers must hold the shared cache lock. Asks backends to unmap least recently used indexes until the resident ones
+// fit in the budget, never choosing the index that was just mapped.
+void evict_shared_entries(const SharedIndexEntry* keep) {
+    uint64_t resident = 0;
+    for (int32_t i = 0; i < shared_cache->capacity; i++) {
+        if (shared_cache->entries[i].backends > 0)
+            resident += shared_cache->entries[i].identity.size;
+    }
+
+    while (resident > cache_budget()) {
+        SharedIndexEntry* victim = nullptr;
+        for (int32_t i = 0; i < shared_cache->capacity; i++) {
+            SharedIndexEntry& entry = shared_cache->entries[i];
+            if (&entry != keep && entry.backends > 0 && (victim == nullptr || entry.last_used < victim->last_used))
+                victim = &entry;
+        }
+        if (victim == nullptr)
+            break;
+
+        resident -= victim->identity.size;
+        // Backends still mapping the victim will release it on their next sweep, so it is no longer counted.
+        victim->generation++;
+        victim->backends = 0;
+    }
+}
+
+void evict_local_entries(const std::string& keep) {
+    uint64_t resident = 0;
+    for (const auto& [name, local] : local_cache)
+        resident += local.identity.size;
+
+    while (resident > cache_budget()) {
+        auto victim = local_cache.end();
+        for (auto it = local_cache.begin(); it != local_cache.end(); ++it) {
+            if (it->first != keep && (victim == local_cache.end() || it->second.last_used < victim->second.last_used))
+                victim = it;
+        }
+        if (victim == local_cache.end())
+            break;
+
+        resident -= victim->second.identity.size;
+        local_cache.erase(victim);
+    }
+}
+
+}
+
+void index_cache_init() {
+    DefineCustomIntVariable("bioseqdb.index_cache_size",
+            "Total size of bwa indexes kept mapped in memory.",
+            "Least recently used indexes are unmapped once the limit is exceeded.",
+            &index_cache_size_mb, 16384, 0, INT_MAX, PGC_SUSET, GUC_UNIT_MB, nullptr, nullptr, nullptr);
+    DefineCustomIntVariable("bioseqdb.max_cached_indexes",
+            "Number of bwa indexes tracked in the shared index cache.",
+            "Only used when bioseqdb is loaded through shared_preload_libraries.",
+            &max_cached_indexes, 64, 1, 65536, PGC_POSTMASTER, 0, nullptr, nullptr, nullptr);
+
+    // Without preloading there is no shared memory to track indexes in, and every backend manages its mappings alone.
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = index_cache_shmem_request;
+#else
+    request_shared_cache();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = index_cache_shmem_startup;
+}
+
+std::string bwa_index_path(const text* name) {
+    std::string_view view(VARDATA_ANY(name), VARSIZE_ANY_EXHDR(name));
+    bool valid = !view.empty() && view.size() < NAMEDATALEN && std::all_of(view.begin(), view.end(), [](char chr) {
+        return (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z') || (chr >= '0' && chr <= '9') || chr == '_';
+    });
+    if (!valid)
+        raise_pg_error(ERRCODE_INVALID_NAME, errmsg("invalid bwa index name: \"%s\"", text_to_cstring(name)));
+
+    return std::string(index_directory) + "/" + std::string(view) + ".bwaidx";
+}
+
+bool bwa_index_exists(const text* name) {
+    return access(bwa_index_path(name).c_str(), F_OK) == 0;
+}
+
+std::string bwa_index_shard_path(const text* name, uint32_t shard) {
+    std::string path = bwa_index_path(name);
+    if (shard == 0)
+        return path;
+    return path.substr(0, path.size() - strlen(".bwaidx")) + ".shard" + std::to_string(shard) + ".bwaidx";
+}
+
+std::string bwa_index_segment_path(const text* name, uint64_t segment) {
+    std::string path = bwa_index_path(name);
+    return path.substr(0, path.size() - strlen(".bwaidx")) + "." + std::to_string(segment) + ".bwaidx";
+}
+
+namespace {
+
+// Index names can't contain dots, so files of shards and delta segments never collide with files of other indexes.
+std::vector<uint64_t> numbered_files(const text* name, std::string_view infix) {
+    std::string prefix = index_name(name) + "." + std::string(infix);
+    std::vector<uint64_t> numbers;
+
+    DIR* dir = AllocateDir(index_directory);
+    if (dir == nullptr && errno == ENOENT)
+        return numbers;
+    while (struct dirent* entry = ReadDir(dir, index_directory)) {
+        std::string_view file = entry->d_name;
+        std::string_view suffix = ".bwaidx";
+        if (file.size() <= prefix.size() + suffix.size() || file.substr(0, prefix.size()) != prefix
+                || file.substr(file.size() - suffix.size()) != suffix)
+            continue;
+        std::string_view number = file.substr(prefix.size(), file.size() - prefix.size() - suffix.size());
+        if (number.size() > 18 || !std::all_of(number.begin(), number.end(), [](char chr) { return chr >= '0' && chr <= '9'; }))
+            continue;
+        numbers.push_back(std::stoull(std::string(number)));
+    }
+    FreeDir(dir);
+
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+// Cache keys of shards and delta segments are their file names without the extension.
+std::string key_path(const std::string& key) {
+    return std::string(index_directory) + "/" + key + ".bwaidx";
+}
+
+}
+
+std::vector<uint32_t> bwa_index_extra_shards(const text* name) {
+    std::vector<uint32_t> shards;
+    for (uint64_t shard : numbered_files(name, "shard")) {
+        if (shard > 0 && shard <= UINT32_MAX)
+            shards.push_back(static_cast<uint32_t>(shard));
+    }
+    return shards;
+}
+
+std::vector<uint64_t> bwa_index_delta_segments(const text* name) {
+    return numbered_files(name, "");
+}
+
+namespace {
+
+// Callers must hold the shared cache lock, if there is one.
+void forget_key(const std::string& key, const std::string& path) {
+    auto it = local_cache.find(key);
+    if (shared_cache != nullptr) {
+        if (it != local_cache.end())
+            release_shared_entry(key, it->second);
+        if (SharedIndexEntry* entry = find_shared_entry(key); entry != nullptr && access(path.c_str(), F_OK) != 0)
+            entry->generation++;
+    }
+    if (it != local_cache.end())
+        local_cache.erase(it);
+}
+
+void forget_file(const std::string& key, const std::string& path) {
+    if (shared_cache != nullptr)
+        LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+    forget_key(key, path);
+    if (shared_cache != nullptr)
+        LWLockRelease(shared_cache->lock);
+}
+
+// Returns the index file mapped in this backend, mapping it on first use, or nullptr if the file does not exist.
+std::shared_ptr<const BwaIndex> acquire_file(const std::string& key, const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        if (errno != ENOENT)
+            ereport(ERROR, (errcode_for_file_access(), errmsg("could not stat index file \"%s\": %m", path.c_str())));
+        forget_file(key, path);
+        return nullptr;
+    }
+    FileIdentity identity {
+        static_cast<uint64_t>(st.st_dev),
+        static_cast<uint64_t>(st.st_ino),
+        static_cast<int64_t>(st.st_mtim.tv_sec),
+        static_cast<int64_t>(st.st_mtim.tv_nsec),
+        static_cast<uint64_t>(st.st_size),
+    };
+    TimestampTz now = GetCurrentTimestamp();
+
+    if (!exit_callback_registered) {
+        before_shmem_exit(detach_all, 0);
+        exit_callback_registered = true;
+    }
+    sweep_local_cache();
+
+    if (auto it = local_cache.find(key); it != local_cache.end()) {
+        if (it->second.identity == identity) {
+            it->second.last_used = now;
+            if (shared_cache != nullptr) {
+                LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+                if (SharedIndexEntry* entry = find_shared_entry(key); entry != nullptr)
+                    entry->last_used = now;
+                LWLockRelease(shared_cache->lock);
+            }
+            return it->second.index;
+        }
+        forget_file(key, path);
+    }
+
+    auto bwa = std::make_shared<BwaIndex>();
+    bwa->load(path.c_str());
+    LocalIndexEntry local { bwa, identity, 0, now };
+
+    if (shared_cache != nullptr) {
+        LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+        SharedIndexEntry* entry = find_shared_entry(key);
+        if (entry == nullptr || entry->identity != identity) {
+            if (entry == nullptr)
+                entry = claim_shared_entry(key);
+            if (entry != nullptr) {
+                entry->identity = identity;
+                entry->backends = 0;
+                entry->generation++;
+            }
+        }
+        // When the shared table is full, the index is still used for this search, just not kept around.
+        if (entry != nullptr) {
+            entry->backends++;
+            entry->last_used = now;
+            local.generation = entry->generation;
+            evict_shared_entries(entry);
+        }
+        LWLockRelease(shared_cache->lock);
+        if (entry == nullptr)
+            return bwa;
+    }
+
+    local_cache[key] = local;
+    if (shared_cache == nullptr)
+        evict_local_entries(key);
+    return bwa;
+}
+
+}
+
+std::shared_ptr<const BwaIndex> bwa_index_acquire(const text* name) {
+    std::string key = index_name(name);
+    std::shared_ptr<const BwaIndex> bwa = acquire_file(key, bwa_index_path(name));
+    if (bwa == nullptr)
+        raise_pg_error(ERRCODE_UNDEFINED_OBJECT, errmsg("bwa index \"%s\" does not exist", key.c_str()));
+    return bwa;
+}
+
+// A merge replaces or adds one shard at a time, each recording the last delta merged into the shards so far, and then
+// removes the merged deltas. Deltas up to the highest number recorded by a shard are skipped, and a file that
+// disappeared means a merge or drop completed in the meantime, so the segments are listed again.
+std::vector<std::shared_ptr<const BwaIndex>> bwa_index_acquire_segments(const text* name, std::vector<IndexSegmentNumber>* numbers) {
+    std::string key = index_name(name);
+    while (true) {
+        std::vector<std::shared_ptr<const BwaIndex>> segments { bwa_index_acquire(name) };
+        std::vector<IndexSegmentNumber> segment_numbers { {0, 0} };
+        uint64_t last_merged = segments[0]->last_merged_segment();
+        bool complete = true;
+        for (uint32_t shard : bwa_index_extra_shards(name)) {
+            std::shared_ptr<const BwaIndex> bwa = acquire_file(key + ".shard" + std::to_string(shard), bwa_index_shard_path(name, shard));
+            if (bwa == nullptr) {
+                complete = false;
+                break;
+            }
+            last_merged = std::max(last_merged, bwa->last_merged_segment());
+            segments.push_back(std::move(bwa));
+            segment_numbers.push_back({shard, 0});
+        }
+        for (uint64_t segment : complete ? bwa_index_delta_segments(name) : std::vector<uint64_t>()) {
+            if (segment <= last_merged)
+                continue;
+            std::shared_ptr<const BwaIndex> delta = acquire_file(key + "." + std::to_string(segment), bwa_index_segment_path(name, segment));
+            if (delta == nullptr) {
+                complete = false;
+                break;
+            }
+            segments.push_back(std::move(delta));
+            segment_numbers.push_back({std::nullopt, segment});
+        }
+        if (complete) {
+            if (numbers != nullptr)
+                *numbers = std::move(segment_numbers);
+            return segments;
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+void bwa_index_forget(const text* name) {
+    std::string key = index_name(name);
+    std::string segment_prefix = key + ".";
+
+    if (shared_cache != nullptr)
+        LWLockAcquire(shared_cache->lock, LW_EXCLUSIVE);
+    forget_key(key, bwa_index_path(name));
+    std::vector<std::string> segments;
+    for (const auto& [cached, local] : local_cache) {
+        if (cached.compare(0, segment_prefix.size(), segment_prefix) == 0)
+            segments.push_back(cached);
+    }
+    for (const std::string& segment : segments)
+        forget_key(segment, key_path(segment));
+    if (shared_cache != nullptr)
+        LWLockRelease(shared_cache->lock);
+}
+
+void bwa_index_forget_segment(const text* name, uint64_t segment) {
+    forget_file(index_name(name) + "." + std::to_string(segment), bwa_index_segment_path(name, segment));
+}
+
+std::vector<IndexCacheEntry> bwa_index_cache_entries() {
+    std::vector<IndexCacheEntry> entries;
+
+    if (shared_cache != nullptr) {
+        LWLockAcquire(shared_cache->lock, LW_SHARED);
+        for (int32_t i = 0; i < shared_cache->capacity; i++) {
+            const SharedIndexEntry& entry = shared_cache->entries[i];
+            if (entry.name[0] == '\0' || entry.backends == 0)
+                continue;
+            auto local = local_cache.find(entry.name);
+            entries.push_back({
+                .name = entry.name,
+                .size = entry.identity.size,
+                .backends = entry.backends,
+                .mapped_here = local != local_cache.end() && local->second.generation == entry.generation,
+                .last_used = entry.last_used,
+            });
+        }
+        LWLockRelease(shared_cache->lock);
+    } else {
+        for (const auto& [name, local] : local_cache) {
+            entries.push_back({
+                .name = name,
+                .size = local.identity.size,
+                .backends = -1,
+                .mapped_here = true,
+                .last_used = local.last_used,
+            });
+        }
+    }
+
+    return entries;
+}
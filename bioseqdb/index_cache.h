@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <postgres.h>
+#include <utils/timestamp.h>
+}
+
+#include "bwa.h"
+
+struct IndexCacheEntry {
+    std::string name;
+    uint64_t size;
+    // Number of backends with the index mapped, or -1 when the cache is not shared between backends.
+    int32_t backends;
+    bool mapped_here;
+    TimestampTz last_used;
+};
+
+// Persistent indexes live in a directory inside the data directory, which is the working directory of every backend.
+// Files are not covered by transactions, so creating or dropping an index takes effect immediately. The references of
+// an index are split into shards numbered from 0, each small enough for one FM-index, and the file of shard 0 is the
+// one that makes the index exist. References appended later are kept in delta segments, numbered from 1 in their own
+// files, until they are merged into the shards.
+extern const char* const index_directory;
+
+// A segment returned by bwa_index_acquire_segments, either a shard or a delta segment.
+struct IndexSegmentNumber {
+    std::optional<uint32_t> shard;
+    // Number of a delta segment, or 0 for shards.
+    uint64_t delta;
+};
+
+void index_cache_init();
+
+std::string bwa_index_path(const text* name);
+bool bwa_index_exists(const text* name);
+std::string bwa_index_shard_path(const text* name, uint32_t shard);
+// Numbers of the shards after the first one with files, in increasing order.
+std::vector<uint32_t> bwa_index_extra_shards(const text* name);
+std::string bwa_index_segment_path(const text* name, uint64_t segment);
+// Numbers of the delta segments with files, in increasing order, including ones already merged.
+std::vector<uint64_t> bwa_index_delta_segments(const text* name);
+
+// Returns the first shard mapped in this backend, mapping it on first use. The shared pointer keeps the mapping alive
+// even if the index is evicted or dropped while a search is still using it.
+std::shared_ptr<const BwaIndex> bwa_index_acquire(const text* name);
+// Returns the shards followed by the delta segments not yet merged into them, as a consistent set even while a merge is
+// running.
+std::vector<std::shared_ptr<const BwaIndex>> bwa_index_acquire_segments(const text* name, std::vector<IndexSegmentNumber>* numbers = nullptr);
+// Forgets the mappings of all shards and delta segments.
+void bwa_index_forget(const text* name);
+void bwa_index_forget_segment(const text* name, uint64_t segment);
+
+std::vector<IndexCacheEntry> bwa_index_cache_entries();
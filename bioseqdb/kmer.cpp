@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#include "kmer.h"
+
+std::vector<uint32_t> distinct_kmers(const NucleotideSequence& nucls) {
+    constexpr uint32_t mask = (1u << (2 * kmer_length)) - 1;
+    std::vector<uint32_t> kmers;
+    if (nucls.len >= kmer_length)
+        kmers.reserve(nucls.len - kmer_length + 1);
+
+    const ubyte_t* pac = nucls.pac();
+    const bntamb1_t* hole = nucls.holes();
+    const bntamb1_t* holes_end = nucls.holes() + nucls.holes_num;
+    uint32_t kmer = 0;
+    size_t bases = 0;
+    for (size_t i = 0; i < nucls.len; i++) {
+        if (hole != holes_end && i == static_cast<size_t>(hole->offset)) {
+            i += hole->len - 1;
+            hole++;
+            bases = 0;
+            continue;
+        }
+        kmer = (kmer << 2 | pac_raw_get(pac, i)) & mask;
+        if (++bases >= kmer_length)
+            kmers.push_back(kmer);
+    }
+
+    std::sort(kmers.begin(), kmers.end());
+    kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+    return kmers;
+}
+
+double kmer_similarity(const std::vector<uint32_t>& lhs, const std::vector<uint32_t>& rhs) {
+    if (lhs.empty() || rhs.empty())
+        return 0;
+
+    size_t common = 0;
+    auto l = lhs.begin();
+    auto r = rhs.begin();
+    while (l != lhs.end() && r != rhs.end()) {
+        if (*l < *r) {
+            l++;
+        } else if (*r < *l) {
+            r++;
+        } else {
+            common++;
+            l++;
+            r++;
+        }
+    }
+    return static_cast<double>(common) / static_cast<double>(lhs.size() + rhs.size() - common);
+}
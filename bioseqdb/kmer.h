@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "sequence.h"
+
+// Length of k-mers used by the GIN operator class. Twelve bases give 16M distinct keys, which is selective enough for
+// read-sized sequences, and packed two bits per base they fit into integer index keys.
+constexpr size_t kmer_length = 12;
+
+// Returns the distinct k-mers of the sequence in ascending order, packed with the first base most significant. K-mers
+// overlapping holes are skipped, so short sequences or ones made mostly of holes may have none.
+std::vector<uint32_t> distinct_kmers(const NucleotideSequence& nucls);
+
+// Jaccard similarity of two sets returned by distinct_kmers, or 0 when either of them is empty.
+double kmer_similarity(const std::vector<uint32_t>& lhs, const std::vector<uint32_t>& rhs);
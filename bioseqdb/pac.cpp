@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "pac.h"
+
+inline namespace {
+    constexpr uint64_t low_bits = 0x5555555555555555ull;
+
+    using UnpackTable = std::array<std::array<char, 4>, 256>;
+
+    // Tables turning one packed byte into its four bases, one symbol per byte, given the symbols of codes 0 to 3.
+    constexpr UnpackTable make_unpack_table(const char (&symbols)[5]) {
+        UnpackTable table {};
+        for (int byte = 0; byte < 256; byte++)
+            for (int i = 0; i < 4; i++)
+                table[byte][i] = symbols[byte >> ((3 - i) << 1) & 3];
+        return table;
+    }
+
+    constexpr auto letters_table = make_unpack_table("ACGT");
+    constexpr auto codes_table = make_unpack_table("\0\1\2\3");
+
+    uint64_t load_word(const ubyte_t* ptr) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        return word;
+    }
+
+    void store_word(ubyte_t* ptr, uint64_t word) {
+        memcpy(ptr, &word, sizeof(word));
+    }
+
+    // Reverses the order of the four bases inside every byte, by swapping nibbles and then the halves of each nibble.
+    uint64_t reverse_bases_in_bytes(uint64_t word) {
+        word = (word >> 4 & 0x0F0F0F0F0F0F0F0Full) | (word & 0x0F0F0F0F0F0F0F0Full) << 4;
+        word = (word >> 2 & 0x3333333333333333ull) | (word & 0x3333333333333333ull) << 2;
+        return word;
+    }
+
+    // XOR with the complement of code turns matching bases into 11, and those keep one bit after the AND with the word
+    // shifted by one. The pattern and masks have the same value in every field, so byte order of the word is irrelevant.
+    uint64_t matching_bases(uint64_t word, uint8_t code) {
+        uint64_t x = word ^ low_bits * (3 - code);
+        return x & x >> 1 & low_bits;
+    }
+
+    void complement_generic(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8)
+            store_word(dst + i, ~load_word(src + i));
+        for (; i < bytes; i++)
+            dst[i] = ~src[i];
+    }
+
+    // Writes the bytes of src to dst in reverse order, reversing the bases inside each of them.
+    void reverse_bytes_generic(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8)
+            store_word(dst + i, reverse_bases_in_bytes(__builtin_bswap64(load_word(src + bytes - i - 8))));
+        for (; i < bytes; i++)
+            dst[i] = reverse_bases_in_bytes(src[bytes - i - 1]);
+    }
+
+    size_t count_bytes_generic(const ubyte_t* pac, size_t begin, size_t end, uint8_t code) {
+        size_t count = 0;
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8)
+            count += __builtin_popcountll(matching_bases(load_word(pac + i), code));
+        for (; i < end; i++)
+            count += __builtin_popcountll(matching_bases(pac[i], code) & 0xFF);
+        return count;
+    }
+
+    void unpack_generic(const ubyte_t* pac, char* text, size_t len, const UnpackTable& table) {
+        size_t full_bytes = len / 4;
+        for (size_t i = 0; i < full_bytes; i++)
+            memcpy(text + 4 * i, table[pac[i]].data(), 4);
+        for (size_t i = full_bytes * 4; i < len; i++)
+            text[i] = table[pac[i >> 2]][i & 3];
+    }
+
+#if defined(__x86_64__)
+    struct CpuFeatures {
+        bool ssse3;
+        bool avx2;
+    };
+
+    const CpuFeatures& cpu_features() {
+        static const CpuFeatures features = [] {
+            __builtin_cpu_init();
+            return CpuFeatures {
+                .ssse3 = __builtin_cpu_supports("ssse3") != 0,
+                .avx2 = __builtin_cpu_supports("avx2") != 0,
+            };
+        }();
+        return features;
+    }
+
+    __attribute__((target("avx2")))
+    void complement_avx2(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+        const __m256i ones = _mm256_set1_epi8(-1);
+        size_t i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(v, ones));
+        }
+        complement_generic(src + i, dst + i, bytes - i);
+    }
+
+    __attribute__((target("ssse3")))
+    void reverse_bytes_ssse3(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+        const __m128i reverse_order = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        // Swaps the two bases of a nibble, leaving the result in the low or in the high nibble.
+        const __m128i low_table = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        const __m128i high_table = _mm_slli_epi16(low_table, 4);
+        size_t i = 0;
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + bytes - i - 16));
+            v = _mm_shuffle_epi8(v, reverse_order);
+            __m128i low = _mm_and_si128(v, nibble);
+            __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+            v = _mm_or_si128(_mm_shuffle_epi8(high_table, low), _mm_shuffle_epi8(low_table, high));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+        }
+        reverse_bytes_generic(src, dst + i, bytes - i);
+    }
+
+    __attribute__((target("avx2")))
+    size_t count_bytes_avx2(const ubyte_t* pac, size_t begin, size_t end, uint8_t code) {
+        const __m256i pattern = _mm256_set1_epi8(static_cast<char>(0x55 * (3 - code)));
+        const __m256i low = _mm256_set1_epi8(0x55);
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        const __m256i popcount_table = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        __m256i total = _mm256_setzero_si256();
+        size_t i = begin;
+        for (; i + 32 <= end; i += 32) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pac + i)), pattern);
+            __m256i matches = _mm256_and_si256(_mm256_and_si256(x, _mm256_srli_epi16(x, 1)), low);
+            __m256i counts = _mm256_add_epi8(
+                    _mm256_shuffle_epi8(popcount_table, _mm256_and_si256(matches, nibble)),
+                    _mm256_shuffle_epi8(popcount_table, _mm256_and_si256(_mm256_srli_epi16(matches, 4), nibble)));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+        size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+                + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+        return count + count_bytes_generic(pac, i, end, code);
+    }
+
+    __attribute__((target("ssse3")))
+    void unpack_ssse3(const ubyte_t* pac, char* text, size_t len, const UnpackTable& table) {
+        // The table of the generic version already holds the four symbols in order, as the expansion of byte 0x1B.
+        const auto& s = table[0x1B];
+        const __m128i letters = _mm_setr_epi8(s[0], s[1], s[2], s[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i mask = _mm_set1_epi8(3);
+        size_t full_bytes = len / 4;
+        size_t i = 0;
+        for (; i + 16 <= full_bytes; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pac + i));
+            // Shifting 16-bit lanes moves bits between neighbouring bytes, but the mask only keeps the wanted base.
+            __m128i base0 = _mm_and_si128(_mm_srli_epi16(v, 6), mask);
+            __m128i base1 = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+            __m128i base2 = _mm_and_si128(_mm_srli_epi16(v, 2), mask);
+            __m128i base3 = _mm_and_si128(v, mask);
+            __m128i low01 = _mm_unpacklo_epi8(base0, base1);
+            __m128i high01 = _mm_unpackhi_epi8(base0, base1);
+            __m128i low23 = _mm_unpacklo_epi8(base2, base3);
+            __m128i high23 = _mm_unpackhi_epi8(base2, base3);
+            __m128i* out = reinterpret_cast<__m128i*>(text + 4 * i);
+            _mm_storeu_si128(out, _mm_shuffle_epi8(letters, _mm_unpacklo_epi16(low01, low23)));
+            _mm_storeu_si128(out + 1, _mm_shuffle_epi8(letters, _mm_unpackhi_epi16(low01, low23)));
+            _mm_storeu_si128(out + 2, _mm_shuffle_epi8(letters, _mm_unpacklo_epi16(high01, high23)));
+            _mm_storeu_si128(out + 3, _mm_shuffle_epi8(letters, _mm_unpackhi_epi16(high01, high23)));
+        }
+        unpack_generic(pac + i, text + 4 * i, len - 4 * i, table);
+    }
+#endif
+
+    void reverse_bytes(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+#if defined(__x86_64__)
+        if (cpu_features().ssse3)
+            return reverse_bytes_ssse3(src, dst, bytes);
+#endif
+        reverse_bytes_generic(src, dst, bytes);
+    }
+
+    size_t count_bytes(const ubyte_t* pac, size_t begin, size_t end, uint8_t code) {
+#if defined(__x86_64__)
+        if (cpu_features().avx2)
+            return count_bytes_avx2(pac, begin, end, code);
+#endif
+        return count_bytes_generic(pac, begin, end, code);
+    }
+}
+
+void pac_complement(const ubyte_t* src, ubyte_t* dst, size_t bytes) {
+#if defined(__x86_64__)
+    if (cpu_features().avx2)
+        return complement_avx2(src, dst, bytes);
+#endif
+    complement_generic(src, dst, bytes);
+}
+
+void pac_reverse(const ubyte_t* src, ubyte_t* dst, size_t len) {
+    size_t bytes = (len + 3) / 4;
+    if (bytes == 0)
+        return;
+
+    reverse_bytes(src, dst, bytes);
+
+    // Padding of the last source byte ended up at the front, so all bases move towards the start by its size. Bytes are
+    // read as big-endian words, which keeps the first base in the most significant bits.
+    unsigned shift = (bytes * 4 - len) * 2;
+    if (shift == 0)
+        return;
+    size_t i = 0;
+    for (; i + 9 <= bytes; i += 8) {
+        uint64_t word = __builtin_bswap64(load_word(dst + i)) << shift | dst[i + 8] >> (8 - shift);
+        store_word(dst + i, __builtin_bswap64(word));
+    }
+    for (; i + 1 < bytes; i++)
+        dst[i] = dst[i] << shift | dst[i + 1] >> (8 - shift);
+    dst[bytes - 1] <<= shift;
+}
+
+size_t pac_count(const ubyte_t* pac, size_t begin, size_t end, uint8_t code) {
+    auto count_single = [&](size_t from, size_t to) {
+        size_t count = 0;
+        for (size_t i = from; i < to; i++)
+            count += (pac[i >> 2] >> ((~i & 3) << 1) & 3) == code;
+        return count;
+    };
+
+    size_t first_full = (begin + 3) / 4;
+    size_t last_full = end / 4;
+    if (first_full >= last_full)
+        return count_single(begin, end);
+    return count_single(begin, first_full * 4) + count_bytes(pac, first_full, last_full, code)
+            + count_single(last_full * 4, end);
+}
+
+size_t pac_mismatch(const ubyte_t* a, const ubyte_t* b, size_t begin, size_t end) {
+    size_t i = begin;
+    for (; i < end && (i & 3) != 0; i++) {
+        if ((a[i >> 2] ^ b[i >> 2]) >> ((~i & 3) << 1) & 3)
+            return i;
+    }
+
+    // Whole bytes are compared a word at a time. The first differing byte is the lowest one in a little-endian load,
+    // and the first differing base is the most significant differing field within it.
+    size_t byte = i >> 2;
+    size_t end_byte = end >> 2;
+    for (; byte + 8 <= end_byte; byte += 8) {
+        uint64_t diff = load_word(a + byte) ^ load_word(b + byte);
+        if (diff != 0) {
+            byte += __builtin_ctzll(diff) >> 3;
+            break;
+        }
+    }
+    for (; byte < end_byte; byte++) {
+        if (a[byte] != b[byte])
+            return byte * 4 + (__builtin_clz(static_cast<unsigned>(a[byte] ^ b[byte])) - 24) / 2;
+    }
+
+    for (i = std::max(i, end_byte * 4); i < end; i++) {
+        if ((a[i >> 2] ^ b[i >> 2]) >> ((~i & 3) << 1) & 3)
+            return i;
+    }
+    return end;
+}
+
+void pac_unpack(const ubyte_t* pac, char* text, size_t len) {
+#if defined(__x86_64__)
+    if (cpu_features().ssse3)
+        return unpack_ssse3(pac, text, len, letters_table);
+#endif
+    unpack_generic(pac, text, len, letters_table);
+}
+
+void pac_expand(const ubyte_t* pac, ubyte_t* codes, size_t len) {
+    char* out = reinterpret_cast<char*>(codes);
+#if defined(__x86_64__)
+    if (cpu_features().ssse3)
+        return unpack_ssse3(pac, out, len, codes_table);
+#endif
+    unpack_generic(pac, out, len, codes_table);
+}
+
+uint64_t pac_load(const ubyte_t* pac, size_t bytes, size_t pos) {
+    size_t byte = pos >> 2;
+    ubyte_t buffer[9] = {};
+    memcpy(buffer, pac + byte, std::min<size_t>(sizeof(buffer), bytes - byte));
+
+    uint64_t word = __builtin_bswap64(load_word(buffer));
+    unsigned shift = (pos & 3) << 1;
+    if (shift != 0)
+        word = word << shift | buffer[8] >> (8 - shift);
+    return word;
+}
+
+// Windows starting at a byte boundary are plain byte copies, others are shifted 32 bases at a time.
+void pac_copy(const ubyte_t* src, size_t bytes, size_t pos, ubyte_t* dst, size_t len) {
+    size_t dst_bytes = (len + 3) / 4;
+    if ((pos & 3) == 0) {
+        memcpy(dst, src + (pos >> 2), std::min(dst_bytes, bytes - (pos >> 2)));
+        return;
+    }
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+        store_word(dst + i / 4, __builtin_bswap64(pac_load(src, bytes, pos + i)));
+    if (i < len) {
+        uint64_t word = __builtin_bswap64(pac_load(src, bytes, pos + i));
+        memcpy(dst + i / 4, &word, dst_bytes - i / 4);
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <bwa/bwt.h>
+}
+
+// Kernels working on bases packed two bits each, most significant bits first, as stored in NucleotideSequence. Every
+// kernel has a portable implementation working on 64-bit words, and x86-64 builds pick a vectorized one at runtime when
+// the processor supports it.
+
+// Writes the complements of the bases in src[0, bytes) to dst.
+void pac_complement(const ubyte_t* src, ubyte_t* dst, size_t bytes);
+
+// Writes the first len bases of src to dst in reverse order. Bases of the last byte of dst past len are zero.
+void pac_reverse(const ubyte_t* src, ubyte_t* dst, size_t len);
+
+// Counts bases equal to code among bases [begin, end).
+size_t pac_count(const ubyte_t* pac, size_t begin, size_t end, uint8_t code);
+
+// Returns the position of the first base in [begin, end) that differs between a and b, or end if there is none.
+size_t pac_mismatch(const ubyte_t* a, const ubyte_t* b, size_t begin, size_t end);
+
+// Writes the first len bases as letters from ACGT, without a terminating zero.
+void pac_unpack(const ubyte_t* pac, char* text, size_t len);
+
+// Writes the first len bases as their codes from 0 to 3, one byte each, the form libbwa aligns.
+void pac_expand(const ubyte_t* pac, ubyte_t* codes, size_t len);
+
+// Returns 32 bases starting at pos, the first one in the most significant bits. Only pac[0, bytes) is read, and bases
+// past it are zero.
+uint64_t pac_load(const ubyte_t* pac, size_t bytes, size_t pos);
+
+// Writes len bases of src starting at base pos to dst, from its first base on. Only src[0, bytes) is read, and bases of
+// the last byte of dst past len are unspecified.
+void pac_copy(const ubyte_t* src, size_t bytes, size_t pos, ubyte_t* dst, size_t len);
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+
+extern "C" {
+#include <postgres.h>
+}
+
+// Raises a C++ exception as a PostgreSQL error. PostgreSQL unwinds errors with longjmp through C frames, which C++
+// exceptions must never reach, so the exception is only inspected here and the error is raised after its handler ends.
+[[noreturn]] inline void raise_exception_as_error(std::exception_ptr exception) {
+    const char* message = nullptr;
+    try {
+        std::rethrow_exception(exception);
+    } catch (const std::bad_alloc&) {
+    } catch (const std::exception& e) {
+        message = pstrdup(e.what());
+    } catch (...) {
+        message = "unknown C++ exception";
+    }
+    if (message == nullptr)
+        ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
+    elog(ERROR, "%s", message);
+    pg_unreachable();
+}
+
+// Runs f on the backend thread, raising any C++ exception it throws as a PostgreSQL error.
+template<typename F>
+void with_exceptions_as_errors(F f) {
+    std::exception_ptr exception;
+    try {
+        f();
+    } catch (...) {
+        exception = std::current_exception();
+    }
+    if (exception)
+        raise_exception_as_error(exception);
+}
+
+// Number of threads to use for a `threads` option, where 0 means one per available core. Options come from any SQL
+// caller, so larger counts are capped at the number of cores as well.
+static inline int resolve_thread_count(int threads) {
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    if (threads > 0)
+        return std::min(threads, cores);
+    return cores;
+}
+
+// Blocks every signal for the lifetime of the object, and restores the previous mask even when leaving by exception.
+class SignalsBlocked {
+public:
+    SignalsBlocked() {
+        sigset_t all_signals;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    }
+    ~SignalsBlocked() { pthread_sigmask(SIG_SETMASK, &old_signals, nullptr); }
+
+    SignalsBlocked(const SignalsBlocked&) = delete;
+    SignalsBlocked& operator=(const SignalsBlocked&) = delete;
+
+private:
+    sigset_t old_signals;
+};
+
+// Runs f with every signal blocked, so that threads it starts inherit the mask and PostgreSQL signal handlers only ever
+// run on the backend thread.
+template<typename F>
+void with_signals_blocked(F f) {
+    SignalsBlocked blocked;
+    f();
+}
+
+// Number of threads parallel_for uses for n items.
+static inline size_t parallel_worker_count(size_t n, int threads) {
+    return std::max<size_t>(1, std::min<size_t>(resolve_thread_count(threads), n));
+}
+
+// Runs f(worker, i) for every i in [0, n), spreading the work over up to `threads` threads. Every thread has its own
+// worker number in [0, parallel_worker_count(n, threads)), so it can use per-thread state without locking. The calling
+// thread takes part in the work as worker 0, and the function returns once every item is done.
+//
+// Worker threads run outside of PostgreSQL, so f must not palloc, raise errors, check for interrupts or touch any other
+// backend state. Signals are blocked in the workers. When f throws, remaining items are skipped and the first exception
+// is raised as a PostgreSQL error on the calling thread once every thread has stopped, so this must be called from the
+// backend thread. When the system refuses to start more threads, the ones already running share the work.
+template<typename F>
+void parallel_for_workers(size_t n, int threads, F f) {
+    size_t workers = parallel_worker_count(n, threads);
+    std::atomic<size_t> next{0};
+    std::mutex error_lock;
+    std::exception_ptr error;
+    auto work = [&](size_t worker) {
+        try {
+            for (size_t i = next++; i < n; i = next++)
+                f(worker, i);
+        } catch (...) {
+            next = n;
+            std::lock_guard<std::mutex> guard(error_lock);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    if (workers > 1) {
+        with_signals_blocked([&] {
+            try {
+                pool.reserve(workers - 1);
+                for (size_t i = 1; i < workers; i++)
+                    pool.emplace_back(work, i);
+            } catch (const std::exception&) {}
+        });
+    }
+
+    work(0);
+    for (auto& thread : pool)
+        thread.join();
+    if (error)
+        raise_exception_as_error(error);
+}
+
+// Runs f(i) for every i in [0, n), with the same rules as parallel_for_workers.
+template<typename F>
+void parallel_for(size_t n, int threads, F f) {
+    parallel_for_workers(n, threads, [&](size_t, size_t i) { f(i); });
+}
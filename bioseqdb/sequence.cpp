@@ -1,7 +1,13 @@
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <random>
 
+extern "C" {
+#include <common/hashfn.h>
+}
+
+#include "pac.h"
 #include "sequence.h"
 
 inline namespace {
@@ -68,11 +74,56 @@ NucleotideSequence* alloc_raw_nucls(uint32_t holes_num, uint32_t len) {
     return ptr;
 }
 
-void inplace_to_text(const NucleotideSequence& nucls, char* text) {
-    const ubyte_t* pac = nucls.pac();
+// libbwa requires random values inside holes, but again we want them to be deterministic => lcg. The values only depend
+// on the holes and the length, so equal sequences have equal bits no matter which function produced them.
+void fill_random_bases(NucleotideSequence& nucls) {
+    ubyte_t* pac = nucls.pac();
+    std::minstd_rand rng(nucls.holes_num ^ nucls.len);
+    auto put_random = [&](uint32_t i) {
+        pac[i >> 2] &= ~(0b11 << ((~i & 3) << 1));
+        pac_raw_set(pac, i, rng() & 0b11);
+    };
 
-    for(uint32_t i = 0 ; i < nucls.len; i++)
-        text[i] = "ACGT"[pac_raw_get(pac, i)];
+    for(const bntamb1_t* hole = nucls.holes() ; hole < nucls.holes() + nucls.holes_num ; hole++) {
+        for(int64_t i = hole->offset ; i < hole->offset + hole->len ; i++)
+            put_random(i);
+    }
+
+    for(uint32_t i = nucls.len ; i < pac_byte_size(nucls.len) * 4 ; i++)
+        put_random(i);
+}
+
+// Checks whether needle appears at pos. The holes of nucls cut to the window must be exactly the holes of needle, and
+// then only the bases between them are compared, 32 at a time.
+bool matches_at(const NucleotideSequence& nucls, const NucleotideSequence& needle, size_t pos) {
+    const bntamb1_t* needle_hole = needle.holes();
+    const bntamb1_t* needle_holes_end = needle.holes() + needle.holes_num;
+    size_t end = pos + needle.len;
+
+    auto [first, last] = overlapping_holes(nucls.holes(), nucls.holes_num, pos, end);
+    for (const bntamb1_t* hole = first; hole != last; hole++, needle_hole++) {
+        size_t begin_in_window = std::max<size_t>(hole->offset, pos) - pos;
+        size_t end_in_window = std::min<size_t>(hole->offset + hole->len, end) - pos;
+        if (needle_hole == needle_holes_end || static_cast<size_t>(needle_hole->offset) != begin_in_window
+                || static_cast<size_t>(needle_hole->offset + needle_hole->len) != end_in_window || needle_hole->amb != hole->amb)
+            return false;
+    }
+    if (needle_hole != needle_holes_end)
+        return false;
+
+    bool equal = true;
+    for_each_block(needle, [&](uint32_t p, uint32_t q) {
+        for (size_t i = p; equal && i < q; i += 32) {
+            uint64_t mask = ~0ull << (64 - 2 * std::min<size_t>(32, q - i));
+            uint64_t diff = pac_load(nucls.pac(), pac_byte_size(nucls.len), pos + i) ^ pac_load(needle.pac(), pac_byte_size(needle.len), i);
+            equal = (diff & mask) == 0;
+        }
+    });
+    return equal;
+}
+
+void inplace_to_text(const NucleotideSequence& nucls, char* text) {
+    pac_unpack(nucls.pac(), text, nucls.len);
 
     for(const bntamb1_t* hole = nucls.holes() ; hole < nucls.holes() + nucls.holes_num ; hole++)
         std::fill(text + hole->offset, text + hole->offset + hole->len, hole->amb);
@@ -96,10 +147,7 @@ uint32_t NucleotideSequence::occurences(char chr) const {
         }
     } else {
         for_each_block(*this, [&](uint32_t p, uint32_t q) {
-            for(uint32_t i = p; i < q ; i++) {
-                if(pac_raw_get(pac, i) == code)
-                    count++;
-            }
+            count += pac_count(pac, p, q, code);
         });
     }
 
@@ -108,53 +156,33 @@ uint32_t NucleotideSequence::occurences(char chr) const {
 
 NucleotideSequence* NucleotideSequence::complement() const {
     auto com_nucls = alloc_raw_nucls(holes_num, len);
-    auto com_pac = com_nucls->pac();
     auto com_holes = com_nucls->holes();
-    auto pac = this->pac();
 
     std::copy_n(holes(), holes_num, com_holes);
-    for(uint32_t i = 0 ; i < holes_num ; i++) {
-        const auto& hole = holes()[i];
-        com_holes[i].amb = complement_symbol(hole.amb);
-        for(uint32_t j = hole.offset ; j < hole.offset + hole.len ; j++)
-            pac_raw_set(com_pac, j, pac_raw_get(pac, j));
-    }
+    for(uint32_t i = 0 ; i < holes_num ; i++)
+        com_holes[i].amb = complement_symbol(com_holes[i].amb);
 
-    for_each_block(*this, [&](uint32_t p, uint32_t q) {
-        for(uint32_t i = p; i < q ; i++) {
-            pac_raw_set(com_pac, i, 0b11 - pac_raw_get(pac, i));
-        }
-    });
+    // Complementing a 2-bit code is negation, so whole words are negated at once and the holes are filled again.
+    pac_complement(pac(), com_nucls->pac(), pac_byte_size(len));
+    fill_random_bases(*com_nucls);
 
     return com_nucls;
 };
 
 NucleotideSequence* NucleotideSequence::reverse() const {
     auto rev_nucls = alloc_raw_nucls(holes_num, len);
-    auto rev_pac = rev_nucls->pac();
     auto rev_holes = rev_nucls->holes();
-    auto pac = this->pac();
     auto holes = this->holes();
-    std::minstd_rand rng(holes_num ^ len);
-
-    for_each_block(*this, [&](uint32_t p, uint32_t q) {
-        for(uint32_t i = p; i < q ; i++) {
-            pac_raw_set(rev_pac, len - i - 1, pac_raw_get(pac, i));
-        }
-    });
 
     for(uint32_t i = 0  ; i < holes_num ; i++) {
         const auto& hole = holes[i];
         auto& rev_hole = rev_holes[holes_num - i - 1];
         rev_hole = hole;
-        rev_hole.offset = len - hole.offset - 1;
-
-        for(uint32_t j = rev_hole.offset ; j < rev_hole.offset + rev_hole.len ; j++)
-            pac_raw_set(rev_pac, j, rng() & 0b11);
+        rev_hole.offset = len - hole.offset - hole.len;
     }
 
-    for(uint32_t i = len; i < pac_byte_size(len) * 4 ; i++)
-        pac_raw_set(rev_pac, i, rng() & 0b11);
+    pac_reverse(pac(), rev_nucls->pac(), len);
+    fill_random_bases(*rev_nucls);
 
     return rev_nucls;
 }
@@ -165,21 +193,152 @@ char* NucleotideSequence::to_text_palloc() const {
     return text;
 }
 
+void NucleotideSequence::to_codes(ubyte_t* codes) const {
+    pac_expand(pac(), codes, len);
+
+    for(const bntamb1_t* hole = holes() ; hole < holes() + holes_num ; hole++)
+        std::fill(codes + hole->offset, codes + hole->offset + hole->len, 4);
+}
+
+std::string NucleotideSequence::to_string() const {
+    std::string text(len, '\0');
+    // std::string always keeps space for the terminating zero written by inplace_to_text.
+    inplace_to_text(*this, text.data());
+    return text;
+}
+
+// Candidates are found by sliding a window over packed bases and looking for the longest stretch of bases of the needle,
+// up to 32 of them. Filler bases inside holes can make false candidates, so every candidate is checked in full.
+std::optional<size_t> NucleotideSequence::find(const NucleotideSequence& needle) const {
+    if (needle.len > len)
+        return std::nullopt;
+    size_t last = len - needle.len;
+
+    size_t anchor = 0;
+    size_t anchor_len = 0;
+    for_each_block(needle, [&](uint32_t p, uint32_t q) {
+        if (q - p > anchor_len) {
+            anchor = p;
+            anchor_len = q - p;
+        }
+    });
+    anchor_len = std::min<size_t>(anchor_len, 32);
+
+    if (anchor_len == 0) {
+        for (size_t pos = 0; pos <= last; pos++) {
+            if (matches_at(*this, needle, pos))
+                return pos;
+        }
+        return std::nullopt;
+    }
+
+    uint64_t mask = ~0ull >> (64 - 2 * anchor_len);
+    uint64_t target = pac_load(needle.pac(), pac_byte_size(needle.len), anchor) >> (64 - 2 * anchor_len);
+    uint64_t window = 0;
+    const ubyte_t* pac = this->pac();
+    for (size_t i = anchor; i < last + anchor + anchor_len; i++) {
+        window = window << 2 | pac_raw_get(pac, i);
+        if (i + 1 >= anchor + anchor_len && (window & mask) == target) {
+            size_t pos = i + 1 - anchor_len - anchor;
+            if (matches_at(*this, needle, pos))
+                return pos;
+        }
+    }
+    return std::nullopt;
+}
+
+// Sequences are ordered lexicographically by symbols, where bases come in ACGT order and before all ambiguous symbols,
+// which are ordered by their letters. Hole-free stretches are compared on packed bytes, so filler bases inside holes
+// never affect the result.
 int NucleotideSequence::compare(const NucleotideSequence& lhs, const NucleotideSequence& rhs) {
-    for (size_t i = 0; i < lhs.len && i < rhs.len; ++i) {
-        uint8_t left_nucl = pac_raw_get(lhs.pac(), i);
-        uint8_t right_nucl = pac_raw_get(rhs.pac(), i);
-        if (left_nucl < right_nucl)
-            return -1;
-        else if (left_nucl > right_nucl)
-            return 1;
+    const bntamb1_t* lhs_hole = lhs.holes();
+    const bntamb1_t* rhs_hole = rhs.holes();
+    const bntamb1_t* lhs_holes_end = lhs.holes() + lhs.holes_num;
+    const bntamb1_t* rhs_holes_end = rhs.holes() + rhs.holes_num;
+    size_t pos = 0;
+
+    while (true) {
+        while (lhs_hole != lhs_holes_end && static_cast<size_t>(lhs_hole->offset + lhs_hole->len) <= pos)
+            lhs_hole++;
+        while (rhs_hole != rhs_holes_end && static_cast<size_t>(rhs_hole->offset + rhs_hole->len) <= pos)
+            rhs_hole++;
+
+        if (pos >= lhs.len || pos >= rhs.len)
+            return pos < rhs.len ? -1 : pos < lhs.len ? 1 : 0;
+
+        bool lhs_in_hole = lhs_hole != lhs_holes_end && static_cast<size_t>(lhs_hole->offset) <= pos;
+        bool rhs_in_hole = rhs_hole != rhs_holes_end && static_cast<size_t>(rhs_hole->offset) <= pos;
+
+        if (!lhs_in_hole && !rhs_in_hole) {
+            size_t end = std::min(lhs.len, rhs.len);
+            if (lhs_hole != lhs_holes_end)
+                end = std::min<size_t>(end, lhs_hole->offset);
+            if (rhs_hole != rhs_holes_end)
+                end = std::min<size_t>(end, rhs_hole->offset);
+
+            pos = pac_mismatch(lhs.pac(), rhs.pac(), pos, end);
+            if (pos < end)
+                return pac_raw_get(lhs.pac(), pos) < pac_raw_get(rhs.pac(), pos) ? -1 : 1;
+        } else if (lhs_in_hole != rhs_in_hole) {
+            return lhs_in_hole ? 1 : -1;
+        } else if (lhs_hole->amb != rhs_hole->amb) {
+            return lhs_hole->amb < rhs_hole->amb ? -1 : 1;
+        } else {
+            pos = std::min(lhs_hole->offset + lhs_hole->len, rhs_hole->offset + rhs_hole->len);
+        }
     }
-    if (lhs.len < rhs.len)
-        return -1;
-    else if (lhs.len == rhs.len)
-        return 0;
-    else
-        return 1;
+}
+
+uint64_t NucleotideSequence::prefix_key() const {
+    // Packed bases are most significant first, so a big-endian read makes the first base the most significant one.
+    uint64_t key = 0;
+    memcpy(&key, pac(), std::min<size_t>(pac_byte_size(len), sizeof(key)));
+    key = __builtin_bswap64(key);
+
+    if (len < 32)
+        key &= ~(~0ull >> (2 * len));
+    if (holes_num > 0 && holes()[0].offset < 32)
+        key |= ~0ull >> (2 * holes()[0].offset);
+
+    return key;
+}
+
+// Hashes the symbols only, with filler bases inside holes and in the padding masked out, so the hash agrees with
+// compare even for values whose filler bits differ. Packed bytes are masked in a small buffer, one block at a time.
+uint64_t NucleotideSequence::hash(uint64_t seed) const {
+    constexpr size_t block_bytes = 4096;
+    ubyte_t block[block_bytes];
+    const bntamb1_t* hole = holes();
+    const bntamb1_t* holes_end = holes() + holes_num;
+    size_t pac_bytes = pac_byte_size(len);
+    uint64_t result = hash_bytes_uint32_extended(len, seed);
+
+    for (size_t begin = 0; begin < pac_bytes; begin += block_bytes) {
+        size_t end = std::min(begin + block_bytes, pac_bytes);
+        std::copy(pac() + begin, pac() + end, block);
+
+        auto clear = [&](size_t from, size_t to) {
+            for (size_t i = std::max(from, begin * 4); i < std::min(to, end * 4); i++)
+                block[(i >> 2) - begin] &= ~(0b11 << ((~i & 3) << 1));
+        };
+        for (; hole != holes_end && static_cast<size_t>(hole->offset) < end * 4; hole++) {
+            clear(hole->offset, hole->offset + hole->len);
+            if (static_cast<size_t>(hole->offset + hole->len) > end * 4)
+                break;
+        }
+        if (end == pac_bytes)
+            clear(len, pac_bytes * 4);
+
+        result = hash_combine64(result, hash_bytes_extended(block, end - begin, seed));
+    }
+
+    for (hole = holes(); hole != holes_end; hole++) {
+        result = hash_combine64(result, hash_bytes_uint32_extended(hole->offset, seed));
+        result = hash_combine64(result, hash_bytes_uint32_extended(hole->len, seed));
+        result = hash_combine64(result, hash_bytes_uint32_extended(hole->amb, seed));
+    }
+
+    return result;
 }
 
 bool operator==(const NucleotideSequence& left, const NucleotideSequence& right) {
@@ -211,8 +370,6 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
     NucleotideSequence* nucls = alloc_raw_nucls(holes_num, str.size());
     auto pac = nucls->pac();
 
-    // libbwa requires random values inside holes, but again we want them to be deterministic => lcg
-    std::minstd_rand rng(holes_num ^ str.size());
     bntamb1_t* hole = nucls->holes() - 1;
     char prev_chr = 0;
 
@@ -229,7 +386,6 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
                 hole->offset = idx;
                 hole->len = 1;
             }
-            pac_raw_set(pac, idx, rng() & 0b11);
         }
         else {
             pac_raw_set(pac, idx, code);
@@ -238,8 +394,45 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
         prev_chr = chr;
     }
 
-    for(uint32_t i = nucls->len ; i < pac_byte_size(nucls->len) * 4 ; i++)
-        pac_raw_set(pac, i, rng() & 0b11);
+    fill_random_bases(*nucls);
+
+    return nucls;
+}
+
+NucleotideSequence* nuclseq_from_packed(uint32_t len, const bntamb1_t* holes, uint32_t holes_num, const ubyte_t* pac) {
+    NucleotideSequence* nucls = alloc_raw_nucls(holes_num, len);
+    std::copy_n(holes, holes_num, nucls->holes());
+    std::copy_n(pac, pac_byte_size(len), nucls->pac());
+    fill_random_bases(*nucls);
+    return nucls;
+}
+
+std::pair<const bntamb1_t*, const bntamb1_t*> overlapping_holes(const bntamb1_t* holes, uint32_t holes_num, size_t begin, size_t end) {
+    const bntamb1_t* holes_end = holes + holes_num;
+    const bntamb1_t* first = std::lower_bound(holes, holes_end, begin, [](const bntamb1_t& hole, size_t pos) {
+        return static_cast<size_t>(hole.offset + hole.len) <= pos;
+    });
+    const bntamb1_t* last = begin == end ? first : std::lower_bound(first, holes_end, end, [](const bntamb1_t& hole, size_t pos) {
+        return static_cast<size_t>(hole.offset) < pos;
+    });
+    return {first, last};
+}
+
+NucleotideSequence* nuclseq_from_slice(const bntamb1_t* holes, uint32_t holes_num, const ubyte_t* pac, size_t begin, size_t end) {
+    auto [first, last] = overlapping_holes(holes, holes_num, begin, end);
+
+    NucleotideSequence* nucls = alloc_raw_nucls(last - first, end - begin);
+    bntamb1_t* slice_hole = nucls->holes();
+    for (const bntamb1_t* hole = first; hole != last; hole++, slice_hole++) {
+        size_t hole_begin = std::max<size_t>(hole->offset, begin);
+        size_t hole_end = std::min<size_t>(hole->offset + hole->len, end);
+        slice_hole->offset = hole_begin - begin;
+        slice_hole->len = hole_end - hole_begin;
+        slice_hole->amb = hole->amb;
+    }
 
+    size_t pac_bytes = end > begin ? pac_byte_size(end) - begin / 4 : 0;
+    pac_copy(pac, pac_bytes, begin & 3, nucls->pac(), end - begin);
+    fill_random_bases(*nucls);
     return nucls;
 }
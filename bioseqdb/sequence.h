@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <optional>
+#include <string>
 #include <string_view> 
+#include <utility>
 
 extern "C" {
 #include <bwa/bwt.h>
@@ -28,8 +31,20 @@ struct NucleotideSequence {
     NucleotideSequence* complement() const;
     NucleotideSequence* reverse() const;
     char* to_text_palloc() const;
+    std::string to_string() const;
+    // Writes len bases as codes from 0 to 3 and ambiguous symbols as 4, the encoding libbwa uses internally.
+    void to_codes(ubyte_t* codes) const;
+
+    // Returns the position of the first occurrence of needle. Ambiguous symbols only match the same symbols.
+    std::optional<size_t> find(const NucleotideSequence& needle) const;
 
     static int compare(const NucleotideSequence& lhs, const NucleotideSequence& rhs);
+    // The first 32 symbols packed into a number that orders like compare. Bases past the end are set to A, the smallest
+    // symbol, and everything from the first hole onwards to T, so the key never orders ahead of a larger sequence. Equal
+    // keys say nothing about the order.
+    uint64_t prefix_key() const;
+    // Consistent with compare, so equal sequences have equal hashes.
+    uint64_t hash(uint64_t seed) const;
 
     char vl_len[4];
     uint32_t holes_num;
@@ -38,6 +53,17 @@ struct NucleotideSequence {
 };
 
 NucleotideSequence* nuclseq_from_text(std::string_view str);
+// Builds a sequence from packed bases and holes that are already known to be valid. Bases inside holes and past the end
+// are ignored.
+NucleotideSequence* nuclseq_from_packed(uint32_t len, const bntamb1_t* holes, uint32_t holes_num, const ubyte_t* pac);
+
+// Returns the holes overlapping bases [begin, end), found by binary search in holes sorted by offset, as they are both
+// in sequences and in the concatenated reference of an index.
+std::pair<const bntamb1_t*, const bntamb1_t*> overlapping_holes(const bntamb1_t* holes, uint32_t holes_num, size_t begin, size_t end);
+
+// Builds the sequence of bases [begin, end) of a larger one, given all of its holes. The packed bytes start at the byte
+// containing base begin and end at the byte containing base end - 1, as read from a slice of a stored value.
+NucleotideSequence* nuclseq_from_slice(const bntamb1_t* holes, uint32_t holes_num, const ubyte_t* pac, size_t begin, size_t end);
 
 bool operator==(const NucleotideSequence& left, const NucleotideSequence& right);
 bool operator!=(const NucleotideSequence& left, const NucleotideSequence& right);
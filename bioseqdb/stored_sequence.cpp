@@ -0,0 +1,115 @@
+#include <cstring>
+
+extern "C" {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wregister"
+#include <postgres.h>
+#include <fmgr.h>
+#include <access/detoast.h>
+#pragma GCC diagnostic pop
+}
+
+#include "stored_sequence.h"
+
+inline namespace {
+
+constexpr int32 header_size = 2 * sizeof(uint32_t);
+constexpr int32 encoded_header_size = sizeof(EncodedSequence) - VARHDRSZ;
+
+// Slicing a compressed value decompresses everything before the slice, so reading those piece by piece would take
+// quadratic time. Such values can only come from columns created before the type switched to external storage.
+bool is_sliceable(Datum datum) {
+    auto attr = reinterpret_cast<struct varlena*>(DatumGetPointer(datum));
+    if (!VARATT_IS_EXTERNAL_ONDISK(attr))
+        return false;
+
+    struct varatt_external toast_pointer;
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+    return !VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer);
+}
+
+}
+
+StoredSequence::StoredSequence(Datum datum): datum(datum), detoasted(nullptr), encoded(false), holes_bytes(0), blocks(0),
+        hole_array(nullptr), block_end_array(nullptr) {
+    if (is_sliceable(datum)) {
+        // The header of plain values is shorter, but they are long enough for the slice to stay within them.
+        auto header = reinterpret_cast<const EncodedSequence*>(PG_DETOAST_DATUM_SLICE(datum, 0, encoded_header_size));
+        encoded = (header->holes_flagged & encoded_sequence_flag) != 0;
+        len = header->len;
+        holes_count = header->holes_num();
+        if (encoded) {
+            holes_bytes = header->holes_bytes;
+            blocks = header->blocks;
+        }
+        pfree(const_cast<EncodedSequence*>(header));
+    } else {
+        detoasted = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(datum));
+        if (is_encoded(*detoasted)) {
+            const NucleotideSequence* decoded = nuclseq_decode(*reinterpret_cast<const EncodedSequence*>(detoasted));
+            if (reinterpret_cast<Pointer>(const_cast<NucleotideSequence*>(detoasted)) != DatumGetPointer(datum))
+                pfree(const_cast<NucleotideSequence*>(detoasted));
+            detoasted = decoded;
+        }
+        len = detoasted->len;
+        holes_count = detoasted->holes_num;
+    }
+}
+
+const bntamb1_t* StoredSequence::holes() {
+    if (detoasted != nullptr)
+        return detoasted->holes();
+
+    if (hole_array == nullptr)
+        read_holes();
+    return hole_array;
+}
+
+// Slices of varlenas are not aligned, so the holes and block ends are copied before use.
+void StoredSequence::read_holes() {
+    hole_array = static_cast<bntamb1_t*>(palloc0(std::max<size_t>(holes_count, 1) * sizeof(bntamb1_t)));
+    if (!encoded) {
+        if (holes_count > 0) {
+            auto holes_slice = PG_DETOAST_DATUM_SLICE(datum, header_size, holes_count * sizeof(bntamb1_t));
+            memcpy(hole_array, VARDATA_ANY(holes_slice), holes_count * sizeof(bntamb1_t));
+            pfree(holes_slice);
+        }
+        return;
+    }
+
+    block_end_array = static_cast<uint32_t*>(palloc(std::max<size_t>(blocks, 1) * sizeof(uint32_t)));
+    auto slice = PG_DETOAST_DATUM_SLICE(datum, encoded_header_size, blocks * sizeof(uint32_t) + holes_bytes);
+    auto data = reinterpret_cast<const ubyte_t*>(VARDATA_ANY(slice));
+    memcpy(block_end_array, data, blocks * sizeof(uint32_t));
+    decode_holes(data + blocks * sizeof(uint32_t), hole_array, holes_count);
+    pfree(slice);
+}
+
+NucleotideSequence* StoredSequence::slice(size_t begin, size_t end) {
+    if (detoasted != nullptr)
+        return nuclseq_from_slice(detoasted->holes(), holes_count, detoasted->pac() + begin / 4, begin, end);
+
+    if (encoded) {
+        const bntamb1_t* holes = this->holes();
+        auto [first, last] = encoded_blocks_covering(holes, holes_count, begin, end);
+        if (first == last)
+            return nuclseq_decode_slice(holes, holes_count, len, block_end_array, nullptr, begin, end);
+
+        uint32_t runs_begin = first > 0 ? block_end_array[first - 1] : 0;
+        int32 runs_offset = encoded_header_size + blocks * sizeof(uint32_t) + holes_bytes + runs_begin;
+        auto runs_slice = PG_DETOAST_DATUM_SLICE(datum, runs_offset, block_end_array[last - 1] - runs_begin);
+        NucleotideSequence* nucls = nuclseq_decode_slice(holes, holes_count, len, block_end_array,
+                reinterpret_cast<const ubyte_t*>(VARDATA_ANY(runs_slice)), begin, end);
+        pfree(runs_slice);
+        return nucls;
+    }
+
+    if (end == begin)
+        return nuclseq_from_slice(holes(), holes_count, nullptr, begin, end);
+
+    int32 pac_offset = header_size + holes_count * sizeof(bntamb1_t) + begin / 4;
+    auto pac_slice = PG_DETOAST_DATUM_SLICE(datum, pac_offset, pac_byte_size(end) - begin / 4);
+    NucleotideSequence* nucls = nuclseq_from_slice(holes(), holes_count, reinterpret_cast<const ubyte_t*>(VARDATA_ANY(pac_slice)), begin, end);
+    pfree(pac_slice);
+    return nucls;
+}
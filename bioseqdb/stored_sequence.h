@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <postgres.h>
+#include <fmgr.h>
+}
+
+#include "encoding.h"
+#include "sequence.h"
+
+// Number of bases read at once when a stored sequence is scanned piece by piece, 1 MiB of packed data, the same as a
+// block of an encoded value.
+constexpr size_t stored_sequence_block_bases = encoded_block_bases;
+
+// Reads a stored sequence piece by piece. Values stored out of line without compression are read through slices, so
+// only the TOAST chunks holding the header, the holes and the requested bases are fetched, and memory use does not
+// grow with the length of the sequence. Encoded values are read the same way, decompressing only the blocks holding the
+// requested bases. Other values are small or compressed, and are detoasted and decoded once as a whole.
+class StoredSequence {
+public:
+    explicit StoredSequence(Datum datum);
+
+    uint32_t length() const { return len; }
+    uint32_t holes_num() const { return holes_count; }
+    // All holes of the sequence, read on first use. Even assemblies have few of them compared to bases.
+    const bntamb1_t* holes();
+
+    // Returns bases [begin, end) as a separate sequence.
+    NucleotideSequence* slice(size_t begin, size_t end);
+
+    // Calls f with consecutive pieces of the sequence and positions of their first bases, until it returns true.
+    // Pieces overlap by the given number of bases, so that matches up to one base longer are found within one piece.
+    template<typename F>
+    bool scan(size_t overlap, F f) {
+        if (detoasted != nullptr)
+            return f(*detoasted, 0);
+
+        for (size_t begin = 0; begin == 0 || begin + overlap < len; begin += stored_sequence_block_bases) {
+            size_t end = std::min<size_t>(begin + stored_sequence_block_bases + overlap, len);
+            NucleotideSequence* piece = slice(begin, end);
+            bool stop = f(*piece, begin);
+            pfree(piece);
+            if (stop)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    // Reads the holes of a value stored out of line, and the block ends of an encoded one.
+    void read_holes();
+
+    Datum datum;
+    const NucleotideSequence* detoasted;
+    bool encoded;
+    uint32_t len;
+    uint32_t holes_count;
+    uint32_t holes_bytes;
+    uint32_t blocks;
+    bntamb1_t* hole_array;
+    uint32_t* block_end_array;
+};
@@ -1,7 +1,12 @@
+import contextlib
 import os
+import io
+import random
+import struct
 import psycopg2
 import string
 import sys
+import time
 import traceback
 
 _status = 0
@@ -170,5 +175,596 @@ def nuclseq_content_rejects_empty_needle_on_empty_sequence(sql):
         failed = True
     assert failed
 
+@test
+def bwa_index_search_matches_adhoc_search(sql):
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, 'ACGTTGCAGGCTAGCTAGGATCGATCGATTACGGCATGCAAGTCCGATCGA'), (2, 'TTGACCGATGCAGTACGATCGATGCATGCNNNNGATCGTAGCTAGCTGAC');")
+    sql.execute("SELECT bwa_index_create('test_index_search', 'SELECT id, seq FROM refs');")
+    try:
+        sql.execute("SELECT * FROM nuclseq_search_bwa('GCAGTACGATCGATGCATGC', 'SELECT id, seq FROM refs');")
+        expected = sql.fetchall()
+        sql.execute("SELECT * FROM nuclseq_search_bwa_index('GCAGTACGATCGATGCATGC', 'test_index_search');")
+        assert sql.fetchall() == expected
+        assert len(expected) > 0
+    finally:
+        sql.execute("SELECT bwa_index_drop('test_index_search');")
+
+@test
+def bwa_index_cache_lists_mapped_index(sql):
+    sql.execute("SELECT bwa_index_create('test_index_cache', 'SELECT 1::BIGINT, ''ACGTTGCAGGCTAGCTAGGATCGATCGATTACGG''::NUCLSEQ');")
+    try:
+        sql.execute("SELECT count(*) FROM nuclseq_search_bwa_index('GCTAGCTAGGATCGATCGAT', 'test_index_cache');")
+        sql.execute("SELECT mapped_here, size_bytes > 0 FROM bwa_index_cache WHERE index_name = 'test_index_cache';")
+        assert sql.fetchone() == (True, True)
+    finally:
+        sql.execute("SELECT bwa_index_drop('test_index_cache');")
+    sql.execute("SELECT count(*) FROM bwa_index_cache WHERE index_name = 'test_index_cache' AND mapped_here;")
+    assert sql.fetchone() == (0,)
+
+@test
+def bwa_multi_search_threads_match_single_thread(sql):
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, 'ACGTTGCAGGCTAGCTAGGATCGATCGATTACGGCATGCAAGTCCGATCGA'), (2, 'TTGACCGATGCAGTACGATCGATGCATGCAAGGATCGTAGCTAGCTGAC');")
+    sql.execute("CREATE TEMPORARY TABLE queries (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO queries SELECT i, CASE WHEN i % 2 = 0 THEN 'GCAGTACGATCGATGCATGC' ELSE 'GCTAGCTAGGATCGATCGAT' END::NUCLSEQ FROM generate_series(1, 100) i;")
+    query = "SELECT query_id, ref_id, ref_match_start, cigar, score FROM nuclseq_multi_search_bwa('SELECT id, seq FROM queries', 'SELECT id, seq FROM refs', bwa_opts(threads => %s)) ORDER BY 1, 2, 3;"
+    sql.execute(query, (1,))
+    expected = sql.fetchall()
+    sql.execute(query, (4,))
+    assert sql.fetchall() == expected
+    assert len(expected) >= 100
+
+@test
+def bwa_index_rejects_invalid_name(sql):
+    failed = False
+    try:
+        sql.execute("SELECT bwa_index_create('../escape', 'SELECT 1::BIGINT, ''A''::NUCLSEQ');")
+    except psycopg2.Error as e:
+        assert 'invalid bwa index name: "../escape"' in e.pgerror
+        failed = True
+    assert failed
+
+@test
+def bwa_index_sa_interval_does_not_change_results(sql):
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, 'ACGTTGCAGGCTAGCTAGGATCGATCGATTACGGCATGCAAGTCCGATCGA'), (2, 'TTGACCGATGCAGTACGATCGATGCATGCNNNNGATCGTAGCTAGCTGAC');")
+    sql.execute("SELECT bwa_index_create('test_index_sa_interval', 'SELECT id, seq FROM refs', sa_interval => 1, threads => 4);")
+    try:
+        sql.execute("SELECT * FROM nuclseq_search_bwa('GCAGTACGATCGATGCATGC', 'SELECT id, seq FROM refs');")
+        expected = sql.fetchall()
+        sql.execute("SELECT * FROM nuclseq_search_bwa_index('GCAGTACGATCGATGCATGC', 'test_index_sa_interval');")
+        assert sql.fetchall() == expected
+    finally:
+        sql.execute("SELECT bwa_index_drop('test_index_sa_interval');")
+
+@test
+def bwa_multi_search_stops_early_under_limit(sql):
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, 'ACGTTGCAGGCTAGCTAGGATCGATCGATTACGGCATGCAAGTCCGATCGA');")
+    sql.execute("CREATE TEMPORARY TABLE queries (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO queries SELECT i, 'GCTAGCTAGGATCGATCGAT' FROM generate_series(1, 1000) i;")
+    sql.execute("SELECT (r).query_id FROM (SELECT nuclseq_multi_search_bwa('SELECT id, seq FROM queries ORDER BY id', 'SELECT id, seq FROM refs') AS r) s LIMIT 3;")
+    assert sql.fetchall() == [(1,), (2,), (3,)]
+    sql.execute("SELECT count(*) FROM nuclseq_multi_search_bwa('SELECT id, seq FROM queries', 'SELECT id, seq FROM refs');")
+    assert sql.fetchone() == (1000,)
+
+@test
+def bwa_search_ref_subseq_keeps_holes_of_later_references(sql):
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, 'ACGTNNNTTGCAGGCTAGCTAGGATCGATCGATTACGGCATGCAAGTCCGATCGA'), (2, 'TTGACCGATGCAGTACGATCGATGCATGCNNNNGATCGTAGCTAGCTGAC');")
+    sql.execute("SELECT bwa_index_create('test_index_holes', 'SELECT id, seq FROM refs');")
+    try:
+        for search in ("nuclseq_search_bwa(%s, 'SELECT id, seq FROM refs')", "nuclseq_search_bwa_index(%s, 'test_index_holes')"):
+            sql.execute("SELECT r.ref_id, r.ref_subseq::TEXT, nuclseq_substring(refs.seq, r.ref_match_start + 1, r.ref_match_len)::TEXT FROM " + search + " r JOIN refs ON refs.id = r.ref_id;", ('GCAGTACGATCGATGCATGCAAGGATCGTAGCTAGC',))
+            rows = sql.fetchall()
+            assert any(ref_id == 2 and 'NNNN' in subseq for ref_id, subseq, _ in rows)
+            assert all(subseq == expected for _, subseq, expected in rows)
+    finally:
+        sql.execute("SELECT bwa_index_drop('test_index_holes');")
+
+def random_nuclseqs(count, max_len):
+    rng = random.Random(7)
+    seqs = []
+    for _ in range(count):
+        seq = ''
+        target_len = rng.randrange(max_len)
+        while len(seq) < target_len:
+            symbol = rng.choice('NWSMKRYBDHV') if rng.random() < 0.1 else rng.choice('ACGT')
+            seq += symbol * (rng.randrange(1, 6) if symbol not in 'ACGT' else 1)
+        seqs.append(seq)
+    return seqs
+
+def random_refs(rng, count, length):
+    return [(i, ''.join(rng.choices('ACGT', k=length))) for i in range(1, count + 1)]
+
+def create_nuclseq_table(sql, name, rows, temporary=True):
+    sql.execute(f"CREATE {'TEMPORARY ' if temporary else ''}TABLE {name} (id BIGINT, seq NUCLSEQ);")
+    sql.executemany(f"INSERT INTO {name} VALUES (%s, %s);", rows)
+
+# Creates a bwa index for the duration of the block, passing options as named arguments of bwa_index_create.
+@contextlib.contextmanager
+def bwa_index(sql, name, reference_sql, **options):
+    named = ''.join(f", {option} => %s" for option in options)
+    sql.execute(f"SELECT bwa_index_create(%s, %s{named});", (name, reference_sql, *options.values()))
+    try:
+        yield name
+    finally:
+        sql.execute("SELECT bwa_index_drop(%s);", (name,))
+
+COMPLEMENTS = str.maketrans('ACGTNWSMKRYBDHV', 'TGCANWSKMYRVHDB')
+
+@test
+def nuclseq_kernels_match_reference(sql):
+    # Lengths cover every remainder modulo 4 and are long enough to reach the vectorized loops.
+    for seq in random_nuclseqs(200, 300):
+        sql.execute("SELECT nuclseq_reverse(%s)::TEXT, nuclseq_complement(%s)::TEXT, nuclseq_content(%s, 'A'), nuclseq_content(%s, 'G');", (seq,) * 4)
+        reverse, complement, content_a, content_g = sql.fetchone()
+        assert reverse == seq[::-1]
+        assert complement == seq.translate(COMPLEMENTS)
+        if seq:
+            assert round(content_a * len(seq)) == seq.count('A')
+            assert round(content_g * len(seq)) == seq.count('G')
+
+@test
+def nuclseq_reverse_and_complement_are_canonical(sql):
+    for seq in random_nuclseqs(50, 100):
+        sql.execute("SELECT nuclseq_hash(nuclseq_reverse(%s)) = nuclseq_hash(%s), nuclseq_hash(nuclseq_complement(%s)) = nuclseq_hash(%s);", (seq, seq[::-1], seq, seq.translate(COMPLEMENTS)))
+        assert sql.fetchone() == (True, True)
+
+def nuclseq_sort_key(seq):
+    return [('ACGT'.index(symbol), '') if symbol in 'ACGT' else (4, symbol) for symbol in seq]
+
+@test
+def nuclseq_holes_are_compared(sql):
+    sql.execute("SELECT 'ANA'::NUCLSEQ = 'ANA', 'ANA'::NUCLSEQ = 'AAA', 'ANA'::NUCLSEQ = 'ATA', 'ANA'::NUCLSEQ > 'ATA', 'ANA'::NUCLSEQ < 'AWA';")
+    assert sql.fetchone() == (True, False, False, True, True)
+
+@test
+def nuclseq_order_matches_reference(sql):
+    seqs = random_nuclseqs(200, 40) + ['', 'A', 'AA', 'AN', 'ANN', 'N', 'T', 'TN']
+    sql.execute("SELECT s::TEXT FROM unnest(%s::NUCLSEQ[]) s ORDER BY s;", (seqs,))
+    assert [row[0] for row in sql.fetchall()] == sorted(seqs, key=nuclseq_sort_key)
+
+@test
+def nuclseq_hash_is_consistent_with_equality(sql):
+    seqs = random_nuclseqs(100, 40)
+    sql.execute("SELECT nuclseq_hash(s), nuclseq_hash_extended(s, 0) & 4294967295, nuclseq_hash(nuclseq_complement(nuclseq_complement(s))) FROM unnest(%s::NUCLSEQ[]) s;", (seqs,))
+    for hash, extended, roundtrip in sql.fetchall():
+        assert hash & 0xFFFFFFFF == extended == roundtrip & 0xFFFFFFFF
+    sql.execute("SET LOCAL enable_mergejoin = off; SET LOCAL enable_nestloop = off;")
+    sql.execute("SELECT count(*) FROM unnest(%s::NUCLSEQ[]) a JOIN unnest(%s::NUCLSEQ[]) b ON a = nuclseq_reverse(nuclseq_reverse(b));", (seqs, seqs))
+    assert sql.fetchone() == (sum(seqs.count(seq) for seq in seqs),)
+
+@test
+def nuclseq_sort_with_abbreviated_keys(sql):
+    # Enough rows for the cardinality check to run, half of them sharing a prefix longer than the abbreviated key.
+    seqs = random_nuclseqs(10000, 60) + ['ACGT' * 10 + seq for seq in random_nuclseqs(10000, 20)]
+    sql.execute("CREATE TEMPORARY TABLE seqs (seq NUCLSEQ);")
+    sql.execute("INSERT INTO seqs SELECT unnest(%s::NUCLSEQ[]);", (seqs,))
+    expected = sorted(seqs, key=nuclseq_sort_key)
+    sql.execute("SELECT seq::TEXT FROM seqs ORDER BY seq;")
+    assert [row[0] for row in sql.fetchall()] == expected
+    sql.execute("CREATE INDEX ON seqs (seq);")
+    sql.execute("SET LOCAL enable_seqscan = off; SET LOCAL enable_bitmapscan = off;")
+    sql.execute("SELECT seq::TEXT FROM seqs ORDER BY seq;")
+    assert [row[0] for row in sql.fetchall()] == expected
+
+def binary_copy(values):
+    data = b'PGCOPY\n\xff\r\n\0' + struct.pack('!ii', 0, 0)
+    for value in values:
+        data += struct.pack('!hi', 1, len(value)) + value
+    return io.BytesIO(data + struct.pack('!h', -1))
+
+@test
+def nuclseq_send_uses_packed_format(sql):
+    sql.execute("SELECT nuclseq_send('ACGTNNA');")
+    assert bytes(sql.fetchone()[0])[:17] == struct.pack('!IIIIB', 7, 1, 4, 2, ord('N'))
+
+@test
+def nuclseq_binary_copy_roundtrip(sql):
+    seqs = random_nuclseqs(100, 100)
+    sql.execute("CREATE TEMPORARY TABLE src (seq NUCLSEQ);")
+    sql.execute("CREATE TEMPORARY TABLE dst (seq NUCLSEQ);")
+    sql.execute("INSERT INTO src SELECT unnest(%s::NUCLSEQ[]);", (seqs,))
+    data = io.BytesIO()
+    sql.copy_expert("COPY src TO STDOUT WITH (FORMAT binary);", data)
+    data.seek(0)
+    sql.copy_expert("COPY dst FROM STDIN WITH (FORMAT binary);", data)
+    sql.execute("SELECT seq::TEXT, nuclseq_hash(seq) = nuclseq_hash(seq::TEXT::NUCLSEQ) FROM dst;")
+    assert sql.fetchall() == [(seq, True) for seq in seqs]
+
+@test
+def nuclseq_recv_rejects_invalid_holes(sql):
+    sql.execute("CREATE TEMPORARY TABLE dst (seq NUCLSEQ);")
+    invalid = [
+        struct.pack('!IIIIB', 4, 1, 2, 3, ord('N')) + b'\0',
+        struct.pack('!IIIIB', 4, 1, 0, 1, ord('A')) + b'\0',
+        struct.pack('!IIIIBIIB', 4, 2, 0, 1, ord('N'), 1, 1, ord('N')) + b'\0',
+    ]
+    for value in invalid:
+        failed = False
+        try:
+            sql.copy_expert("COPY dst FROM STDIN WITH (FORMAT binary);", binary_copy([value]))
+        except psycopg2.Error as e:
+            assert 'nuclseq_recv' in e.pgerror
+            failed = True
+        assert failed
+        test.rollback()
+        sql.execute("CREATE TEMPORARY TABLE dst (seq NUCLSEQ);")
+
+def kmers(seq):
+    return {seq[i:i + 12] for i in range(len(seq) - 11) if set(seq[i:i + 12]) <= set('ACGT')}
+
+def kmer_similarity(a, b):
+    a, b = kmers(a), kmers(b)
+    return len(a & b) / len(a | b) if a and b else 0
+
+@test
+def nuclseq_contains_matches_reference(sql):
+    seqs = random_nuclseqs(100, 300)
+    motifs = [seq[i:i + 20] for seq in seqs[:20] for i in (0, len(seq) // 2)] + ['ACGTACGTACGTACGT', 'NN', 'A', '']
+    sql.execute("SELECT a::TEXT, b::TEXT, a @> b FROM unnest(%s::NUCLSEQ[]) a, unnest(%s::NUCLSEQ[]) b;", (seqs, motifs))
+    for a, b, contains in sql.fetchall():
+        assert contains == (b in a)
+
+@test
+def nuclseq_gin_index_matches_seqscan(sql):
+    # Sequences share halves, so that similarity queries have matches other than the query itself.
+    halves = random_nuclseqs(200, 150)
+    seqs = [a + b for a, b in zip(halves, halves[1:] + halves[:1])]
+    motifs = [seq[len(seq) // 3:len(seq) // 3 + 16] for seq in seqs[:20]] + ['ACGTAC', 'ANNA', 'GGGGGGGGGGGGGGGGGGG']
+    sql.execute("CREATE TEMPORARY TABLE seqs (id INTEGER, seq NUCLSEQ);")
+    sql.execute("INSERT INTO seqs SELECT i, s FROM unnest(%s::NUCLSEQ[]) WITH ORDINALITY u(s, i);", (seqs,))
+    sql.execute("CREATE INDEX ON seqs USING gin (seq nuclseq_gin_kmer_operators);")
+    sql.execute("SET LOCAL enable_seqscan = off;")
+    for motif in motifs:
+        sql.execute("SELECT id FROM seqs WHERE seq @> %s ORDER BY id;", (motif,))
+        assert [row[0] for row in sql.fetchall()] == [i + 1 for i, seq in enumerate(seqs) if motif in seq]
+    for query in seqs[:20]:
+        sql.execute("SELECT id FROM seqs WHERE seq %% %s ORDER BY id;", (query,))
+        assert [row[0] for row in sql.fetchall()] == [i + 1 for i, seq in enumerate(seqs) if kmer_similarity(seq, query) >= 0.3]
+
+def substring(seq, start, count=None):
+    stop = len(seq) + 1 if count is None else start + count
+    begin = min(max(start, 1), len(seq) + 1) - 1
+    return seq[begin:max(min(max(stop, 1), len(seq) + 1) - 1, begin)]
+
+@test
+def nuclseq_substring_matches_reference(sql):
+    rng = random.Random(3)
+    for seq in random_nuclseqs(100, 100):
+        start, count = rng.randrange(-5, len(seq) + 5), rng.randrange(0, 20)
+        expected = substring(seq, start, count)
+        sql.execute("SELECT nuclseq_substring(%s, %s, %s)::TEXT, nuclseq_substring(%s, %s)::TEXT, nuclseq_hash(nuclseq_substring(%s, %s, %s)) = nuclseq_hash(%s);", (seq, start, count, seq, start, seq, start, count, expected))
+        assert sql.fetchone() == (expected, substring(seq, start), True)
+
+@test
+def nuclseq_substring_reads_toasted_slices(sql):
+    # Large enough to be stored out of line in many TOAST chunks, with windows starting at every base within a byte.
+    seq = ''.join(random_nuclseqs(400, 5000))
+    sql.execute("CREATE TEMPORARY TABLE chromosomes (seq NUCLSEQ);")
+    sql.execute("INSERT INTO chromosomes VALUES (%s);", (seq,))
+    for start in (1, 2, 3, 4, 5, len(seq) // 2 + 1, len(seq) - 999):
+        sql.execute("SELECT nuclseq_substring(seq, %s, 1000)::TEXT, nuclseq_substring(seq, %s, 1000) = %s::NUCLSEQ FROM chromosomes;", (start, start, seq[start - 1:start + 999]))
+        assert sql.fetchone() == (seq[start - 1:start + 999], True)
+
+@test
+def nuclseq_substring_rejects_negative_length(sql):
+    failed = False
+    try:
+        sql.execute("SELECT nuclseq_substring('ACGT', 1, -1);")
+    except psycopg2.DataError as e:
+        assert 'negative substring length not allowed' in e.pgerror
+        failed = True
+    assert failed
+
+@test
+def nuclseq_position_matches_reference(sql):
+    seqs = random_nuclseqs(50, 200)
+    for seq in seqs:
+        for motif in (seq[len(seq) // 2:len(seq) // 2 + 10], seq[-3:], 'ACGTT', 'NN', ''):
+            sql.execute("SELECT nuclseq_position(%s, %s);", (seq, motif))
+            assert sql.fetchone() == (seq.find(motif) + 1,)
+
+@test
+def nuclseq_functions_read_long_sequences_in_blocks(sql):
+    # Longer than one 4M-base block, with motifs crossing the block boundary.
+    rng = random.Random(11)
+    seq = ''.join(rng.choices('ACGT', k=5_000_000))
+    seq = seq[:1000] + 'N' * 50 + seq[1050:]
+    sql.execute("CREATE TEMPORARY TABLE chromosomes (seq NUCLSEQ);")
+    sql.execute("INSERT INTO chromosomes VALUES (%s);", (seq,))
+    sql.execute("SELECT nuclseq_len(seq), nuclseq_content(seq, 'G'), nuclseq_content(seq, 'N') FROM chromosomes;")
+    assert sql.fetchone() == (len(seq), seq.count('G') / len(seq), 50 / len(seq))
+    for start in (990, 4 * 2**20 - 10, 4 * 2**20, len(seq) - 30):
+        motif = seq[start:start + 30]
+        sql.execute("SELECT nuclseq_position(seq, %s) FROM chromosomes;", (motif,))
+        assert sql.fetchone() == (seq.find(motif) + 1,)
+
+@test
+def bwa_paired_search_finds_proper_pairs(sql):
+    rng = random.Random(5)
+    ref = ''.join(rng.choices('ACGT', k=20000))
+    pairs = []
+    for i in range(300):
+        start, insert_size = rng.randrange(0, len(ref) - 400), rng.randrange(250, 350)
+        first = ref[start:start + 70]
+        second = ref[start + insert_size - 70:start + insert_size][::-1].translate(COMPLEMENTS)
+        pairs.append((i, first, second, start, insert_size))
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (1, %s);", (ref,))
+    sql.execute("CREATE TEMPORARY TABLE pairs (id BIGINT, first NUCLSEQ, second NUCLSEQ);")
+    sql.executemany("INSERT INTO pairs VALUES (%s, %s, %s);", [pair[:3] for pair in pairs])
+    sql.execute("SELECT query_id, mate, ref_match_start, is_reverse, insert_size FROM nuclseq_multi_search_bwa_paired('SELECT id, first, second FROM pairs', 'SELECT id, seq FROM refs') WHERE is_proper_pair ORDER BY 1, 2;")
+    expected = []
+    for i, _, _, start, insert_size in pairs:
+        expected.append((i, 1, start, False, insert_size))
+        expected.append((i, 2, start + insert_size - 70, True, insert_size))
+    assert sql.fetchall() == expected
+
+@test
+def bwa_sam_export_lists_alignments(sql):
+    rng = random.Random(8)
+    ref = ''.join(rng.choices('ACGT', k=5000))
+    queries = []
+    for i in range(40):
+        start = rng.randrange(0, len(ref) - 70)
+        query = ref[start:start + 70]
+        queries.append((i, query if i % 2 == 0 else query[::-1].translate(COMPLEMENTS), start))
+    sql.execute("CREATE TEMPORARY TABLE refs (id BIGINT, seq NUCLSEQ);")
+    sql.execute("INSERT INTO refs VALUES (7, %s);", (ref,))
+    sql.execute("CREATE TEMPORARY TABLE queries (id BIGINT, seq NUCLSEQ);")
+    sql.executemany("INSERT INTO queries VALUES (%s, %s);", [query[:2] for query in queries] + [(40, 'ACGTACGTAC')])
+    with bwa_index(sql, 'test_index_sam', 'SELECT id, seq FROM refs'):
+        sql.execute("SELECT nuclseq_sam_bwa_index('SELECT id, seq FROM queries', 'test_index_sam');")
+        lines = [line for line, in sql.fetchall()]
+    header = [line for line in lines if line.startswith('@')]
+    assert header[0].startswith('@HD') and '@SQ\tSN:7\tLN:5000' in header
+    records = {int(fields[0]): fields for fields in (line.split('\t') for line in lines if not line.startswith('@'))}
+    assert len(records) == 41
+    for i, query, start in queries:
+        name, flag, rname, pos, _, cigar, _, _, _, seq = records[i][:10]
+        assert (int(flag), rname, int(pos), cigar, seq) == (16 * (i % 2), '7', start + 1, '70M', ref[start:start + 70])
+    assert int(records[40][1]) == 4
+
+@test
+def nuclseq_encodes_gaps_and_repeats(sql):
+    rng = random.Random(12)
+    seq = ''.join(rng.choices('ACGT', k=40000)) + 'N' * 200000 + ''.join(rng.choices('ACGT', k=40000)) + 'A' * 400000 + 'CAG' * 1000
+    sql.execute("CREATE TEMPORARY TABLE assemblies (seq NUCLSEQ);")
+    sql.execute("INSERT INTO assemblies VALUES (%s), ('ACGTTGCA');", (seq,))
+    sql.execute("SELECT pg_column_size(seq), seq::TEXT, seq = nuclseq_complement(nuclseq_complement(seq)) FROM assemblies ORDER BY nuclseq_len(seq) DESC;")
+    (size, text, equal), _ = sql.fetchall()
+    assert size < len(seq) // 20 and text == seq and equal
+    sql.execute("SELECT nuclseq_len(seq), nuclseq_content(seq, 'N') FROM assemblies WHERE nuclseq_len(seq) > 8;")
+    assert sql.fetchone() == (len(seq), 200000 / len(seq))
+    for start, count in ((39990, 20), (239990, 30), (0, 100), (279990, 400020), (len(seq) - 10, 10)):
+        sql.execute("SELECT nuclseq_substring(seq, %s, %s)::TEXT FROM assemblies WHERE nuclseq_len(seq) > 8;", (start + 1, count))
+        assert sql.fetchone() == (seq[start:start + count],)
+    motif = seq[279990:280010]
+    sql.execute("SELECT nuclseq_position(seq, %s) FROM assemblies WHERE nuclseq_len(seq) > 8;", (motif,))
+    assert sql.fetchone() == (seq.find(motif) + 1,)
+    sql.execute("CREATE TEMPORARY TABLE derived AS SELECT nuclseq_complement(seq) AS complement, nuclseq_reverse(seq) AS reverse, nuclseq_substring(seq, 2) AS suffix FROM assemblies WHERE nuclseq_len(seq) > 8;")
+    sql.execute("SELECT pg_column_size(complement), pg_column_size(reverse), pg_column_size(suffix), complement::TEXT FROM derived;")
+    *sizes, complement = sql.fetchone()
+    assert all(size < len(seq) // 20 for size in sizes) and complement == seq.translate(COMPLEMENTS)
+
+@test
+def bwa_index_append_and_merge_keep_search_results(sql):
+    refs = random_refs(random.Random(21), 6, 3000)
+    queries = [(i, ref[start:start + 80]) for i, (_, ref) in enumerate(refs) for start in (100, 2000)]
+    create_nuclseq_table(sql, 'refs', refs)
+    create_nuclseq_table(sql, 'queries', queries)
+    search = "SELECT query_id, ref_id, ref_match_start, is_primary, cigar FROM nuclseq_multi_search_bwa_index('SELECT id, seq FROM queries', 'test_index_segments') ORDER BY 1, 2, 3;"
+    sql.execute("SELECT query_id, ref_id, ref_match_start, is_primary, cigar FROM nuclseq_multi_search_bwa('SELECT id, seq FROM queries', 'SELECT id, seq FROM refs') ORDER BY 1, 2, 3;")
+    expected = sql.fetchall()
+    with bwa_index(sql, 'test_index_segments', 'SELECT id, seq FROM refs WHERE id <= 2'):
+        sql.execute("SELECT bwa_index_append('test_index_segments', 'SELECT id, seq FROM refs WHERE id BETWEEN 3 AND 4');")
+        sql.execute("SELECT bwa_index_append('test_index_segments', 'SELECT id, seq FROM refs WHERE id > ' || (SELECT max(max_ref_id) FROM bwa_index_segments('test_index_segments')));")
+        sql.execute("SELECT segment, sequences, max_ref_id FROM bwa_index_segments('test_index_segments');")
+        assert sql.fetchall() == [(0, 2, 2), (1, 2, 4), (2, 2, 6)]
+        sql.execute(search)
+        assert sql.fetchall() == expected
+        sql.execute("SELECT bwa_index_merge('test_index_segments');")
+        sql.execute("SELECT segment, sequences, max_ref_id FROM bwa_index_segments('test_index_segments');")
+        assert sql.fetchall() == [(0, 6, 6)]
+        sql.execute(search)
+        assert sql.fetchall() == expected
+
+def wait_for_build(sql, build_id):
+    for _ in range(600):
+        sql.execute("SELECT status, sequences, bases, error FROM bwa_index_builds WHERE build_id = %s;", (build_id,))
+        status = sql.fetchone()
+        _conn.commit()
+        if status[0] not in ('queued', 'running'):
+            break
+        time.sleep(0.1)
+    return status
+
+@test
+def bwa_index_create_async_builds_in_background(sql):
+    sql.execute("SHOW shared_preload_libraries;")
+    if 'bioseqdb' not in sql.fetchone()[0]:
+        try:
+            sql.execute("SELECT bwa_index_create_async('test_index_async', 'SELECT 1, ''ACGT''::NUCLSEQ');")
+            assert False
+        except psycopg2.errors.ObjectNotInPrerequisiteState as e:
+            assert 'shared_preload_libraries' in e.pgerror
+        return
+    refs = random_refs(random.Random(22), 4, 2000)
+    create_nuclseq_table(sql, 'test_async_refs', refs, temporary=False)
+    sql.execute("SELECT bwa_index_create_async('test_index_async', 'SELECT id, seq FROM test_async_refs');")
+    build_id = sql.fetchone()[0]
+    _conn.commit()
+    try:
+        assert wait_for_build(sql, build_id) == ('done', 4, 8000, None)
+        sql.execute("SELECT ref_id, ref_match_start FROM nuclseq_search_bwa_index(%s, 'test_index_async');", (refs[2][1][500:600],))
+        assert sql.fetchall() == [(3, 500)]
+        sql.execute("SELECT bwa_index_build_cancel(%s);", (build_id,))
+        assert sql.fetchone() == (False,)
+    finally:
+        _conn.rollback()
+        sql.execute("SELECT bwa_index_drop('test_index_async') FROM bwa_index_builds WHERE build_id = %s AND status = 'done';", (build_id,))
+        sql.execute("DELETE FROM bwa_index_build_queue WHERE build_id = %s;", (build_id,))
+        sql.execute("DROP TABLE test_async_refs;")
+        _conn.commit()
+
+@test
+def bwa_index_merge_async_merges_in_background(sql):
+    sql.execute("SHOW shared_preload_libraries;")
+    if 'bioseqdb' not in sql.fetchone()[0]:
+        return
+    refs = random_refs(random.Random(23), 4, 2000)
+    create_nuclseq_table(sql, 'test_merge_async_refs', refs, temporary=False)
+    sql.execute("SELECT bwa_index_create('test_index_merge_async', 'SELECT id, seq FROM test_merge_async_refs WHERE id <= 2');")
+    sql.execute("SELECT bwa_index_append('test_index_merge_async', 'SELECT id, seq FROM test_merge_async_refs WHERE id > 2');")
+    sql.execute("SELECT bwa_index_merge_async('test_index_merge_async');")
+    build_id = sql.fetchone()[0]
+    _conn.commit()
+    try:
+        assert wait_for_build(sql, build_id) == ('done', 2, 4000, None)
+        sql.execute("SELECT segment, sequences, shard FROM bwa_index_segments('test_index_merge_async');")
+        assert sql.fetchall() == [(0, 4, 0)]
+        sql.execute("SELECT ref_id, ref_match_start FROM nuclseq_search_bwa_index(%s, 'test_index_merge_async');", (refs[3][1][500:600],))
+        assert sql.fetchall() == [(4, 500)]
+    finally:
+        _conn.rollback()
+        sql.execute("SELECT bwa_index_drop('test_index_merge_async');")
+        sql.execute("DELETE FROM bwa_index_build_queue WHERE build_id = %s;", (build_id,))
+        sql.execute("DROP TABLE test_merge_async_refs;")
+        _conn.commit()
+
+@test
+def bwa_index_build_queue_rows_belong_to_submitter(sql):
+    sql.execute("SELECT current_user;")
+    submitter = sql.fetchone()[0]
+    sql.execute("CREATE ROLE bioseqdb_test_intruder;")
+    sql.execute("INSERT INTO bwa_index_build_queue (index_name, reference_sql, sa_interval, threads) VALUES ('test_index_queue', 'SELECT 1, ''ACGT''::NUCLSEQ', 32, 1) RETURNING build_id;")
+    build_id = sql.fetchone()[0]
+    sql.execute("SET ROLE bioseqdb_test_intruder;")
+    for statement, args in [
+        ("UPDATE bwa_index_build_queue SET reference_sql = 'SELECT 2, ''ACGT''::NUCLSEQ' WHERE build_id = %s;", (build_id,)),
+        ("INSERT INTO bwa_index_build_queue (index_name, reference_sql, sa_interval, threads, submitted_by) VALUES ('test_index_queue', 'SELECT 1', 32, 1, %s::REGROLE);", (submitter,)),
+    ]:
+        sql.execute("SAVEPOINT intrusion;")
+        try:
+            sql.execute(statement, args)
+            assert False
+        except psycopg2.errors.InsufficientPrivilege:
+            sql.execute("ROLLBACK TO SAVEPOINT intrusion;")
+    sql.execute("UPDATE bwa_index_build_queue SET status = 'cancelled' WHERE build_id = %s;", (build_id,))
+    assert sql.rowcount == 0
+    sql.execute("DELETE FROM bwa_index_build_queue WHERE build_id = %s;", (build_id,))
+    assert sql.rowcount == 0
+    sql.execute("SELECT bwa_index_build_cancel(%s);", (build_id,))
+    assert sql.fetchone() == (False,)
+    sql.execute("RESET ROLE;")
+    sql.execute("SELECT status, reference_sql FROM bwa_index_build_queue WHERE build_id = %s;", (build_id,))
+    assert sql.fetchone() == ('queued', "SELECT 1, 'ACGT'::NUCLSEQ")
+
+@test
+def bwa_index_management_needs_grant(sql):
+    sql.execute("CREATE ROLE bioseqdb_test_intruder;")
+    sql.execute("SET ROLE bioseqdb_test_intruder;")
+    for statement in [
+        "SELECT bwa_index_create('test_index_grant', 'SELECT 1, ''ACGT''::NUCLSEQ');",
+        "SELECT bwa_index_append('test_index_grant', 'SELECT 1, ''ACGT''::NUCLSEQ');",
+        "SELECT bwa_index_merge('test_index_grant');",
+        "SELECT bwa_index_merge_async('test_index_grant');",
+        "SELECT bwa_index_drop('test_index_grant');",
+    ]:
+        sql.execute("SAVEPOINT intrusion;")
+        try:
+            sql.execute(statement)
+            assert False
+        except psycopg2.errors.InsufficientPrivilege:
+            sql.execute("ROLLBACK TO SAVEPOINT intrusion;")
+
+@test
+def bwa_index_shards_keep_search_results(sql):
+    refs = random_refs(random.Random(23), 6, 3000)
+    queries = [(i, ref[start:start + 80]) for i, (_, ref) in enumerate(refs) for start in (100, 2000)]
+    create_nuclseq_table(sql, 'test_shard_refs', refs, temporary=False)
+    create_nuclseq_table(sql, 'test_shard_queries', queries, temporary=False)
+    search = "SELECT query_id, ref_id, ref_match_start, is_primary, cigar FROM nuclseq_multi_search_bwa_index('SELECT id, seq FROM test_shard_queries', 'test_index_shards') ORDER BY 1, 2, 3;"
+    sql.execute("SELECT query_id, ref_id, ref_match_start, is_primary, cigar FROM nuclseq_multi_search_bwa('SELECT id, seq FROM test_shard_queries', 'SELECT id, seq FROM test_shard_refs') ORDER BY 1, 2, 3;")
+    expected = sql.fetchall()
+    with bwa_index(sql, 'test_index_shards', 'SELECT id, seq FROM test_shard_refs', shard_bases=6000):
+        sql.execute("SELECT segment, sequences, max_ref_id, shard FROM bwa_index_segments('test_index_shards');")
+        assert sql.fetchall() == [(0, 2, 2, 0), (0, 2, 4, 1), (0, 2, 6, 2)]
+        sql.execute(search)
+        assert sql.fetchall() == expected
+        sql.execute("SELECT proparallel FROM pg_proc WHERE proname = 'nuclseq_search_bwa_index';")
+        assert sql.fetchone() == ('s',)
+        sql.execute("SET LOCAL parallel_setup_cost = 0;")
+        sql.execute("SET LOCAL parallel_tuple_cost = 0;")
+        sql.execute("SET LOCAL min_parallel_table_scan_size = 0;")
+        sql.execute("SELECT q.id, r.ref_id, r.ref_match_start, r.is_primary, r.cigar FROM test_shard_queries q, LATERAL nuclseq_search_bwa_index(q.seq, 'test_index_shards') r ORDER BY 1, 2, 3;")
+        assert sql.fetchall() == expected
+        try:
+            sql.execute("SELECT * FROM nuclseq_multi_search_bwa_paired_index('SELECT id, seq, seq FROM test_shard_queries', 'test_index_shards');")
+            assert False
+        except psycopg2.errors.FeatureNotSupported:
+            test.rollback()
+
+@test
+def bwa_index_merge_starts_new_shards(sql):
+    refs = random_refs(random.Random(24), 4, 3000)
+    create_nuclseq_table(sql, 'refs', refs)
+    with bwa_index(sql, 'test_index_shard_merge', 'SELECT id, seq FROM refs WHERE id <= 2'):
+        sql.execute("SELECT bwa_index_append('test_index_shard_merge', 'SELECT id, seq FROM refs WHERE id > 2');")
+        sql.execute("SELECT bwa_index_merge('test_index_shard_merge', shard_bases => 6000);")
+        sql.execute("SELECT segment, sequences, max_ref_id, shard FROM bwa_index_segments('test_index_shard_merge');")
+        assert sql.fetchall() == [(0, 2, 2, 0), (0, 2, 4, 1)]
+        sql.execute("SELECT ref_id, ref_match_start FROM nuclseq_search_bwa_index(%s, 'test_index_shard_merge');", (refs[3][1][500:600],))
+        assert sql.fetchall() == [(4, 500)]
+
+@test
+def nuclseq_search_exact_bwa_index_finds_near_matches(sql):
+    refs = random_refs(random.Random(25), 4, 3000)
+    create_nuclseq_table(sql, 'refs', refs)
+    with bwa_index(sql, 'test_index_exact', 'SELECT id, seq FROM refs'):
+        search = "SELECT ref_id, ref_match_start, is_reverse, mismatches FROM nuclseq_search_exact_bwa_index(%s, 'test_index_exact', %s);"
+        query = refs[1][1][700:730]
+        sql.execute(search, (query, 0))
+        assert sql.fetchall() == [(2, 700, False, 0)]
+        sql.execute(search, (query[::-1].translate(COMPLEMENTS), 0))
+        assert sql.fetchall() == [(2, 700, True, 0)]
+        mutated = query[:10] + query[10].translate(COMPLEMENTS) + query[11:20] + 'N' + query[21:]
+        sql.execute(search, (mutated, 1))
+        assert sql.fetchall() == []
+        sql.execute(search, (mutated, 2))
+        assert sql.fetchall() == [(2, 700, False, 2)]
+        sql.execute("SELECT count(*) FROM nuclseq_search_exact_bwa_index(%s, 'test_index_exact', 0, 0);", (query,))
+        assert sql.fetchone() == (0,)
+
+@test
+def nuclseq_align_sw_aligns_pairs(sql):
+    rng = random.Random(26)
+    target = ''.join(rng.choices('ACGT', k=500))
+    align = "SELECT score, cigar, query_match_start, query_match_end, target_match_start, target_match_end FROM nuclseq_align_sw(%s, %s);"
+    sql.execute(align, (target[100:160], target))
+    assert sql.fetchone() == (60, '60M', 0, 60, 100, 160)
+    gap = next(i for i in range(130, 150) if target[i - 1] != target[i] != target[i + 1])
+    sql.execute(align, (target[100:gap] + target[gap + 1:160], target))
+    assert sql.fetchone() == (52, f'{gap - 100}M1D{159 - gap}M', 0, 59, 100, 160)
+    prefix = ''.join('ACGT'[('ACGT'.index(base) + 1) % 4] for base in target[190:200])
+    sql.execute(align, (prefix + target[200:240], target))
+    assert sql.fetchone() == (40, '10S40M', 10, 50, 200, 240)
+    sql.execute("SELECT nuclseq_align_sw('AAAA', 'CCCC') IS NULL;")
+    assert sql.fetchone() == (True,)
+
+@test
+def nuclseq_search_sw_aligns_against_rows(sql):
+    refs = random_refs(random.Random(27), 4, 1000)
+    create_nuclseq_table(sql, 'refs', refs)
+    query = refs[2][1][300:380]
+    sql.execute("SELECT target_id, score, cigar, target_match_start FROM nuclseq_search_sw(%s, 'SELECT id, seq FROM refs') WHERE score >= 40;", (query,))
+    assert sql.fetchall() == [(3, 80, '80M', 300)]
+    sql.execute("SELECT r.id, (a).score FROM (SELECT id, nuclseq_align_sw(%s, seq) a FROM refs) r ORDER BY 1;", (query,))
+    lateral = sql.fetchall()
+    sql.execute("SELECT target_id, score FROM nuclseq_search_sw(%s, 'SELECT id, seq FROM refs') ORDER BY 1;", (query,))
+    assert sql.fetchall() == lateral
+
 _conn.close()
 sys.exit(_status)